@@ -203,6 +203,159 @@ void detect_aircraft_filename(void) {
 }
 
 
+// Settings from XTextureExtractor.cfg, each line is "<key> <value>" and # starts a comment
+int config_capture_mode = CAPTURE_MODE_PBO;
+int config_encode_threads = 0; // 0 picks one less than the number of cores
+int config_keepalive_msec = NETWORK_KEEPALIVE_MSEC; // 0 only sends windows when they change
+int config_keyframe_msec = DELTA_KEYFRAME_MSEC; // 0 only sends keyframes when a client asks for one
+char config_multicast_group[64] = ""; // Empty when multicast is turned off
+int config_multicast_port = MULTICAST_PORT;
+int config_multicast_parity = MULTICAST_PARITY;
+int config_shared_memory = false; // Publish the raw windows in shared memory for readers on this machine
+int config_send_backend = NETWORK_SEND_SOCKET;
+int config_latency_msec = NETWORK_LATENCY_MSEC; // 0 turns off the rate control
+int config_tcp_port = atoi(TCP_PLUGIN_PORT); // Only read when the network thread starts
+int config_png_preset = PNG_PRESET_BALANCED;
+int config_jpeg_quality = JPEG_QUALITY_OFF;
+int config_jpeg_subsample = true; // 4:2:0, with half resolution colour
+int config_window_count = 0; // Windows with their own settings, matched by name, with -1 to use the global setting
+char config_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_window_png_preset[COCKPIT_MAX_WINDOWS];
+int config_window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+
+// Finds the settings for a window in the config, adding it if this is the first setting for it
+static int config_window(plugin_config_t &config, const char *name) {
+	for (int w = 0; w < config.window_count; w++)
+		if (!strcmp(config.window_name[w], name))
+			return w;
+	if (config.window_count >= COCKPIT_MAX_WINDOWS)
+		return -1;
+	strcpy(config.window_name[config.window_count], name);
+	config.window_png_preset[config.window_count] = -1;
+	config.window_jpeg_quality[config.window_count] = -1;
+	return config.window_count++;
+}
+
+void load_plugin_config() {
+	// Reset everything to the defaults so that removing a line from the file takes effect on reload. The settings for
+	// the network thread are collected here and only handed over once the whole file has been read.
+	plugin_config_t config;
+	memset(&config, 0, sizeof(config));
+	config_capture_mode = CAPTURE_MODE_PBO;
+	config.encode_threads = 0;
+	config.keepalive_msec = NETWORK_KEEPALIVE_MSEC;
+	config.keyframe_msec = DELTA_KEYFRAME_MSEC;
+	config.multicast_group[0] = '\0';
+	config.multicast_port = MULTICAST_PORT;
+	config.multicast_parity = MULTICAST_PARITY;
+	config.shared_memory = false;
+	config.send_backend = NETWORK_SEND_SOCKET;
+	config.latency_msec = NETWORK_LATENCY_MSEC;
+	config.tcp_port = atoi(TCP_PLUGIN_PORT);
+	config.png_preset = PNG_PRESET_BALANCED;
+	config.jpeg_quality = JPEG_QUALITY_OFF;
+	config.jpeg_subsample = true;
+	config.window_count = 0;
+
+	char cfgfile[SAFE_PATH_LENGTH];
+	sprintf(cfgfile, "%s%c%s", plugin_path, PATH_SEP_CHR, PLUGIN_CONFIG_FILE);
+	FILE *fp = fopen(cfgfile, "rb");
+	if (fp == NULL) {
+		log_printf("No plugin config file %s, using default settings\n", cfgfile);
+		config_publish(config);
+		return;
+	}
+	log_printf("Loading plugin config from %s\n", cfgfile);
+	char buffer[1024];
+	while (fgets(buffer, 1024, fp) != NULL) {
+		char key[256], value[256], window[256];
+		int fields = (buffer[0] == '#') ? 0 : sscanf(buffer, "%255s %255s %255s", key, value, window);
+		if (fields < 2)
+			continue;
+		if (!strcmp(key, "capture")) {
+			if (!strcmp(value, "pbo"))
+				config_capture_mode = CAPTURE_MODE_PBO;
+			else if (!strcmp(value, "sync"))
+				config_capture_mode = CAPTURE_MODE_SYNC;
+			else
+				log_printf("Unknown capture mode [%s], expected pbo or sync\n", value);
+		} else if (!strcmp(key, "encode_threads")) {
+			config.encode_threads = atoi(value);
+		} else if (!strcmp(key, "keepalive_ms")) {
+			config.keepalive_msec = atoi(value);
+		} else if (!strcmp(key, "keyframe_ms")) {
+			config.keyframe_msec = atoi(value);
+		} else if (!strcmp(key, "multicast")) {
+			if (!strcmp(value, "off"))
+				config.multicast_group[0] = '\0';
+			else
+				snprintf(config.multicast_group, sizeof(config.multicast_group), "%s", value);
+		} else if (!strcmp(key, "multicast_port")) {
+			config.multicast_port = atoi(value);
+		} else if (!strcmp(key, "multicast_parity")) {
+			config.multicast_parity = atoi(value);
+		} else if (!strcmp(key, "shared_memory")) {
+			if (!strcmp(value, "on"))
+				config.shared_memory = true;
+			else if (!strcmp(value, "off"))
+				config.shared_memory = false;
+			else
+				log_printf("Unknown shared_memory setting [%s], expected on or off\n", value);
+		} else if (!strcmp(key, "send_backend")) {
+			if (!strcmp(value, "socket"))
+				config.send_backend = NETWORK_SEND_SOCKET;
+			else if (!strcmp(value, "io_uring"))
+				config.send_backend = NETWORK_SEND_IO_URING;
+			else
+				log_printf("Unknown send backend [%s], expected socket or io_uring\n", value);
+		} else if (!strcmp(key, "latency_ms")) {
+			config.latency_msec = atoi(value);
+		} else if (!strcmp(key, "port")) {
+			config.tcp_port = atoi(value);
+		} else if (!strcmp(key, "png_preset")) {
+			// An optional window name after the preset only changes that window
+			int preset = encode_png_preset_from_name(value);
+			if (preset < 0) {
+				log_printf("Unknown png_preset [%s], expected stored, fast, balanced or small\n", value);
+				continue;
+			} else if (fields < 3) {
+				config.png_preset = preset;
+			} else if (config_window(config, window) >= 0) {
+				config.window_png_preset[config_window(config, window)] = preset;
+				log_printf("Config setting [%s] = [%s] for window [%s]\n", key, value, window);
+				continue;
+			}
+		} else if (!strcmp(key, "jpeg_quality")) {
+			// Same as png_preset, with 0 to keep sending PNG
+			int quality = atoi(value);
+			if ((quality < 0) || (quality > 100)) {
+				log_printf("Invalid jpeg_quality [%s], expected 1 to 100 or 0 for off\n", value);
+				continue;
+			} else if (fields < 3) {
+				config.jpeg_quality = quality;
+			} else if (config_window(config, window) >= 0) {
+				config.window_jpeg_quality[config_window(config, window)] = quality;
+				log_printf("Config setting [%s] = [%s] for window [%s]\n", key, value, window);
+				continue;
+			}
+		} else if (!strcmp(key, "jpeg_subsampling")) {
+			if (!strcmp(value, "420"))
+				config.jpeg_subsample = true;
+			else if (!strcmp(value, "444"))
+				config.jpeg_subsample = false;
+			else
+				log_printf("Unknown jpeg_subsampling [%s], expected 420 or 444\n", value);
+		} else {
+			log_printf("Ignoring unknown config setting [%s]\n", key);
+			continue;
+		}
+		log_printf("Config setting [%s] = [%s]\n", key, value);
+	}
+	fclose(fp);
+	config_publish(config);
+}
+
+
 int network_started = false;
 
 
@@ -281,6 +434,8 @@ int panel_callback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
 
 void load_window_state();
 void				draw(XPLMWindowID in_window_id, void * in_refcon);
+int					frame_callback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon);
+bool				frame_callback_registered = false;
 int					handle_mouse(XPLMWindowID in_window_id, int x, int y, int is_down, void * in_refcon);
 int                 handle_command(XPLMCommandRef cmd_id, XPLMCommandPhase phase, void * in_refcon);
 
@@ -387,6 +542,11 @@ PLUGIN_API void	XPluginStop(void)
 	if (cmd_hide_button != NULL) XPLMUnregisterCommandHandler(cmd_hide_button, handle_command, 0, 0); cmd_hide_button = NULL;
 	if (cmd_png_button != NULL) XPLMUnregisterCommandHandler(cmd_png_button, handle_command, 0, 0); cmd_png_button = NULL;
 	if (cmd_plugin_button != NULL) XPLMUnregisterCommandHandler(cmd_plugin_button, handle_command, 0, 0); cmd_plugin_button = NULL;
+
+	if (frame_callback_registered) {
+		XPLMUnregisterDrawCallback(frame_callback, xplm_Phase_Window, 0, NULL);
+		frame_callback_registered = false;
+	}
 }
 
 bool plugin_disabled = false;
@@ -397,6 +557,11 @@ PLUGIN_API void XPluginDisable(void) {
 }
 
 PLUGIN_API int XPluginEnable(void) {
+	// Texture scanning and capture run once per frame after the panel and gauges are drawn, whether our windows are visible or not
+	if (!frame_callback_registered) {
+		XPLMRegisterDrawCallback(frame_callback, xplm_Phase_Window, 0, NULL);
+		frame_callback_registered = true;
+	}
 	if (plugin_disabled) {
 		log_printf("Plugin was previously disabled, re-enabling it\n");
 		plugin_disabled = false;
@@ -491,10 +656,6 @@ void draw_texture_lbrt(int leftX, int botY, int rightX, int topY, int maxX, int
 }
 
 
-unsigned char texture_buffer[MAX_TEXTURE_WIDTH * MAX_TEXTURE_HEIGHT * 4]; // Ensure we definitely have enough space for 4-byte RGBA
-unsigned char *texture_pointer = NULL; // When this is null, the image has been sent and we need to capture a new one
-
-
 void draw(XPLMWindowID in_window_id, void * in_refcon)
 {
 	float col_white[] = {1.0, 1.0, 1.0};
@@ -572,16 +733,6 @@ void draw(XPLMWindowID in_window_id, void * in_refcon)
 		0 /* no depth writing */
 	);
 
-	if (cockpit_dirty) {
-		log_printf("Detected aircraft dirty flag set, so begin finding texture\n");
-		// Draw colors to the texture to make it possible to detect.
-		// xplm_Phase_Panel draws before the aircraft draws over the top
-		// xplm_Phase_Gauges draws after the aircraft but this is not what you get when you read the PNG texture when it is done in the 2D window callback
-		XPLMRegisterDrawCallback(panel_callback, xplm_Phase_Panel, 1, NULL);
-		cockpit_dirty = false;
-		return;
-	}
-
 	int *g_texture_lbrt = &_g_texture_lbrt[win_num][0];
 	int topInset = 20; // Include space for the UI buttons
 	int sideInset = -10; // Remove the X-Plane default 10 pixel border
@@ -595,17 +746,6 @@ void draw(XPLMWindowID in_window_id, void * in_refcon)
 	// sideInset += 1;
 
 	if (cockpit_aircraft_known) {
-		// If this is the first time we've seen the texture since the aircraft was loaded then we should save a PNG for debugging
-		// The texture seems to be built up over a number of frames in some aircraft, so use >10 for safety so we capture an accurate texture
-		if ((cockpit_texture_id > 0) && (cockpit_snapshot_seq != cockpit_texture_seq) && (cockpit_texture_draw > 10)) {
-			char snapshot[SAFE_PATH_LENGTH];
-			sprintf(snapshot, "%s%c%s.tex.png", plugin_path, PATH_SEP_CHR, cockpit_aircraft_filename);
-			save_png(cockpit_texture_id, snapshot);
-			cockpit_snapshot_seq = cockpit_texture_seq;
-		}
-		// Keep track of the number of times we draw the texture
-		cockpit_texture_draw++;
-
 		/*
 		log_printf("TextureCoords: L=%d, B=%d, R=%d, T=%d - 2DCoords: L=%d, B=%d, R=%d, T=%d - Insets: side=%d, top=%d\n",
 			g_texture_lbrt[0], g_texture_lbrt[1], g_texture_lbrt[2], g_texture_lbrt[3],
@@ -616,19 +756,39 @@ void draw(XPLMWindowID in_window_id, void * in_refcon)
 		draw_texture_lbrt(g_texture_lbrt[0], g_texture_lbrt[1], g_texture_lbrt[2], g_texture_lbrt[3],
 			cockpit_texture_width, cockpit_texture_height,
 			l + sideInset, b + sideInset, r - sideInset, t - topInset);
+	}
+}
 
-		// Check to see if we need to prepare a new texture image to send, only capture a new one if the previous has been consumed
-		if (texture_pointer == NULL) {
-			// GL_RGBA is the fastest (52 -> 37 fps), then GL_RGB (52 -> 31 fps), and GL_BGR_EXT is the slowest (52 -> 28 fps).
-			// glTexSubImage2D doesn't seem to work, always returns a black image
-			// glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cockpit_texture_width, cockpit_texture_height, GL_RGBA, GL_UNSIGNED_BYTE, texture_buffer);
-			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, texture_buffer);
+// Called once per frame after the panel texture is complete. This is independent of our windows, so texture
+// scanning and network capture keep working even when every window is closed and we are only streaming.
+int frame_callback(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
+{
+	if (cockpit_dirty) {
+		log_printf("Detected aircraft dirty flag set, so begin finding texture\n");
+		// Draw colors to the texture to make it possible to detect.
+		// xplm_Phase_Panel draws before the aircraft draws over the top
+		// xplm_Phase_Gauges draws after the aircraft but this is not what you get when you read the PNG texture when it is done in the 2D window callback
+		XPLMRegisterDrawCallback(panel_callback, xplm_Phase_Panel, 1, NULL);
+		cockpit_dirty = false;
+		return 1;
+	}
 
-			// Image is now captured, so set the pointer and we wait for the network thread to compress and send it
-			texture_pointer = texture_buffer;
-			// log_printf("Captured texture buffer, ready for transmission\n");
+	if (cockpit_aircraft_known && (cockpit_texture_id > 0)) {
+		// If this is the first time we've seen the texture since the aircraft was loaded then we should save a PNG for debugging
+		// The texture seems to be built up over a number of frames in some aircraft, so use >10 for safety so we capture an accurate texture
+		if ((cockpit_snapshot_seq != cockpit_texture_seq) && (cockpit_texture_draw > 10)) {
+			char snapshot[SAFE_PATH_LENGTH];
+			sprintf(snapshot, "%s%c%s.tex.png", plugin_path, PATH_SEP_CHR, cockpit_aircraft_filename);
+			save_png(cockpit_texture_id, snapshot);
+			cockpit_snapshot_seq = cockpit_texture_seq;
 		}
+		// Keep track of the number of frames the texture has been active
+		cockpit_texture_draw++;
+
+		// Start or collect a readback of the texture for the network thread
+		capture_texture();
 	}
+	return 1;
 }
 
 void clear_window_state() {
@@ -679,6 +839,9 @@ void load_window_state() {
 		}
 	}
 
+	// Pick up any changes to the plugin settings as well
+	load_plugin_config();
+
 	// Detect the type of aircraft and load in the name to cockpit_aircraft_filename, also find the -PANELS- texture and get the size
 	detect_aircraft_filename();
 
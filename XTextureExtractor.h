@@ -31,6 +31,11 @@
 #include "XPLMPlugin.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <functional>
 #if IBM
 #include <windows.h>
 #endif
@@ -45,8 +50,8 @@
 #error This is made to be compiled against the XPLM301 SDK, this macro is also not set in the vcxproj Debug mode flags
 #endif
 
-static char __log_printf_buffer[4096];
-#define log_printf(fmt, ...) if(true) snprintf(__log_printf_buffer, 4096, "XTextureExtractor-%s: " fmt, PLUGIN_VERSION, ##__VA_ARGS__), XPLMDebugString(__log_printf_buffer)
+// The buffer is on the stack so the encoder and network threads can log at the same time as X-Plane's thread
+#define log_printf(fmt, ...) do { char __log_printf_buffer[4096]; snprintf(__log_printf_buffer, 4096, "XTextureExtractor-%s: " fmt, PLUGIN_VERSION, ##__VA_ARGS__); XPLMDebugString(__log_printf_buffer); } while (false)
 
 #define COCKPIT_MAX_WINDOWS 20
 #define TCP_PLUGIN_PORT    "52500"
@@ -55,19 +60,162 @@ static char __log_printf_buffer[4096];
 #define TCP_INTRO_HEADER   4096
 #define TCP_PROTOCOL_VERSION "XTEv3"
 #define PLUGIN_VERSION     "v3.3"
-#if APL
-// OSX does not support 10mb buffers
-#define TCP_SEND_BUFFER    5*1024*1024
-#else
-#define TCP_SEND_BUFFER    10*1024*1024
-#endif
+// Only big enough for a frame or two, anything more queues in the plugin where stale frames can be replaced
+#define TCP_SEND_BUFFER    512*1024
 // Windows defines MAX_PATH as 260 and https://developer.x-plane.com/sdk/XPLMGetNthAircraftModel/ defines filename as 256 and path as 512
 // Define a safe path length which we can be sure exceeds all possible cases
 #define SAFE_PATH_LENGTH   4096
+// Optional plugin-wide settings file, stored next to the .tex files
+#define PLUGIN_CONFIG_FILE "XTextureExtractor.cfg"
+// Number of pixel pack buffers used for asynchronous texture capture
+#define CAPTURE_PBO_RING   3
+#define CAPTURE_MODE_SYNC  0
+#define CAPTURE_MODE_PBO   1
+// Unchanged windows are still resent this often by default
+#define NETWORK_KEEPALIVE_MSEC 1000
+// Optional protocol that clients can ask for after the header, which only sends the tiles that changed
+#define TCP_DELTA_PROTOCOL "XTEv3-delta"
+#define DELTA_TILE_SIZE    64
+#define DELTA_KEYFRAME_MSEC 5000
+// Compact framing without any padding that clients can ask for instead, with or without the deltas
+#define TCP_V4_PROTOCOL    "XTEv4"
+#define TCP_V4_DELTA_PROTOCOL "XTEv4-delta"
+#define XTEV4_CODEC_PNG    0 // Whole window as a PNG
+#define XTEV4_CODEC_TILES  1 // Changed tiles, with the same payload as a DELTA record
+#define XTEV4_CODEC_PNG_SCALED 2 // Smaller PNG of the window, for clients that said they can stretch it back out
+#define XTEV4_STREAM_ID    0xFF // Window id for records that are about the stream rather than a window
+#define XTEV4_CODEC_HEADER 3 // New TCP_INTRO_HEADER after the aircraft changed, sent with XTEV4_STREAM_ID
+#define XTEV4_CODEC_QOI    4 // Whole window as a QOI image instead of a PNG, for clients that asked for it in CODECS
+#define XTEV4_CODEC_JPEG   5 // Whole window as a JPEG, possibly resized, so it always has the full size like PNG_SCALED
+// Clients that send this command are sent the new header on the same connection when the aircraft changes, in a
+// HEADR record for XTEv3 or an XTEV4_CODEC_HEADER record for XTEv4, instead of being disconnected
+#define TCP_HEADERS_COMMAND "HEADERS"
+// How often to check for new frames if the wake up socket could not be opened
+#define NETWORK_POLL_MSEC  10
+// Most buffers handed to the socket in one call, each record needs up to 3
+#define NETWORK_MAX_IOVEC  48
+// Optional UDP multicast of the XTEv4-delta stream, so many clients showing the same windows cost no extra bandwidth
+#define MULTICAST_PORT     52501
+#define MULTICAST_HEADER   20   // Bytes at the start of each datagram, before the chunk of the record
+#define MULTICAST_CHUNK_SIZE 1200 // Bytes of the record in each datagram, small enough to never be fragmented
+#define MULTICAST_PARITY   8    // Data chunks covered by each XOR parity chunk, 0 for no parity
+#define MULTICAST_SEND_BUFFER (2*1024*1024) // Keyframes go out in a burst, so this needs to hold a few of them
+// Rate control for each client, so a slow link gets fewer or smaller frames instead of a backlog of stale ones
+#define NETWORK_LATENCY_MSEC  200   // Default for how long a frame can wait in the socket on the way to a slow client
+#define NETWORK_MIN_BUDGET    (32*1024) // Always allow this much in the socket, since a link can only be measured when busy
+#define NETWORK_RATE_MSEC     250   // How often the throughput of each client is measured
+#define NETWORK_TARGET_FPS    20    // Clients that cannot take full size windows this often are sent them at half size
+#define NETWORK_SCALE_SETTLE_MSEC 1000 // Time to measure a client after changing size, before it can be changed again
+#define NETWORK_SCALE_PROBE_MSEC 10000 // How long a client stays at half size before trying full size again
+// How the network thread sends to the TCP clients, io_uring is only available on Linux
+#define NETWORK_SEND_SOCKET   0
+#define NETWORK_SEND_IO_URING 1
+#define NETWORK_URING_ENTRIES 64    // Sends submitted in one system call, more clients than this take more calls
+#define NETWORK_ZEROCOPY_MIN  16384 // Smaller sends are cheaper to copy than to pin, see the kernel msg_zerocopy docs
+// PNG encoder presets, trading compression time against size, see encode_presets[] for what each one does
+#define PNG_PRESET_STORED     0
+#define PNG_PRESET_FAST       1
+#define PNG_PRESET_BALANCED   2
+#define PNG_PRESET_SMALL      3
+#define PNG_PRESET_COUNT      4
+// Lossy JPEG for the windows with a quality set in the config, only sent to clients that list JPEG in CODECS
+#define JPEG_QUALITY_OFF      0
 // TODO: The code is a mess of unchecked char strings, which should be replaced with std::string or checked snprintf
 
+// Location of each window inside the buffer captured for the network thread. Windows are packed one
+// after the other with a stride of width*4, and the rows are upside down with the bottom row first.
+struct capture_window_t {
+	int x, y;          // Bottom-left corner inside the texture, in GL coordinates
+	int width, height;
+	size_t offset;     // Byte offset of the first row inside the captured buffer
+};
+
+// One captured image of every window, handed from the render thread to the network thread
+struct capture_frame_t {
+	std::vector<unsigned char> pixels;
+	capture_window_t layout[COCKPIT_MAX_WINDOWS];
+	int count;         // Number of windows in layout
+	int texture_seq;   // cockpit_texture_seq at the time of the capture
+	unsigned sequence; // Increments with every captured frame
+	uint64_t capture_usec; // Wall clock time the pixels were read back, in microseconds since 1970
+};
+
 extern void start_networking_thread(void);
-extern unsigned char *texture_pointer;
+extern void capture_texture(void);
+extern std::atomic<int> network_client_count;
+extern void network_wakeup(void);
+extern int config_capture_mode;
+extern const capture_frame_t *capture_acquire_frame(void);
+extern void encode_window_png(std::vector<unsigned char> &png_data, const capture_frame_t *frame, int i);
+extern void encode_window_png_resized(std::vector<unsigned char> &png_data, const capture_frame_t *frame, int i, int width, int height);
+extern void encode_window_qoi(std::vector<unsigned char> &qoi_data, const capture_frame_t *frame, int i);
+extern void encode_window_jpeg(std::vector<unsigned char> &jpeg_data, const capture_frame_t *frame, int i, int quality, bool subsample);
+extern void encode_window_jpeg_resized(std::vector<unsigned char> &jpeg_data, const capture_frame_t *frame, int i, int width, int height, int quality, bool subsample);
+extern void encode_jpeg_rgba(std::vector<unsigned char> &jpeg_data, const unsigned char *rows, ptrdiff_t stride, int width, int height, int quality, bool subsample);
+extern int encode_window_jpeg_quality(int i);
+extern void encode_parallel_for(int count, const std::function<void(int)> &job);
+extern int config_encode_threads;
+extern uint64_t capture_hash_window(const capture_frame_t *frame, int i);
+extern uint64_t capture_time_usec(void);
+extern int encode_window_delta(std::vector<unsigned char> &payload, const capture_frame_t *frame, int i, std::vector<unsigned char> &reference);
+extern void encode_window_reference(std::vector<unsigned char> &reference, const capture_frame_t *frame, int i);
+extern int config_keepalive_msec;
+extern int config_keyframe_msec;
+extern char config_multicast_group[64];
+extern int config_multicast_port;
+extern int config_multicast_parity;
+extern int config_shared_memory;
+extern int config_send_backend;
+extern int config_latency_msec;
+extern int config_tcp_port;
+extern int config_png_preset;
+extern int config_jpeg_quality;
+extern int config_jpeg_subsample;
+extern int config_window_count;
+extern char config_window_name[COCKPIT_MAX_WINDOWS][256];
+extern int config_window_png_preset[COCKPIT_MAX_WINDOWS];
+extern int config_window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+
+// The config_ settings above apart from config_capture_mode belong to the network thread and its encoders. A reload on
+// the main thread fills in one of these and hands it over with config_publish, and the network thread copies it into
+// the globals between frames, so it never sees a half loaded config or one that changes part way through a frame.
+struct plugin_config_t {
+	int encode_threads;
+	int keepalive_msec;
+	int keyframe_msec;
+	char multicast_group[64];
+	int multicast_port;
+	int multicast_parity;
+	int shared_memory;
+	int send_backend;
+	int latency_msec;
+	int tcp_port;
+	int png_preset;
+	int jpeg_quality;
+	int jpeg_subsample;
+	int window_count;
+	char window_name[COCKPIT_MAX_WINDOWS][256];
+	int window_png_preset[COCKPIT_MAX_WINDOWS];
+	int window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+};
+extern void config_publish(const plugin_config_t &config);
+
+// The aircraft, texture and window globals below as another thread sees them, which the relay uses when the plugin it
+// reads from changes aircraft. The network thread copies it into the globals between frames, the same as the config.
+struct network_header_t {
+	GLint texture_id;
+	GLint texture_width;
+	GLint texture_height;
+	int texture_seq;
+	char aircraft_name[256];
+	int window_count;
+	char window_name[COCKPIT_MAX_WINDOWS][256];
+	int texture_lbrt[COCKPIT_MAX_WINDOWS][4];
+};
+extern void network_publish_header(const network_header_t &header);
+extern int encode_png_preset_from_name(const char *name);
+extern bool shm_reader_active(void);
+extern void shm_publish_frame(const capture_frame_t *frame);
 extern GLint cockpit_texture_id;
 extern GLint cockpit_texture_width;
 extern GLint cockpit_texture_height;
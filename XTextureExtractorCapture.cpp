@@ -0,0 +1,404 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+#include "XTextureExtractor.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <chrono>
+#if APL
+#include <dlfcn.h>
+#endif
+
+
+// The stock gl.h on Windows only covers OpenGL 1.1, so we declare the buffer and sync entry points
+// ourselves and look them up at runtime. None of this is available on really old drivers, in which
+// case we fall back to the synchronous glGetTexImage() path.
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER           0x88EB
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER_BINDING
+#define GL_PIXEL_PACK_BUFFER_BINDING   0x88ED
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ                 0x88E1
+#endif
+#ifndef GL_READ_ONLY
+#define GL_READ_ONLY                   0x88B8
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE  0x9117
+#endif
+#ifndef GL_ALREADY_SIGNALED
+#define GL_ALREADY_SIGNALED            0x911A
+#endif
+#ifndef GL_CONDITION_SATISFIED
+#define GL_CONDITION_SATISFIED         0x911C
+#endif
+#ifndef GL_READ_FRAMEBUFFER
+#define GL_READ_FRAMEBUFFER            0x8CA8
+#endif
+#ifndef GL_READ_FRAMEBUFFER_BINDING
+#define GL_READ_FRAMEBUFFER_BINDING    0x8CAA
+#endif
+#ifndef GL_COLOR_ATTACHMENT0
+#define GL_COLOR_ATTACHMENT0           0x8CE0
+#endif
+#ifndef GL_FRAMEBUFFER_COMPLETE
+#define GL_FRAMEBUFFER_COMPLETE        0x8CD5
+#endif
+
+typedef void      (APIENTRY *xte_glGenBuffers_t)(GLsizei n, GLuint *buffers);
+typedef void      (APIENTRY *xte_glBindBuffer_t)(GLenum target, GLuint buffer);
+typedef void      (APIENTRY *xte_glBufferData_t)(GLenum target, ptrdiff_t size, const void *data, GLenum usage);
+typedef void *    (APIENTRY *xte_glMapBuffer_t)(GLenum target, GLenum access);
+typedef GLboolean (APIENTRY *xte_glUnmapBuffer_t)(GLenum target);
+typedef void *    (APIENTRY *xte_glFenceSync_t)(GLenum condition, GLbitfield flags);
+typedef GLenum    (APIENTRY *xte_glClientWaitSync_t)(void *sync, GLbitfield flags, uint64_t timeout);
+typedef void      (APIENTRY *xte_glDeleteSync_t)(void *sync);
+typedef void      (APIENTRY *xte_glGenFramebuffers_t)(GLsizei n, GLuint *framebuffers);
+typedef void      (APIENTRY *xte_glBindFramebuffer_t)(GLenum target, GLuint framebuffer);
+typedef void      (APIENTRY *xte_glFramebufferTexture2D_t)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+typedef GLenum    (APIENTRY *xte_glCheckFramebufferStatus_t)(GLenum target);
+
+static xte_glGenBuffers_t     xte_glGenBuffers = NULL;
+static xte_glBindBuffer_t     xte_glBindBuffer = NULL;
+static xte_glBufferData_t     xte_glBufferData = NULL;
+static xte_glMapBuffer_t      xte_glMapBuffer = NULL;
+static xte_glUnmapBuffer_t    xte_glUnmapBuffer = NULL;
+static xte_glFenceSync_t      xte_glFenceSync = NULL;
+static xte_glClientWaitSync_t xte_glClientWaitSync = NULL;
+static xte_glDeleteSync_t     xte_glDeleteSync = NULL;
+static xte_glGenFramebuffers_t        xte_glGenFramebuffers = NULL;
+static xte_glBindFramebuffer_t        xte_glBindFramebuffer = NULL;
+static xte_glFramebufferTexture2D_t   xte_glFramebufferTexture2D = NULL;
+static xte_glCheckFramebufferStatus_t xte_glCheckFramebufferStatus = NULL;
+
+#if LIN
+extern "C" void (*glXGetProcAddressARB(const GLubyte *procName))(void);
+#endif
+
+static void *capture_get_proc(const char *name) {
+#if IBM
+	return (void *)wglGetProcAddress(name);
+#elif LIN
+	return (void *)glXGetProcAddressARB((const GLubyte *)name);
+#else
+	return dlsym(RTLD_DEFAULT, name);
+#endif
+}
+
+static bool capture_gl_loaded = false;
+static bool capture_have_pbo = false; // Pixel pack buffers for asynchronous readback
+static bool capture_have_fbo = false; // Framebuffer objects so we can glReadPixels() just the windows
+
+static void capture_gl_init(void) {
+	if (capture_gl_loaded)
+		return;
+	capture_gl_loaded = true;
+
+	xte_glGenBuffers  = (xte_glGenBuffers_t) capture_get_proc("glGenBuffers");
+	xte_glBindBuffer  = (xte_glBindBuffer_t) capture_get_proc("glBindBuffer");
+	xte_glBufferData  = (xte_glBufferData_t) capture_get_proc("glBufferData");
+	xte_glMapBuffer   = (xte_glMapBuffer_t)  capture_get_proc("glMapBuffer");
+	xte_glUnmapBuffer = (xte_glUnmapBuffer_t)capture_get_proc("glUnmapBuffer");
+	capture_have_pbo = (xte_glGenBuffers && xte_glBindBuffer && xte_glBufferData && xte_glMapBuffer && xte_glUnmapBuffer);
+	if (capture_have_pbo) {
+		log_printf("Pixel pack buffers are available, using a ring of %d for asynchronous texture capture\n", CAPTURE_PBO_RING);
+	} else {
+		log_printf("Pixel pack buffers are not available, using synchronous texture capture\n");
+	}
+
+	// Fences are optional, without them we just assume a buffer issued a full ring ago is complete
+	xte_glFenceSync      = (xte_glFenceSync_t)     capture_get_proc("glFenceSync");
+	xte_glClientWaitSync = (xte_glClientWaitSync_t)capture_get_proc("glClientWaitSync");
+	xte_glDeleteSync     = (xte_glDeleteSync_t)    capture_get_proc("glDeleteSync");
+	if (!xte_glFenceSync || !xte_glClientWaitSync || !xte_glDeleteSync) {
+		log_printf("Fence syncs are not available, pixel pack buffers will be mapped after %d frames\n", CAPTURE_PBO_RING - 1);
+		xte_glFenceSync = NULL;
+	}
+
+	xte_glGenFramebuffers        = (xte_glGenFramebuffers_t)       capture_get_proc("glGenFramebuffers");
+	xte_glBindFramebuffer        = (xte_glBindFramebuffer_t)       capture_get_proc("glBindFramebuffer");
+	xte_glFramebufferTexture2D   = (xte_glFramebufferTexture2D_t)  capture_get_proc("glFramebufferTexture2D");
+	xte_glCheckFramebufferStatus = (xte_glCheckFramebufferStatus_t)capture_get_proc("glCheckFramebufferStatus");
+	capture_have_fbo = (xte_glGenFramebuffers && xte_glBindFramebuffer && xte_glFramebufferTexture2D && xte_glCheckFramebufferStatus);
+	if (!capture_have_fbo)
+		log_printf("Framebuffer objects are not available, reading back the whole texture instead of each window\n");
+}
+
+
+// Triple buffer of captured frames shared with the network thread. The render thread always owns the back
+// slot and the network thread owns the front slot, and they swap with the middle slot using a single atomic
+// exchange. CAPTURE_FRESH is set in the middle index when it holds a frame the network thread has not seen yet,
+// so the render thread never waits for the encoder, and the encoder always gets the newest complete frame.
+#define CAPTURE_FRESH 4
+static capture_frame_t capture_slots[3];
+static int capture_back = 0;                      // Only touched by the render thread
+static int capture_front = 2;                     // Only touched by the network thread
+static std::atomic<int> capture_middle(1);
+static unsigned capture_sequence = 0;             // Incremented for every published frame
+static std::vector<unsigned char> capture_staging; // Whole texture, only used when we cannot read the windows directly
+
+// Work out where each window lives in texture memory. The .tex rectangles have row 0 at the top of the
+// image (see save_png) but GL returns the bottom row of the texture first, so the window rows come back upside down.
+static int capture_compute_layout(capture_window_t *layout, size_t *total) {
+	size_t offset = 0;
+	for (int i = 0; i < cockpit_window_limit; i++) {
+#define CLAMP_COORD(v, max) ((v) < 0 ? 0 : ((v) > (max) ? (max) : (v)))
+		int l = CLAMP_COORD(_g_texture_lbrt[i][0], cockpit_texture_width);
+		int b = CLAMP_COORD(_g_texture_lbrt[i][1], cockpit_texture_height);
+		int r = CLAMP_COORD(_g_texture_lbrt[i][2], cockpit_texture_width);
+		int t = CLAMP_COORD(_g_texture_lbrt[i][3], cockpit_texture_height);
+#undef CLAMP_COORD
+		layout[i].x = l;
+		layout[i].y = cockpit_texture_height - t;
+		layout[i].width = (r > l) ? r - l : 0;
+		layout[i].height = (t > b) ? t - b : 0;
+		layout[i].offset = offset;
+		offset += (size_t)layout[i].width * layout[i].height * 4;
+	}
+	*total = offset;
+	return cockpit_window_limit;
+}
+
+// Copy each window out of a whole texture image into the packed layout
+static void capture_pack_windows(const unsigned char *texture, int count, const capture_window_t *layout, unsigned char *dest) {
+	size_t in_stride = (size_t)cockpit_texture_width * 4;
+	for (int i = 0; i < count; i++) {
+		size_t out_stride = (size_t)layout[i].width * 4;
+		for (int row = 0; row < layout[i].height; row++)
+			memcpy(dest + layout[i].offset + row * out_stride, texture + (layout[i].y + row) * in_stride + layout[i].x * 4, out_stride);
+	}
+}
+
+// Wall clock rather than a steady clock, so clients on other machines can work out the latency if their clocks are in sync
+uint64_t capture_time_usec(void) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Pixels have been written into the back slot, so fill in the rest and swap it into the middle for the network thread
+static void capture_publish(int count, const capture_window_t *layout, int texture_seq, uint64_t capture_usec) {
+	capture_frame_t *frame = &capture_slots[capture_back];
+	memcpy(frame->layout, layout, count * sizeof(capture_window_t));
+	frame->count = count;
+	frame->texture_seq = texture_seq;
+	frame->sequence = ++capture_sequence;
+	frame->capture_usec = capture_usec;
+	capture_back = capture_middle.exchange(capture_back | CAPTURE_FRESH, std::memory_order_acq_rel) & ~CAPTURE_FRESH;
+	// log_printf("Captured texture buffer, ready for transmission\n");
+	network_wakeup();
+}
+
+// True while the last published frame is still waiting for the network thread
+static bool capture_unconsumed(void) {
+	return (capture_middle.load(std::memory_order_acquire) & CAPTURE_FRESH) != 0;
+}
+
+// Called from the network thread, returns the newest frame not seen before or NULL if there is nothing new.
+// The frame stays valid until the next call.
+const capture_frame_t *capture_acquire_frame(void) {
+	if (!capture_unconsumed())
+		return NULL;
+	capture_front = capture_middle.exchange(capture_front, std::memory_order_acq_rel) & ~CAPTURE_FRESH;
+	return &capture_slots[capture_front];
+}
+
+// Attach the panel texture to our own read framebuffer, so glReadPixels() can pull out individual windows
+static GLuint capture_fbo = 0;
+static GLint capture_fbo_texture = -1;
+static bool capture_fbo_complete = false;
+
+static bool capture_bind_fbo(GLint *previous_read) {
+	if (!capture_have_fbo)
+		return false;
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, previous_read);
+	if (capture_fbo == 0)
+		xte_glGenFramebuffers(1, &capture_fbo);
+	xte_glBindFramebuffer(GL_READ_FRAMEBUFFER, capture_fbo);
+	if (capture_fbo_texture != cockpit_texture_id) {
+		xte_glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, cockpit_texture_id, 0);
+		capture_fbo_texture = cockpit_texture_id;
+		capture_fbo_complete = (xte_glCheckFramebufferStatus(GL_READ_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+		if (!capture_fbo_complete)
+			log_printf("Texture id %d cannot be attached to a framebuffer, reading back the whole texture instead of each window\n", cockpit_texture_id);
+	}
+	if (!capture_fbo_complete) {
+		xte_glBindFramebuffer(GL_READ_FRAMEBUFFER, *previous_read);
+		return false;
+	}
+	return true;
+}
+
+// Read every window into dest, which is either client memory or an offset into the bound pixel pack buffer.
+// Returns false if the texture cannot be attached to a framebuffer and nothing was read.
+static bool capture_read_windows(int count, const capture_window_t *layout, unsigned char *dest) {
+	GLint previous_read = 0;
+	if (!capture_bind_fbo(&previous_read))
+		return false;
+	for (int i = 0; i < count; i++)
+		if ((layout[i].width > 0) && (layout[i].height > 0))
+			glReadPixels(layout[i].x, layout[i].y, layout[i].width, layout[i].height, GL_RGBA, GL_UNSIGNED_BYTE, dest + layout[i].offset);
+	xte_glBindFramebuffer(GL_READ_FRAMEBUFFER, previous_read);
+	return true;
+}
+
+// Fallback that reads the whole texture, the windows then need to be picked out with capture_pack_windows()
+static void capture_read_texture(unsigned char *dest) {
+	// GL_RGBA is the fastest (52 -> 37 fps), then GL_RGB (52 -> 31 fps), and GL_BGR_EXT is the slowest (52 -> 28 fps).
+	// glTexSubImage2D doesn't seem to work, always returns a black image
+	// glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cockpit_texture_width, cockpit_texture_height, GL_RGBA, GL_UNSIGNED_BYTE, texture_buffer);
+	XPLMBindTexture2d(cockpit_texture_id, 0);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, dest);
+}
+
+// Each ring entry is a pixel pack buffer that the GPU copies the windows into while we keep rendering
+struct capture_pbo_t {
+	GLuint buffer;
+	void *fence;        // Signalled once the GPU has finished writing the buffer
+	bool pending;       // A readback has been issued and not consumed yet
+	unsigned issued;    // Frame number the readback was issued, used to find the newest one
+	int texture_seq;    // Texture the readback came from, so we never publish a stale aircraft
+	uint64_t capture_usec; // When the readback was issued, which is when the pixels were rendered
+	size_t size;        // Bytes allocated for the buffer
+	bool packed;        // Contains just the windows, otherwise it is the whole texture
+	int count;          // Window layout at the time of the readback
+	capture_window_t layout[COCKPIT_MAX_WINDOWS];
+	size_t total;
+};
+static capture_pbo_t capture_pbo[CAPTURE_PBO_RING];
+static unsigned capture_frame = 0;
+
+static bool capture_pbo_signaled(capture_pbo_t *pbo) {
+	if (pbo->fence == NULL)
+		return (capture_frame - pbo->issued >= CAPTURE_PBO_RING - 1);
+	// Zero timeout, we only want to know if it is done and never wait for it
+	GLenum status = xte_glClientWaitSync(pbo->fence, 0, 0);
+	return ((status == GL_ALREADY_SIGNALED) || (status == GL_CONDITION_SATISFIED));
+}
+
+static void capture_pbo_release(capture_pbo_t *pbo) {
+	if (pbo->fence != NULL)
+		xte_glDeleteSync(pbo->fence);
+	pbo->fence = NULL;
+	pbo->pending = false;
+}
+
+static void capture_texture_pbo(void) {
+	GLint previous_pack = 0;
+	glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previous_pack);
+	capture_frame++;
+
+	// Find the newest readback the GPU has finished with, anything issued before it is also complete and now stale
+	int newest = -1;
+	for (int i = 0; i < CAPTURE_PBO_RING; i++) {
+		if (capture_pbo[i].pending && capture_pbo_signaled(&capture_pbo[i]) && ((newest < 0) || (capture_pbo[i].issued > capture_pbo[newest].issued)))
+			newest = i;
+	}
+	if (newest >= 0) {
+		capture_pbo_t *pbo = &capture_pbo[newest];
+		// Always publish the newest frame, if the network thread is still busy it will just pick up this one when it is done
+		if (pbo->texture_seq == cockpit_texture_seq) {
+			xte_glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo->buffer);
+			const unsigned char *mapped = (const unsigned char *)xte_glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+			if (mapped != NULL) {
+				std::vector<unsigned char> &pixels = capture_slots[capture_back].pixels;
+				pixels.resize(pbo->total);
+				if (pbo->packed)
+					memcpy(pixels.data(), mapped, pbo->total);
+				else
+					capture_pack_windows(mapped, pbo->count, pbo->layout, pixels.data());
+				capture_publish(pbo->count, pbo->layout, pbo->texture_seq, pbo->capture_usec);
+				xte_glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			} else {
+				// Nothing is mapped, and unmapping anyway would just raise GL_INVALID_OPERATION in X-Plane's context
+				log_printf("Failed to map pixel pack buffer %d, dropping this capture\n", pbo->buffer);
+			}
+		}
+		for (int i = 0; i < CAPTURE_PBO_RING; i++)
+			if (capture_pbo[i].pending && (capture_pbo[i].issued < pbo->issued))
+				capture_pbo_release(&capture_pbo[i]);
+		capture_pbo_release(pbo);
+	}
+
+	// Start a new readback if anyone is listening and there is a free buffer, if the GPU is a whole ring behind we skip a frame instead of stalling
+	if (network_client_count > 0) {
+		capture_pbo_t *pbo = NULL;
+		for (int i = 0; i < CAPTURE_PBO_RING; i++)
+			if (!capture_pbo[i].pending) {
+				pbo = &capture_pbo[i];
+				break;
+			}
+		if (pbo != NULL) {
+			pbo->count = capture_compute_layout(pbo->layout, &pbo->total);
+			// Size for the whole texture since we may have to fall back to it, the windows only use the start
+			size_t size = (size_t)cockpit_texture_width * cockpit_texture_height * 4;
+			if (pbo->total > size)
+				size = pbo->total; // Overlapping windows can add up to more than the texture
+			if (pbo->buffer == 0)
+				xte_glGenBuffers(1, &pbo->buffer);
+			xte_glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo->buffer);
+			if (pbo->size != size) {
+				xte_glBufferData(GL_PIXEL_PACK_BUFFER, (ptrdiff_t)size, NULL, GL_STREAM_READ);
+				pbo->size = size;
+			}
+			// With a pack buffer bound the pointer is an offset into the buffer, so this returns immediately
+			pbo->packed = capture_read_windows(pbo->count, pbo->layout, (unsigned char *)0);
+			if (!pbo->packed)
+				capture_read_texture((unsigned char *)0);
+			pbo->fence = (xte_glFenceSync != NULL) ? xte_glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : NULL;
+			pbo->pending = true;
+			pbo->issued = capture_frame;
+			pbo->texture_seq = cockpit_texture_seq;
+			pbo->capture_usec = capture_time_usec();
+		}
+	}
+
+	xte_glBindBuffer(GL_PIXEL_PACK_BUFFER, previous_pack);
+}
+
+void capture_texture(void) {
+	capture_gl_init();
+	if ((config_capture_mode == CAPTURE_MODE_PBO) && capture_have_pbo) {
+		capture_texture_pbo();
+		return;
+	}
+
+	// The synchronous read stalls X-Plane, so only capture a new one once the previous has been consumed
+	if ((network_client_count > 0) && !capture_unconsumed()) {
+		capture_window_t layout[COCKPIT_MAX_WINDOWS];
+		size_t total;
+		int count = capture_compute_layout(layout, &total);
+		std::vector<unsigned char> &pixels = capture_slots[capture_back].pixels;
+		pixels.resize(total);
+		if (!capture_read_windows(count, layout, pixels.data())) {
+			// Have to read the whole texture, so pick out the windows from a staging copy
+			capture_staging.resize((size_t)cockpit_texture_width * cockpit_texture_height * 4);
+			capture_read_texture(capture_staging.data());
+			capture_pack_windows(capture_staging.data(), count, layout, pixels.data());
+		}
+		capture_publish(count, layout, cockpit_texture_seq, capture_time_usec());
+	}
+}
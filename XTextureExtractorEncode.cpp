@@ -0,0 +1,700 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+#include "XTextureExtractor.h"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include "lodepng/lodepng.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define ENCODE_SSE2
+#endif
+
+
+// Each thread needs its own buffer to flip a window into before compressing it
+static thread_local std::vector<unsigned char> sub_buffer;
+
+// lodepng deflate settings for each PNG_PRESET, the defaults are tuned for small files rather than 30 frames a second.
+// The displays are mostly flat colours, so the rows are not filtered at all, which costs almost nothing in size and
+// saves a lot of time. The times and sizes measured on the sample textures are in the README.
+struct encode_preset_t {
+	const char *name;
+	unsigned btype;        // 0 is stored with no compression, 2 is dynamic Huffman
+	unsigned windowsize;   // How far back to look for repeats, the main cost of compressing
+	unsigned lazymatching; // Checks if a better match starts at the next byte
+	unsigned nicematch;    // Stops searching once a match this long is found
+};
+static const encode_preset_t encode_presets[PNG_PRESET_COUNT] = {
+	{ "stored",   0,    0, 0,   0 }, // Only for localhost, the images are about 28 times bigger
+	{ "fast",     2,  512, 0,  32 },
+	{ "balanced", 2, 2048, 0, 128 }, // A little smaller and nearly twice as fast as lodepng's defaults
+	{ "small",    2, 4096, 1, 258 }, // Same time as lodepng's defaults, for slow links
+};
+
+int encode_png_preset_from_name(const char *name) {
+	for (int p = 0; p < PNG_PRESET_COUNT; p++)
+		if (!strcmp(name, encode_presets[p].name))
+			return p;
+	return -1;
+}
+
+// Windows named in the config can have their own preset and JPEG quality, everything else uses the global ones
+static int encode_window_preset(int i) {
+	for (int w = 0; w < config_window_count; w++)
+		if (!strcmp(config_window_name[w], _g_window_name[i]) && (config_window_png_preset[w] >= 0))
+			return config_window_png_preset[w];
+	return config_png_preset;
+}
+
+int encode_window_jpeg_quality(int i) {
+	for (int w = 0; w < config_window_count; w++)
+		if (!strcmp(config_window_name[w], _g_window_name[i]) && (config_window_jpeg_quality[w] >= 0))
+			return config_window_jpeg_quality[w];
+	return config_jpeg_quality;
+}
+
+// Most displays only use a few dozen colours, and as 8 bit palette indexes instead of RGB there is a third as much for
+// deflate to get through, so images with few enough colours are sent as palette PNGs. The colours are counted with a
+// small hash table that gives up as soon as there are too many. Each window keeps its table from the last frame, so a
+// display that keeps the same colours gets the same palette without having to build it again.
+#define ENCODE_PALETTE_MAX   256
+#define ENCODE_PALETTE_BITS  10 // Hash table size, which keeps it well under half full so the searches stay short
+#define ENCODE_PALETTE_SLOTS (1 << ENCODE_PALETTE_BITS)
+struct encode_palette_t {
+	uint32_t key[ENCODE_PALETTE_SLOTS];  // RGB with bit 24 set so black is not mistaken for an empty slot
+	unsigned char index[ENCODE_PALETTE_SLOTS];
+	uint32_t colour[ENCODE_PALETTE_MAX];
+	int count;
+	encode_palette_t() { clear(); }
+	void clear(void) {
+		memset(key, 0, sizeof(key));
+		count = 0;
+	}
+};
+static encode_palette_t encode_window_palette[COCKPIT_MAX_WINDOWS]; // Only used from the job for that window
+static thread_local encode_palette_t encode_scratch_palette;
+static thread_local std::vector<unsigned char> scanline_buffer; // Filter byte and then the pixels of each row
+
+// Works out the palette index of every pixel, adding any new colours to the palette, and writes them out as PNG
+// scanlines. Returns false if there are too many colours, and sets unused if the palette has colours from earlier
+// frames that are no longer in this one.
+static bool encode_palette_census(encode_palette_t &palette, const unsigned char *rows, ptrdiff_t stride, int width, int height, unsigned char *scanlines, bool &unused) {
+	bool seen[ENCODE_PALETTE_MAX] = { false };
+	int seen_count = 0;
+	uint32_t last = 0;
+	unsigned char last_index = 0;
+	for (int y = 0; y < height; y++) {
+		const unsigned char *rgba = rows + y * stride;
+		unsigned char *out = scanlines + (size_t)y * (width + 1);
+		*out++ = 0; // No filter
+		for (int x = 0; x < width; x++, rgba += 4) {
+			uint32_t key = rgba[0] | (rgba[1] << 8) | (rgba[2] << 16) | (1u << 24);
+			if (key != last) {
+				// Runs of the same colour are very common, so the table is only searched when the colour changes
+				uint32_t slot = (key * 0x9E3779B1u) >> (32 - ENCODE_PALETTE_BITS);
+				while (palette.key[slot] != key) {
+					if (palette.key[slot] == 0) {
+						if (palette.count == ENCODE_PALETTE_MAX)
+							return false;
+						palette.key[slot] = key;
+						palette.index[slot] = (unsigned char)palette.count;
+						palette.colour[palette.count++] = key;
+						break;
+					}
+					slot = (slot + 1) & (ENCODE_PALETTE_SLOTS - 1);
+				}
+				last = key;
+				last_index = palette.index[slot];
+				if (!seen[last_index]) {
+					seen[last_index] = true;
+					seen_count++;
+				}
+			}
+			out[x] = last_index;
+		}
+	}
+	unused = (seen_count < palette.count);
+	return true;
+}
+
+// The same scanlines for an RGB image, dropping the alpha on the way
+static void encode_rgb_scanlines(const unsigned char *rows, ptrdiff_t stride, int width, int height, unsigned char *scanlines) {
+	for (int y = 0; y < height; y++) {
+		const unsigned char *rgba = rows + y * stride;
+		unsigned char *out = scanlines + (size_t)y * (width * 3 + 1);
+		*out++ = 0; // No filter
+		// Copying 4 bytes at a time is much quicker, and the byte past each pixel is overwritten by the next one
+		int x = 0;
+		for (; x < width - 1; x++)
+			memcpy(out + x * 3, rgba + x * 4, 4);
+		if (x < width)
+			memcpy(out + x * 3, rgba + x * 4, 3);
+	}
+}
+
+// Chunks are the length of the data, the type, the data and a CRC of the type and data. The length is filled in by
+// encode_png_chunk_end once the data has been added after the type.
+static size_t encode_png_chunk_start(std::vector<unsigned char> &png, const char *type) {
+	size_t start = png.size();
+	png.resize(start + 4);
+	png.insert(png.end(), type, type + 4);
+	return start;
+}
+
+static void encode_png_put32(unsigned char *out, uint32_t value) {
+	out[0] = (unsigned char)(value >> 24);
+	out[1] = (unsigned char)(value >> 16);
+	out[2] = (unsigned char)(value >> 8);
+	out[3] = (unsigned char)value;
+}
+
+static void encode_png_chunk_end(std::vector<unsigned char> &png, size_t start) {
+	encode_png_put32(&png[start], (uint32_t)(png.size() - start - 8));
+	unsigned char crc[4];
+	encode_png_put32(crc, lodepng_crc32(&png[start + 4], png.size() - start - 4));
+	png.insert(png.end(), crc, crc + 4);
+}
+
+// Compress an RGBA image as an RGB or palette PNG, appending it to whatever is already in png_data. rows points at
+// the top row and stride is the bytes from one row to the next, which is negative for the upside down windows in a
+// captured frame, so they are read straight from the frame. The alpha is dropped and the scanlines are built in one
+// pass, and only deflate comes from lodepng. The palette is kept for the next image if it is from
+// encode_window_palette, or NULL to start from nothing.
+static unsigned encode_png_rows(std::vector<unsigned char> &png_data, const unsigned char *rows, ptrdiff_t stride, int width, int height, int preset, encode_palette_t *palette) {
+	const encode_preset_t *settings = &encode_presets[((preset >= 0) && (preset < PNG_PRESET_COUNT)) ? preset : PNG_PRESET_BALANCED];
+	LodePNGCompressSettings zlib;
+	lodepng_compress_settings_init(&zlib);
+	zlib.btype = settings->btype;
+	zlib.use_lz77 = (settings->btype != 0);
+	if (settings->windowsize > 0)
+		zlib.windowsize = settings->windowsize;
+	zlib.lazymatching = settings->lazymatching;
+	zlib.nicematch = settings->nicematch;
+
+	if (palette == NULL) {
+		palette = &encode_scratch_palette;
+		palette->clear();
+	}
+	scanline_buffer.resize((size_t)(width * 3 + 1) * height);
+	bool unused = false;
+	bool fits = encode_palette_census(*palette, rows, stride, width, height, scanline_buffer.data(), unused);
+	if (!fits && (palette->count > 0)) {
+		// Colours left over from earlier frames may have filled it up, so try again with just this one
+		palette->clear();
+		fits = encode_palette_census(*palette, rows, stride, width, height, scanline_buffer.data(), unused);
+	}
+	if (!fits) {
+		palette->clear();
+		encode_rgb_scanlines(rows, stride, width, height, scanline_buffer.data());
+	}
+
+	static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	png_data.insert(png_data.end(), signature, signature + 8);
+	size_t chunk = encode_png_chunk_start(png_data, "IHDR");
+	unsigned char ihdr[13];
+	encode_png_put32(ihdr, width);
+	encode_png_put32(ihdr + 4, height);
+	ihdr[8] = 8;                 // Bit depth
+	ihdr[9] = fits ? 3 : 2;      // Palette or RGB
+	ihdr[10] = ihdr[11] = ihdr[12] = 0; // Deflate, adaptive filtering and no interlacing, the only ones there are
+	png_data.insert(png_data.end(), ihdr, ihdr + 13);
+	encode_png_chunk_end(png_data, chunk);
+	if (fits) {
+		chunk = encode_png_chunk_start(png_data, "PLTE");
+		for (int c = 0; c < palette->count; c++) {
+			uint32_t colour = palette->colour[c];
+			unsigned char rgb[3] = { (unsigned char)colour, (unsigned char)(colour >> 8), (unsigned char)(colour >> 16) };
+			png_data.insert(png_data.end(), rgb, rgb + 3);
+		}
+		encode_png_chunk_end(png_data, chunk);
+		// Once the display has moved on from some of the colours they are dropped, rather than being sent every frame
+		if (unused)
+			palette->clear();
+	}
+	chunk = encode_png_chunk_start(png_data, "IDAT");
+	size_t line = fits ? (size_t)width + 1 : (size_t)width * 3 + 1;
+	unsigned error = lodepng::compress(png_data, scanline_buffer.data(), line * height, zlib);
+	if (error)
+		return error;
+	encode_png_chunk_end(png_data, chunk);
+	chunk = encode_png_chunk_start(png_data, "IEND");
+	encode_png_chunk_end(png_data, chunk);
+	return 0;
+}
+
+void encode_window_png(std::vector<unsigned char> &png_data, const capture_frame_t *frame, int i) {
+	// Sub-image dimensions were worked out by the capture code, which packed each window on its own
+	const capture_window_t *win = &frame->layout[i];
+	ptrdiff_t stride = (ptrdiff_t)win->width * 4;
+	if ((win->width <= 0) || (win->height <= 0)) {
+		log_printf("Error! Empty window %d with size %dx%d\n", i, win->width, win->height);
+		return;
+	}
+
+	// The rows are upside down, so start from the last one and work backwards
+	png_data.clear();
+	const unsigned char *top = frame->pixels.data() + win->offset + (win->height - 1) * stride;
+	unsigned error = encode_png_rows(png_data, top, -stride, win->width, win->height, encode_window_preset(i), &encode_window_palette[i]);
+	if (error)
+		log_printf("PNG encode of window %d failed with error %u: %s\n", i, error, lodepng_error_text(error));
+}
+
+// Resizing works out ahead of time which source pixels go into each output pixel along one axis, and how much of each,
+// so the inner loops are just multiply and add. The weights for each output pixel add up to 256.
+struct encode_resample_axis_t {
+	std::vector<int> first;     // First source pixel for each output pixel
+	std::vector<int> count;     // Number of source pixels
+	std::vector<int> index;     // Where the weights for each output pixel start
+	std::vector<uint16_t> weight;
+};
+
+// Each output pixel is the average of the source pixels it covers, weighted by how much of each is covered. This is a
+// box filter for whole number ratios, and still averages everything properly when shrinking by awkward amounts.
+static void encode_resample_axis(encode_resample_axis_t &axis, int src, int dst) {
+	axis.first.resize(dst);
+	axis.count.resize(dst);
+	axis.index.resize(dst);
+	axis.weight.clear();
+	for (int o = 0; o < dst; o++) {
+		// Work in units of 1/dst of a source pixel, so the edges of every output pixel are whole numbers
+		long long start = (long long)o * src, end = (long long)(o + 1) * src;
+		int first = (int)(start / dst);
+		int last = (int)((end - 1) / dst);
+		axis.first[o] = first;
+		axis.count[o] = last - first + 1;
+		axis.index[o] = (int)axis.weight.size();
+		int total = 0, biggest = 0, biggest_index = axis.index[o];
+		for (int s = first; s <= last; s++) {
+			long long lo = ((long long)s * dst > start) ? (long long)s * dst : start;
+			long long hi = ((long long)(s + 1) * dst < end) ? (long long)(s + 1) * dst : end;
+			int w = (int)(((hi - lo) * 256 + src / 2) / src);
+			if (w > biggest) {
+				biggest = w;
+				biggest_index = (int)axis.weight.size();
+			}
+			axis.weight.push_back((uint16_t)w);
+			total += w;
+		}
+		// Rounding can leave the total slightly off, which would make the image lighter or darker
+		axis.weight[biggest_index] = (uint16_t)(axis.weight[biggest_index] + 256 - total);
+	}
+}
+
+// Shrink a window to width x height, flipping it the right way up on the way. The rows are shrunk first into 16 bit
+// values (pixel x 256), then the columns. With SSE2 all four channels of a pixel are done at once, the other builds
+// (the arm64 half of the Mac plugin) use plain loops that give exactly the same result.
+static thread_local encode_resample_axis_t resample_x, resample_y;
+static thread_local std::vector<uint16_t> resample_rows;
+
+static void encode_resample_window(unsigned char *dest, const capture_frame_t *frame, int i, int width, int height) {
+	const capture_window_t *win = &frame->layout[i];
+	encode_resample_axis(resample_x, win->width, width);
+	encode_resample_axis(resample_y, win->height, height);
+	size_t row_values = (size_t)width * 4;
+	resample_rows.resize(row_values * win->height);
+
+	for (int y = 0; y < win->height; y++) {
+		const unsigned char *src = frame->pixels.data() + win->offset + (size_t)(win->height - 1 - y) * win->width * 4;
+		uint16_t *out = resample_rows.data() + row_values * y;
+		for (int ox = 0; ox < width; ox++) {
+			const unsigned char *p = src + (size_t)resample_x.first[ox] * 4;
+			const uint16_t *w = &resample_x.weight[resample_x.index[ox]];
+			int count = resample_x.count[ox];
+#ifdef ENCODE_SSE2
+			// 255 x 256 still fits in 16 bits, and the weights add up to 256, so the sum cannot overflow either
+			const __m128i zero = _mm_setzero_si128();
+			__m128i sum = zero;
+			for (int k = 0; k < count; k++) {
+				int32_t rgba;
+				memcpy(&rgba, p + k * 4, 4);
+				__m128i pixel = _mm_unpacklo_epi8(_mm_cvtsi32_si128(rgba), zero);
+				sum = _mm_add_epi16(sum, _mm_mullo_epi16(pixel, _mm_set1_epi16((short)w[k])));
+			}
+			_mm_storel_epi64((__m128i *)(out + ox * 4), sum);
+#else
+			unsigned sum[4] = { 0, 0, 0, 0 };
+			for (int k = 0; k < count; k++)
+				for (int c = 0; c < 4; c++)
+					sum[c] += p[k * 4 + c] * w[k];
+			for (int c = 0; c < 4; c++)
+				out[ox * 4 + c] = (uint16_t)sum[c];
+#endif
+		}
+	}
+
+	for (int oy = 0; oy < height; oy++) {
+		const uint16_t *rows = resample_rows.data() + row_values * resample_y.first[oy];
+		const uint16_t *w = &resample_y.weight[resample_y.index[oy]];
+		int count = resample_y.count[oy];
+		size_t v = 0;
+#ifdef ENCODE_SSE2
+		// Two pixels at a time, with the products widened to 32 bits since they no longer fit in 16
+		const __m128i round = _mm_set1_epi32(1 << 15);
+		for (; v + 8 <= row_values; v += 8) {
+			__m128i lo_sum = _mm_setzero_si128(), hi_sum = _mm_setzero_si128();
+			for (int k = 0; k < count; k++) {
+				__m128i values = _mm_loadu_si128((const __m128i *)(rows + row_values * k + v));
+				__m128i weight = _mm_set1_epi16((short)w[k]);
+				__m128i lo = _mm_mullo_epi16(values, weight);
+				__m128i hi = _mm_mulhi_epu16(values, weight);
+				lo_sum = _mm_add_epi32(lo_sum, _mm_unpacklo_epi16(lo, hi));
+				hi_sum = _mm_add_epi32(hi_sum, _mm_unpackhi_epi16(lo, hi));
+			}
+			lo_sum = _mm_srli_epi32(_mm_add_epi32(lo_sum, round), 16);
+			hi_sum = _mm_srli_epi32(_mm_add_epi32(hi_sum, round), 16);
+			__m128i packed = _mm_packs_epi32(lo_sum, hi_sum);
+			_mm_storel_epi64((__m128i *)(dest + v), _mm_packus_epi16(packed, packed));
+		}
+#endif
+		for (; v < row_values; v++) {
+			unsigned sum = 0;
+			for (int k = 0; k < count; k++)
+				sum += (unsigned)rows[row_values * k + v] * w[k];
+			dest[v] = (unsigned char)((sum + (1 << 15)) >> 16);
+		}
+		dest += row_values;
+	}
+}
+
+// Compress a window shrunk to width x height, for clients that asked for a smaller image or cannot keep up with the full size
+void encode_window_png_resized(std::vector<unsigned char> &png_data, const capture_frame_t *frame, int i, int width, int height) {
+	sub_buffer.resize((size_t)width * height * 4);
+	encode_resample_window(sub_buffer.data(), frame, i, width, height);
+
+	png_data.clear();
+	// Several sizes of one window can be compressed at once, so these do not use the palette kept for the window
+	unsigned error = encode_png_rows(png_data, sub_buffer.data(), (ptrdiff_t)width * 4, width, height, encode_window_preset(i), NULL);
+	if (error)
+		log_printf("PNG encode of window %d at %dx%d failed with error %u: %s\n", i, width, height, error, lodepng_error_text(error));
+}
+
+// The same for the clients that are sent the window as a JPEG, see XTextureExtractorJpeg.cpp
+void encode_window_jpeg_resized(std::vector<unsigned char> &jpeg_data, const capture_frame_t *frame, int i, int width, int height, int quality, bool subsample) {
+	sub_buffer.resize((size_t)width * height * 4);
+	encode_resample_window(sub_buffer.data(), frame, i, width, height);
+	encode_jpeg_rgba(jpeg_data, sub_buffer.data(), (ptrdiff_t)width * 4, width, height, quality, subsample);
+}
+
+// QOI (https://qoiformat.org) is a much simpler lossless format than PNG, with no deflate, that compresses several times
+// faster for images about 45% bigger on the flat coloured displays. It is only sent to XTEv4 clients that asked for it,
+// since it only makes sense on a fast network. The window is read straight from the frame bottom row last, with alpha
+// left out since the displays are opaque.
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+
+static unsigned char *encode_qoi_be32(unsigned char *out, uint32_t value) {
+	*out++ = (unsigned char)(value >> 24);
+	*out++ = (unsigned char)(value >> 16);
+	*out++ = (unsigned char)(value >> 8);
+	*out++ = (unsigned char)value;
+	return out;
+}
+
+void encode_window_qoi(std::vector<unsigned char> &qoi_data, const capture_frame_t *frame, int i) {
+	const capture_window_t *win = &frame->layout[i];
+	int stride = win->width * 4;
+	// Worst case is 4 bytes per pixel, written to the thread's buffer and copied out once the real size is known
+	sub_buffer.resize((size_t)win->width * win->height * 4 + 14 + 8);
+	unsigned char *out = sub_buffer.data();
+	memcpy(out, "qoif", 4);
+	out = encode_qoi_be32(out + 4, win->width);
+	out = encode_qoi_be32(out, win->height);
+	*out++ = 3; // RGB
+	*out++ = 0; // sRGB with linear alpha
+
+	// Pixels are packed as r | g << 8 | b << 16 | a << 24, always with an alpha of 255
+	uint32_t index[64] = {};
+	uint32_t prev = 0xFF000000u;
+	int run = 0;
+	for (int y = 0; y < win->height; y++) {
+		const unsigned char *src = frame->pixels.data() + win->offset + (size_t)(win->height - 1 - y) * stride;
+		for (int x = 0; x < win->width; x++, src += 4) {
+			uint32_t px = src[0] | (src[1] << 8) | (src[2] << 16) | 0xFF000000u;
+			if (px == prev) {
+				if (++run == 62) {
+					*out++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				*out++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			int hash = (src[0] * 3 + src[1] * 5 + src[2] * 7 + 255 * 11) & 63;
+			if (index[hash] == px) {
+				*out++ = QOI_OP_INDEX | hash;
+			} else {
+				index[hash] = px;
+				// Differences wrap around, so 255 to 0 is +1
+				int dr = (signed char)(src[0] - (prev & 0xFF));
+				int dg = (signed char)(src[1] - ((prev >> 8) & 0xFF));
+				int db = (signed char)(src[2] - ((prev >> 16) & 0xFF));
+				int dr_dg = dr - dg, db_dg = db - dg;
+				if ((dr >= -2) && (dr <= 1) && (dg >= -2) && (dg <= 1) && (db >= -2) && (db <= 1)) {
+					*out++ = QOI_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+				} else if ((dg >= -32) && (dg <= 31) && (dr_dg >= -8) && (dr_dg <= 7) && (db_dg >= -8) && (db_dg <= 7)) {
+					*out++ = QOI_OP_LUMA | (dg + 32);
+					*out++ = ((dr_dg + 8) << 4) | (db_dg + 8);
+				} else {
+					*out++ = QOI_OP_RGB;
+					*out++ = src[0];
+					*out++ = src[1];
+					*out++ = src[2];
+				}
+			}
+			prev = px;
+		}
+	}
+	if (run > 0)
+		*out++ = QOI_OP_RUN | (run - 1);
+	static const unsigned char end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	memcpy(out, end_marker, sizeof(end_marker));
+	out += sizeof(end_marker);
+	qoi_data.assign(sub_buffer.data(), out);
+}
+
+// Remember what the delta clients have been sent for a window, so the next delta can be worked out from it
+void encode_window_reference(std::vector<unsigned char> &reference, const capture_frame_t *frame, int i) {
+	const capture_window_t *win = &frame->layout[i];
+	const unsigned char *src = frame->pixels.data() + win->offset;
+	reference.assign(src, src + (size_t)win->width * win->height * 4);
+}
+
+// Work out which DELTA_TILE_SIZE tiles of a window are different to the reference, and compress just those.
+// The payload is a list of 2 byte little-endian tile x,y pairs (counted in tiles from the top left), followed
+// by a PNG that is one tile wide with the changed tiles stacked on top of each other in the same order. Tiles on
+// the right and bottom edges are clipped by the window, and the unused part of their slot is left black.
+// Returns the number of tiles, 0 if nothing changed, or -1 if the whole window should be sent instead.
+// The reference is updated to match the window whenever something is returned.
+int encode_window_delta(std::vector<unsigned char> &payload, const capture_frame_t *frame, int i, std::vector<unsigned char> &reference) {
+	const capture_window_t *win = &frame->layout[i];
+	const int tile = DELTA_TILE_SIZE;
+	int stride = win->width * 4;
+	const unsigned char *pixels = frame->pixels.data() + win->offset;
+	if (reference.size() != (size_t)stride * win->height) {
+		// Nothing valid to compare against, which happens if the delta clients have never seen this window
+		encode_window_reference(reference, frame, i);
+		return -1;
+	}
+
+	// Compare each tile row by row, the rows in the buffer are bottom first but tiles are counted from the top
+	int tiles_x = (win->width + tile - 1) / tile;
+	int tiles_y = (win->height + tile - 1) / tile;
+	std::vector<std::pair<int,int>> dirty;
+	std::vector<char> tile_dirty(tiles_x);
+	for (int ty = 0; ty < tiles_y; ty++) {
+		std::fill(tile_dirty.begin(), tile_dirty.end(), 0);
+		for (int y = ty * tile; (y < (ty + 1) * tile) && (y < win->height); y++) {
+			size_t row = (size_t)(win->height - 1 - y) * stride;
+			for (int tx = 0; tx < tiles_x; tx++) {
+				if (tile_dirty[tx])
+					continue;
+				int x = tx * tile;
+				int bytes = ((win->width - x < tile) ? win->width - x : tile) * 4;
+				if (memcmp(pixels + row + x * 4, reference.data() + row + x * 4, bytes))
+					tile_dirty[tx] = 1;
+			}
+		}
+		for (int tx = 0; tx < tiles_x; tx++)
+			if (tile_dirty[tx])
+				dirty.push_back(std::make_pair(tx, ty));
+	}
+	if (dirty.empty())
+		return 0;
+	memcpy(reference.data(), pixels, reference.size());
+
+	// When most of the window has changed the tiles compress worse than a single image would
+	if (dirty.size() * 4 > (size_t)tiles_x * tiles_y * 3)
+		return -1;
+
+	// Stack the tiles into a buffer one tile wide, flipping them the right way up as they are copied
+	int count = (int)dirty.size();
+	sub_buffer.assign((size_t)tile * 4 * tile * count, 0);
+	for (int t = 0; t < count; t++) {
+		int x = dirty[t].first * tile;
+		int y0 = dirty[t].second * tile;
+		int bytes = ((win->width - x < tile) ? win->width - x : tile) * 4;
+		for (int r = 0; (r < tile) && (y0 + r < win->height); r++) {
+			const unsigned char *src = pixels + (size_t)(win->height - 1 - (y0 + r)) * stride + x * 4;
+			memcpy(&sub_buffer[((size_t)t * tile + r) * tile * 4], src, bytes);
+		}
+	}
+
+	payload.clear();
+	for (int t = 0; t < count; t++) {
+		payload.push_back(dirty[t].first & 0xFF);
+		payload.push_back(dirty[t].first >> 8);
+		payload.push_back(dirty[t].second & 0xFF);
+		payload.push_back(dirty[t].second >> 8);
+	}
+	// The PNG goes straight on the end of the tile list
+	unsigned error = encode_png_rows(payload, sub_buffer.data(), (ptrdiff_t)tile * 4, tile, tile * count, encode_window_preset(i), NULL);
+	if (error) {
+		log_printf("PNG encode of %d tiles for window %d failed with error %u: %s\n", count, i, error, lodepng_error_text(error));
+		return -1;
+	}
+	return count;
+}
+
+
+// Worker pool that runs one job per window. The calling thread works on jobs as well, so a pool of
+// N threads only starts N-1 workers, and with one thread everything runs inline like it used to.
+// The workers are detached like the networking thread, so the pool is allocated once and never freed
+// in case the static destructors run while a worker is still waiting on it when the plugin unloads.
+struct encode_pool_t {
+	std::mutex mutex;
+	std::condition_variable wake;      // Workers wait here for a new batch of jobs
+	std::condition_variable done;      // The caller waits here for the batch to finish, or the workers to exit
+	const std::function<void(int)> *job = NULL;
+	int job_count = 0;
+	int next = 0;                      // Next job index to hand out
+	int remaining = 0;                 // Jobs not finished yet
+	int busy = 0;                      // Workers still looking at the current batch
+	unsigned generation = 0;           // Bumped for every batch so workers know there is new work
+	int workers = 0;                   // Worker threads currently running
+	bool stopping = false;
+};
+static encode_pool_t *encode_pool = NULL;
+
+// Grab jobs from the current batch until there are none left, must be called with the lock held
+static void encode_run_jobs(std::unique_lock<std::mutex> &lock) {
+	encode_pool_t *pool = encode_pool;
+	while (pool->next < pool->job_count) {
+		int i = pool->next++;
+		lock.unlock();
+		(*pool->job)(i);
+		lock.lock();
+		if (--pool->remaining == 0)
+			pool->done.notify_all();
+	}
+}
+
+static void encode_worker(void) {
+	encode_pool_t *pool = encode_pool;
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	unsigned seen = pool->generation;
+	while (true) {
+		pool->wake.wait(lock, [&] { return pool->stopping || (pool->generation != seen); });
+		if (pool->stopping)
+			break;
+		seen = pool->generation;
+		pool->busy++;
+		encode_run_jobs(lock);
+		pool->busy--;
+		pool->done.notify_all();
+	}
+	pool->workers--;
+	pool->done.notify_all();
+}
+
+static void encode_stop_workers(void) {
+	encode_pool_t *pool = encode_pool;
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->stopping = true;
+	pool->wake.notify_all();
+	pool->done.wait(lock, [&] { return pool->workers == 0; });
+	pool->stopping = false;
+}
+
+static int encode_threads_wanted(void) {
+	int threads = config_encode_threads;
+	if (threads <= 0) {
+		// Leave a core for X-Plane itself
+		threads = (int)std::thread::hardware_concurrency() - 1;
+	}
+	if (threads < 1)
+		threads = 1;
+	if (threads > COCKPIT_MAX_WINDOWS)
+		threads = COCKPIT_MAX_WINDOWS; // There is never more than one job per window
+	return threads;
+}
+
+void encode_parallel_for(int count, const std::function<void(int)> &job) {
+	if (encode_pool == NULL)
+		encode_pool = new encode_pool_t;
+	encode_pool_t *pool = encode_pool;
+
+	// Resize the pool if the config has changed since the last batch
+	int workers = encode_threads_wanted() - 1;
+	if (pool->workers != workers) {
+		encode_stop_workers();
+		log_printf("Starting %d encoder threads\n", workers + 1);
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		for (int i = 0; i < workers; i++)
+			std::thread(encode_worker).detach();
+		pool->workers = workers;
+	}
+
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->job = &job;
+	pool->job_count = count;
+	pool->next = 0;
+	pool->remaining = count;
+	pool->generation++;
+	pool->wake.notify_all();
+	encode_run_jobs(lock);
+	// Wait for the workers to finish their jobs, and to let go of this batch before the job goes out of scope
+	pool->done.wait(lock, [&] { return (pool->remaining == 0) && (pool->busy == 0); });
+	pool->job = NULL;
+	pool->job_count = 0;
+}
+
+// Quick 64-bit hash of the pixels in a window, so the network thread can tell if it has changed since the last
+// time it was sent. This is not cryptographic, it just needs to be much cheaper than compressing the window.
+// Four independent lanes keep the multiplies from waiting on each other.
+uint64_t capture_hash_window(const capture_frame_t *frame, int i) {
+	const capture_window_t *win = &frame->layout[i];
+	size_t len = (size_t)win->width * win->height * 4;
+	const unsigned char *p = frame->pixels.data() + win->offset;
+	const uint64_t mul = 0x9E3779B97F4A7C15ULL;
+	uint64_t h[4] = { len, len ^ 0x243F6A8885A308D3ULL, len ^ 0x13198A2E03707344ULL, len ^ 0xA4093822299F31D0ULL };
+	size_t pos = 0;
+	for (; pos + 32 <= len; pos += 32) {
+		for (int lane = 0; lane < 4; lane++) {
+			uint64_t w;
+			memcpy(&w, p + pos + lane * 8, 8);
+			h[lane] = (h[lane] ^ w) * mul;
+			h[lane] ^= h[lane] >> 29;
+		}
+	}
+	// Windows are always a multiple of 4 bytes, but not necessarily of 32
+	for (; pos + 4 <= len; pos += 4) {
+		uint32_t w;
+		memcpy(&w, p + pos, 4);
+		h[0] = (h[0] ^ w) * mul;
+		h[0] ^= h[0] >> 29;
+	}
+	uint64_t result = h[0];
+	for (int lane = 1; lane < 4; lane++) {
+		result = (result ^ h[lane]) * mul;
+		result ^= result >> 32;
+	}
+	return result;
+}
@@ -0,0 +1,439 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+// Baseline JPEG encoder for the windows, for tablets on slow WiFi that cannot keep up with PNG. Everything a decoder
+// needs is in the standard tables from Annex K of the JPEG specification, so any decoder can show it, including
+// ImageIO in Java and BitmapFactory on Android. The colour conversion, DCT and quantization work on 4 values at a
+// time with SSE2 where it is available, with a plain C++ version of the same steps for everything else.
+
+#include "XTextureExtractor.h"
+#include <vector>
+#include <math.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define JPEG_SSE2
+#endif
+
+
+// Natural order index of each coefficient in zigzag order
+static const int jpeg_zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Quantization tables for quality 50, in natural order
+static const unsigned char jpeg_quant_luma[64] = {
+	16,  11,  10,  16,  24,  40,  51,  61,
+	12,  12,  14,  19,  26,  58,  60,  55,
+	14,  13,  16,  24,  40,  57,  69,  56,
+	14,  17,  22,  29,  51,  87,  80,  62,
+	18,  22,  37,  56,  68, 109, 103,  77,
+	24,  35,  55,  64,  81, 104, 113,  92,
+	49,  64,  78,  87, 103, 121, 120, 101,
+	72,  92,  95,  98, 112, 100, 103,  99,
+};
+static const unsigned char jpeg_quant_chroma[64] = {
+	17,  18,  24,  47,  99,  99,  99,  99,
+	18,  21,  26,  66,  99,  99,  99,  99,
+	24,  26,  56,  99,  99,  99,  99,  99,
+	47,  66,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+};
+
+// Huffman tables as they go in the DHT segment, the number of codes of each length from 1 to 16 and then the symbols
+static const unsigned char jpeg_dc_luma_bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char jpeg_dc_chroma_bits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char jpeg_dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const unsigned char jpeg_ac_luma_bits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D };
+static const unsigned char jpeg_ac_luma_values[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+	0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+	0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+	0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA,
+};
+static const unsigned char jpeg_ac_chroma_bits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char jpeg_ac_chroma_values[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+	0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+	0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+	0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+	0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+	0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA,
+};
+
+// Code and length in bits for each symbol, worked out from the DHT form of the table
+struct jpeg_huffman_t {
+	uint16_t code[256];
+	uint8_t size[256];
+	jpeg_huffman_t(const unsigned char *bits, const unsigned char *values) {
+		int k = 0;
+		uint16_t next = 0;
+		for (int length = 1; length <= 16; length++) {
+			for (int n = 0; n < bits[length - 1]; n++, k++) {
+				code[values[k]] = next++;
+				size[values[k]] = length;
+			}
+			next <<= 1;
+		}
+	}
+};
+static const jpeg_huffman_t jpeg_dc_luma(jpeg_dc_luma_bits, jpeg_dc_values);
+static const jpeg_huffman_t jpeg_dc_chroma(jpeg_dc_chroma_bits, jpeg_dc_values);
+static const jpeg_huffman_t jpeg_ac_luma(jpeg_ac_luma_bits, jpeg_ac_luma_values);
+static const jpeg_huffman_t jpeg_ac_chroma(jpeg_ac_chroma_bits, jpeg_ac_chroma_values);
+
+// Packs the Huffman codes into bytes, with a zero after every 0xFF so it cannot be mistaken for a marker
+struct jpeg_writer_t {
+	std::vector<unsigned char> &out;
+	uint32_t bits = 0;
+	int count = 0;
+	jpeg_writer_t(std::vector<unsigned char> &o) : out(o) {}
+	void put(uint32_t code, int size) {
+		bits = (bits << size) | code;
+		count += size;
+		while (count >= 8) {
+			unsigned char b = (unsigned char)(bits >> (count - 8));
+			out.push_back(b);
+			if (b == 0xFF)
+				out.push_back(0);
+			count -= 8;
+		}
+	}
+	void flush(void) {
+		if (count > 0)
+			put((1u << (8 - count)) - 1, 8 - count); // Padded with ones
+	}
+};
+
+// Everything that depends on the quality, worked out once for each image
+struct jpeg_tables_t {
+	unsigned char quant[2][64]; // Luma and chroma, in natural order
+	float scale[2][64];         // What to multiply the DCT output by to quantize it
+};
+
+static void jpeg_make_tables(jpeg_tables_t &tables, int quality) {
+	// The same scaling of the standard tables as libjpeg, so the quality means the same as it does everywhere else
+	quality = (quality < 1) ? 1 : (quality > 100) ? 100 : quality;
+	int percent = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+	// The AAN DCT leaves each output multiplied by these, so they are divided out along with the quantization
+	static const double aan[8] = { 1.0, 1.387039845, 1.306562965, 1.175875602, 1.0, 0.785694958, 0.541196100, 0.275899379 };
+	for (int t = 0; t < 2; t++) {
+		const unsigned char *base = (t == 0) ? jpeg_quant_luma : jpeg_quant_chroma;
+		for (int k = 0; k < 64; k++) {
+			int q = (base[k] * percent + 50) / 100;
+			q = (q < 1) ? 1 : (q > 255) ? 255 : q;
+			tables.quant[t][k] = (unsigned char)q;
+			tables.scale[t][k] = (float)(1.0 / (q * aan[k / 8] * aan[k % 8] * 8.0));
+		}
+	}
+}
+
+// One pass of the AAN forward DCT from libjpeg's jfdctflt.c, on 8 values that can each be a vector of columns
+template <typename T> static inline void jpeg_fdct_1d(T *d) {
+	T tmp0 = d[0] + d[7], tmp7 = d[0] - d[7];
+	T tmp1 = d[1] + d[6], tmp6 = d[1] - d[6];
+	T tmp2 = d[2] + d[5], tmp5 = d[2] - d[5];
+	T tmp3 = d[3] + d[4], tmp4 = d[3] - d[4];
+
+	T tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+	T tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+	d[0] = tmp10 + tmp11;
+	d[4] = tmp10 - tmp11;
+	T z1 = (tmp12 + tmp13) * 0.707106781f;
+	d[2] = tmp13 + z1;
+	d[6] = tmp13 - z1;
+
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+	T z5 = (tmp10 - tmp12) * 0.382683433f;
+	T z2 = tmp10 * 0.541196100f + z5;
+	T z4 = tmp12 * 1.306562965f + z5;
+	T z3 = tmp11 * 0.707106781f;
+	T z11 = tmp7 + z3, z13 = tmp7 - z3;
+	d[5] = z13 + z2;
+	d[3] = z13 - z2;
+	d[1] = z11 + z4;
+	d[7] = z11 - z4;
+}
+
+#ifdef JPEG_SSE2
+// Just enough of a float vector for jpeg_fdct_1d
+struct jpeg_f4 {
+	__m128 v;
+	jpeg_f4() {}
+	jpeg_f4(__m128 x) : v(x) {}
+	jpeg_f4 operator+(const jpeg_f4 &o) const { return _mm_add_ps(v, o.v); }
+	jpeg_f4 operator-(const jpeg_f4 &o) const { return _mm_sub_ps(v, o.v); }
+	jpeg_f4 operator*(float f) const { return _mm_mul_ps(v, _mm_set1_ps(f)); }
+};
+
+// DCT of an 8x8 block in place, 4 columns at a time. The rows are done by transposing and doing the columns again,
+// and then transposing back.
+static void jpeg_fdct_block(float *block) {
+	for (int pass = 0; pass < 2; pass++) {
+		for (int half = 0; half < 8; half += 4) {
+			jpeg_f4 d[8];
+			for (int k = 0; k < 8; k++)
+				d[k] = _mm_load_ps(block + k * 8 + half);
+			jpeg_fdct_1d(d);
+			for (int k = 0; k < 8; k++)
+				_mm_store_ps(block + k * 8 + half, d[k].v);
+		}
+		// Transpose as four 4x4 blocks, swapping the top right and bottom left ones
+		__m128 r[8][2];
+		for (int k = 0; k < 8; k++) {
+			r[k][0] = _mm_load_ps(block + k * 8);
+			r[k][1] = _mm_load_ps(block + k * 8 + 4);
+		}
+		for (int by = 0; by < 2; by++)
+			for (int bx = 0; bx < 2; bx++)
+				_MM_TRANSPOSE4_PS(r[by * 4][bx], r[by * 4 + 1][bx], r[by * 4 + 2][bx], r[by * 4 + 3][bx]);
+		for (int k = 0; k < 4; k++) {
+			_mm_store_ps(block + k * 8, r[k][0]);
+			_mm_store_ps(block + k * 8 + 4, r[k + 4][0]);
+			_mm_store_ps(block + (k + 4) * 8, r[k][1]);
+			_mm_store_ps(block + (k + 4) * 8 + 4, r[k + 4][1]);
+		}
+	}
+}
+
+static void jpeg_quantize(int *coef, const float *block, const float *scale) {
+	for (int k = 0; k < 64; k += 4)
+		_mm_storeu_si128((__m128i *)(coef + k), _mm_cvtps_epi32(_mm_mul_ps(_mm_load_ps(block + k), _mm_load_ps(scale + k))));
+}
+
+// Converts n pixels (a multiple of 4) of RGBA to Y, Cb and Cr centred on zero
+static void jpeg_convert_row(const unsigned char *rgba, int n, float *y, float *cb, float *cr) {
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	for (int x = 0; x < n; x += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)(rgba + x * 4));
+		__m128 r = _mm_cvtepi32_ps(_mm_and_si128(px, mask));
+		__m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask));
+		__m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask));
+		_mm_store_ps(y + x, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.299f)), _mm_mul_ps(g, _mm_set1_ps(0.587f))), _mm_sub_ps(_mm_mul_ps(b, _mm_set1_ps(0.114f)), _mm_set1_ps(128.0f))));
+		_mm_store_ps(cb + x, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(-0.168736f)), _mm_mul_ps(g, _mm_set1_ps(-0.331264f))), _mm_mul_ps(b, _mm_set1_ps(0.5f))));
+		_mm_store_ps(cr + x, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.5f)), _mm_mul_ps(g, _mm_set1_ps(-0.418688f))), _mm_mul_ps(b, _mm_set1_ps(-0.081312f))));
+	}
+}
+#else
+static void jpeg_fdct_block(float *block) {
+	for (int pass = 0; pass < 2; pass++) {
+		for (int col = 0; col < 8; col++) {
+			float d[8];
+			for (int k = 0; k < 8; k++)
+				d[k] = block[k * 8 + col];
+			jpeg_fdct_1d(d);
+			for (int k = 0; k < 8; k++)
+				block[k * 8 + col] = d[k];
+		}
+		for (int row = 0; row < 8; row++)
+			for (int col = row + 1; col < 8; col++) {
+				float t = block[row * 8 + col];
+				block[row * 8 + col] = block[col * 8 + row];
+				block[col * 8 + row] = t;
+			}
+	}
+}
+
+static void jpeg_quantize(int *coef, const float *block, const float *scale) {
+	for (int k = 0; k < 64; k++)
+		coef[k] = (int)lrintf(block[k] * scale[k]);
+}
+
+static void jpeg_convert_row(const unsigned char *rgba, int n, float *y, float *cb, float *cr) {
+	for (int x = 0; x < n; x++, rgba += 4) {
+		float r = rgba[0], g = rgba[1], b = rgba[2];
+		y[x] = (r * 0.299f + g * 0.587f) + (b * 0.114f - 128.0f);
+		cb[x] = (r * -0.168736f + g * -0.331264f) + b * 0.5f;
+		cr[x] = (r * 0.5f + g * -0.418688f) + b * -0.081312f;
+	}
+}
+#endif
+
+// Number of bits needed for the magnitude of a coefficient, which is its Huffman category
+static inline int jpeg_category(int value) {
+	unsigned magnitude = (value < 0) ? -value : value;
+	int bits = 0;
+	while (magnitude) {
+		bits++;
+		magnitude >>= 1;
+	}
+	return bits;
+}
+
+// Writes the category and then the bits of the value, with negative values stored as one less in that many bits
+static inline void jpeg_put_value(jpeg_writer_t &writer, const jpeg_huffman_t &table, int symbol, int value, int category) {
+	writer.put(table.code[symbol], table.size[symbol]);
+	if (category > 0)
+		writer.put((value < 0 ? value - 1 : value) & ((1 << category) - 1), category);
+}
+
+// DCT, quantize and write one block of samples, which is destroyed in the process
+static void jpeg_encode_block(jpeg_writer_t &writer, float *block, const float *scale, int &dc, const jpeg_huffman_t &dc_table, const jpeg_huffman_t &ac_table) {
+	alignas(16) int coef[64];
+	jpeg_fdct_block(block);
+	jpeg_quantize(coef, block, scale);
+
+	int diff = coef[0] - dc;
+	dc = coef[0];
+	int category = jpeg_category(diff);
+	jpeg_put_value(writer, dc_table, category, diff, category);
+
+	int run = 0;
+	for (int k = 1; k < 64; k++) {
+		int value = coef[jpeg_zigzag[k]];
+		if (value == 0) {
+			run++;
+			continue;
+		}
+		for (; run >= 16; run -= 16)
+			writer.put(ac_table.code[0xF0], ac_table.size[0xF0]);
+		// The standard AC tables only have codes for up to 10 bits, which quality 100 with every quantizer at 1 comes close to
+		value = (value > 1023) ? 1023 : (value < -1023) ? -1023 : value;
+		category = jpeg_category(value);
+		jpeg_put_value(writer, ac_table, (run << 4) | category, value, category);
+		run = 0;
+	}
+	if (run > 0)
+		writer.put(ac_table.code[0x00], ac_table.size[0x00]); // End of block
+}
+
+static void jpeg_put16(std::vector<unsigned char> &out, int value) {
+	out.push_back((unsigned char)(value >> 8));
+	out.push_back((unsigned char)value);
+}
+
+static void jpeg_put_huffman(std::vector<unsigned char> &out, int id, const unsigned char *bits, const unsigned char *values) {
+	int count = 0;
+	out.push_back((unsigned char)id);
+	for (int k = 0; k < 16; k++) {
+		out.push_back(bits[k]);
+		count += bits[k];
+	}
+	out.insert(out.end(), values, values + count);
+}
+
+static void jpeg_put_headers(std::vector<unsigned char> &out, const jpeg_tables_t &tables, int width, int height, bool subsample) {
+	static const unsigned char jfif[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+	out.insert(out.end(), jfif, jfif + sizeof(jfif));
+
+	jpeg_put16(out, 0xFFDB); // Quantization tables, in zigzag order
+	jpeg_put16(out, 2 + 2 * 65);
+	for (int t = 0; t < 2; t++) {
+		out.push_back((unsigned char)t);
+		for (int k = 0; k < 64; k++)
+			out.push_back(tables.quant[t][jpeg_zigzag[k]]);
+	}
+
+	jpeg_put16(out, 0xFFC0); // Baseline frame, with Y at twice the resolution of Cb and Cr when subsampling
+	jpeg_put16(out, 17);
+	out.push_back(8);
+	jpeg_put16(out, height);
+	jpeg_put16(out, width);
+	out.push_back(3);
+	static const unsigned char components[3][3] = { { 1, 0x11, 0 }, { 2, 0x11, 1 }, { 3, 0x11, 1 } };
+	for (int c = 0; c < 3; c++) {
+		out.push_back(components[c][0]);
+		out.push_back(((c == 0) && subsample) ? 0x22 : components[c][1]);
+		out.push_back(components[c][2]);
+	}
+
+	jpeg_put16(out, 0xFFC4);
+	jpeg_put16(out, 2 + 4 * 17 + 12 + 12 + 162 + 162);
+	jpeg_put_huffman(out, 0x00, jpeg_dc_luma_bits, jpeg_dc_values);
+	jpeg_put_huffman(out, 0x10, jpeg_ac_luma_bits, jpeg_ac_luma_values);
+	jpeg_put_huffman(out, 0x01, jpeg_dc_chroma_bits, jpeg_dc_values);
+	jpeg_put_huffman(out, 0x11, jpeg_ac_chroma_bits, jpeg_ac_chroma_values);
+
+	static const unsigned char scan[] = { 0xFF, 0xDA, 0x00, 0x0C, 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+	out.insert(out.end(), scan, scan + sizeof(scan));
+}
+
+// Compress an RGBA image to a JPEG, where rows points at the top row and stride is the bytes from one row to the next,
+// which is negative for the upside down windows in a captured frame. Pixels past the right and bottom edges copy the
+// last row and column, so the partial blocks at the edges do not ring.
+void encode_jpeg_rgba(std::vector<unsigned char> &jpeg_data, const unsigned char *rows, ptrdiff_t stride, int width, int height, int quality, bool subsample) {
+	jpeg_tables_t tables;
+	jpeg_make_tables(tables, quality);
+	jpeg_data.clear();
+	jpeg_put_headers(jpeg_data, tables, width, height, subsample);
+
+	// Each MCU is 16x16 pixels with one 8x8 block each of Cb and Cr when subsampling, otherwise 8x8 with one of each
+	int mcu = subsample ? 16 : 8;
+	alignas(16) float y[16 * 16], cb[16 * 16], cr[16 * 16], block[64];
+	alignas(16) unsigned char edge[16 * 4];
+	int dc[3] = { 0, 0, 0 };
+	jpeg_writer_t writer(jpeg_data);
+	for (int my = 0; my < height; my += mcu) {
+		for (int mx = 0; mx < width; mx += mcu) {
+			for (int r = 0; r < mcu; r++) {
+				const unsigned char *src = rows + ((my + r < height) ? my + r : height - 1) * stride + (ptrdiff_t)mx * 4;
+				if (mx + mcu > width) {
+					for (int x = 0; x < mcu; x++)
+						memcpy(edge + x * 4, src + ((mx + x < width) ? x : width - 1 - mx) * 4, 4);
+					src = edge;
+				}
+				jpeg_convert_row(src, mcu, y + r * mcu, cb + r * mcu, cr + r * mcu);
+			}
+			for (int b = 0; b < mcu * mcu / 64; b++) {
+				int bx = (b % 2) * 8, by = (b / 2) * 8;
+				for (int r = 0; r < 8; r++)
+					memcpy(block + r * 8, y + (by + r) * mcu + bx, 8 * sizeof(float));
+				jpeg_encode_block(writer, block, tables.scale[0], dc[0], jpeg_dc_luma, jpeg_ac_luma);
+			}
+			for (int c = 1; c < 3; c++) {
+				const float *plane = (c == 1) ? cb : cr;
+				for (int r = 0; r < 8; r++)
+					for (int x = 0; x < 8; x++)
+						block[r * 8 + x] = subsample ? (plane[(r * 2) * 16 + x * 2] + plane[(r * 2) * 16 + x * 2 + 1] + plane[(r * 2 + 1) * 16 + x * 2] + plane[(r * 2 + 1) * 16 + x * 2 + 1]) * 0.25f : plane[r * 8 + x];
+				jpeg_encode_block(writer, block, tables.scale[1], dc[c], jpeg_dc_chroma, jpeg_ac_chroma);
+			}
+		}
+	}
+	writer.flush();
+	jpeg_put16(jpeg_data, 0xFFD9);
+}
+
+void encode_window_jpeg(std::vector<unsigned char> &jpeg_data, const capture_frame_t *frame, int i, int quality, bool subsample) {
+	const capture_window_t *win = &frame->layout[i];
+	ptrdiff_t stride = (ptrdiff_t)win->width * 4;
+	const unsigned char *top = frame->pixels.data() + win->offset + (win->height - 1) * stride;
+	encode_jpeg_rgba(jpeg_data, top, -stride, win->width, win->height, quality, subsample);
+}
@@ -27,27 +27,40 @@
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#define poll(fds, nfds, timeout) WSAPoll(fds, nfds, timeout)
+#define SEND_FLAGS 0
+typedef WSABUF network_iovec_t;
+#define NETWORK_IOVEC_SET(iov, ptr, bytes) { (iov).buf = (CHAR *)(ptr); (iov).len = (ULONG)(bytes); }
 #endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <list>
+#include <deque>
+#include <memory>
 
 #pragma comment (lib, "Ws2_32.lib")
 
 #include "XTextureExtractor.h"
 #include <vector>
 #include <thread>
-#include "lodepng/lodepng.h"
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <mutex>
 
 int last_cockpit_texture_seq = -2; // Track when the aircraft changes, and restart the connection so we can resend the updated header
 
-unsigned char sub_buffer[MAX_TEXTURE_WIDTH * MAX_TEXTURE_HEIGHT * 4]; // Ensure we definitely have enough space for 4-byte RGBA images of any supported size
-
 #if LIN || APL
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#if LIN
+#include <linux/sockios.h>
+#endif
+#include <sys/uio.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
@@ -59,8 +72,152 @@ unsigned char sub_buffer[MAX_TEXTURE_WIDTH * MAX_TEXTURE_HEIGHT * 4]; // Ensure
 #include <unistd.h>
 #define Sleep(ms) usleep((ms)*1000)
 #define ZeroMemory(ptr, sz) bzero(ptr, sz)
+#if LIN
+#define SEND_FLAGS MSG_NOSIGNAL // Report a closed socket as an error instead of killing X-Plane with SIGPIPE
+#else
+#define SEND_FLAGS 0 // Uses SO_NOSIGPIPE on each socket instead
+#endif
+typedef struct iovec network_iovec_t;
+#define NETWORK_IOVEC_SET(iov, ptr, bytes) { (iov).iov_base = (void *)(ptr); (iov).iov_len = (bytes); }
+#endif
+#if LIN && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+#endif
+#ifdef IORING_CQE_F_NOTIF // Only headers from 6.0 onwards have everything needed for zero-copy sends
+#define NETWORK_IO_URING 1
 #endif
-std::list<SOCKET> connections;
+
+// Config loaded on the main thread, waiting for the network thread to pick it up between frames
+static std::mutex config_mutex;
+static plugin_config_t config_pending;
+static bool config_changed = false;
+
+void config_publish(const plugin_config_t &config) {
+	std::lock_guard<std::mutex> lock(config_mutex);
+	config_pending = config;
+	config_changed = true;
+}
+
+// Copies the last published config into the config_ globals, which nothing else writes once the network thread is
+// running. The encoders only run inside encode_parallel_for, so they always see the same config as the frame.
+static void config_apply(void) {
+	std::lock_guard<std::mutex> lock(config_mutex);
+	if (!config_changed)
+		return;
+	config_changed = false;
+	const plugin_config_t &c = config_pending;
+	config_encode_threads = c.encode_threads;
+	config_keepalive_msec = c.keepalive_msec;
+	config_keyframe_msec = c.keyframe_msec;
+	memcpy(config_multicast_group, c.multicast_group, sizeof(config_multicast_group));
+	config_multicast_port = c.multicast_port;
+	config_multicast_parity = c.multicast_parity;
+	config_shared_memory = c.shared_memory;
+	config_send_backend = c.send_backend;
+	config_latency_msec = c.latency_msec;
+	config_tcp_port = c.tcp_port;
+	config_png_preset = c.png_preset;
+	config_jpeg_quality = c.jpeg_quality;
+	config_jpeg_subsample = c.jpeg_subsample;
+	config_window_count = c.window_count;
+	memcpy(config_window_name, c.window_name, sizeof(config_window_name));
+	memcpy(config_window_png_preset, c.window_png_preset, sizeof(config_window_png_preset));
+	memcpy(config_window_jpeg_quality, c.window_jpeg_quality, sizeof(config_window_jpeg_quality));
+}
+
+// Header from another thread, waiting for the network thread like the config
+static std::mutex header_mutex;
+static network_header_t header_pending;
+static bool header_changed = false;
+
+void network_publish_header(const network_header_t &header) {
+	std::lock_guard<std::mutex> lock(header_mutex);
+	header_pending = header;
+	header_changed = true;
+}
+
+static void network_apply_header(void) {
+	std::lock_guard<std::mutex> lock(header_mutex);
+	if (!header_changed)
+		return;
+	header_changed = false;
+	const network_header_t &h = header_pending;
+	cockpit_texture_id = h.texture_id;
+	cockpit_texture_width = h.texture_width;
+	cockpit_texture_height = h.texture_height;
+	cockpit_texture_seq = h.texture_seq;
+	strcpy(cockpit_aircraft_name, h.aircraft_name);
+	cockpit_window_limit = h.window_count;
+	memcpy(_g_window_name, h.window_name, sizeof(_g_window_name));
+	memcpy(_g_texture_lbrt, h.texture_lbrt, sizeof(_g_texture_lbrt));
+}
+
+// Send a list of buffers in a single call, returns the number of bytes sent or SOCKET_ERROR
+int network_sendv(SOCKET sock, network_iovec_t *iov, int count) {
+#if IBM
+	DWORD sent = 0;
+	if (WSASend(sock, iov, count, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	return (int)sent;
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	return (int)sendmsg(sock, &msg, SEND_FLAGS);
+#endif
+}
+
+// An encoded record waiting to be sent. Only the small header lives in the record, it is followed on the wire by the
+// encoder's own output buffer and then any padding, so the image data is shared by every client and never copied.
+struct network_record_t {
+	int window = -1;            // Window the record is for, or -1 for the header
+	bool keyframe = true;       // Whole window, rather than a delta that depends on the records before it
+	unsigned char header[48];
+	size_t header_size = 0;
+	std::shared_ptr<const std::vector<unsigned char>> payload;
+	size_t padding = 0;         // Bytes of network_padding after the payload
+	size_t size() const { return header_size + (payload ? payload->size() : 0) + padding; }
+};
+
+// Each connected client, and what it has asked for with command lines sent after the header
+struct network_client_t {
+	SOCKET sock;
+	std::string input;          // Partial command line received so far
+	bool delta = false;         // Client asked for TCP_DELTA_PROTOCOL or TCP_V4_DELTA_PROTOCOL
+	bool v4 = false;            // Client asked for one of the XTEv4 protocols, so records use the compact framing
+	bool multicast = false;     // Client receives the windows from the multicast group, this socket is just for commands
+	uint32_t need_keyframe = ~0u; // Bit for each window that must be sent in full, since the client has not seen it or lost track
+	uint32_t windows = ~0u;     // Bit for each window the client wants, which is all of them until it says otherwise
+	std::deque<network_record_t> queue; // Records waiting to be sent, at most one per window
+	network_record_t sending;   // Record currently being sent, which can no longer be replaced
+	size_t sending_offset = 0;  // How much of the current record has already been sent
+	uint32_t codecs = (1u << XTEV4_CODEC_PNG) | (1u << XTEV4_CODEC_TILES); // Bit for each XTEv4 codec the client can decode
+	// Rate control, see network_measure_client()
+	double rate = 0;            // Bytes per second the client took while it was behind, 0 if it has kept up so far
+	double need = 0;            // Bytes per second the client is being offered, as if every window was full size
+	size_t accepted = 0;        // Bytes handed to the socket since the last measurement
+	size_t offered = 0;         // Bytes queued since the last measurement, and how many frames they were for
+	int offered_frames = 0;
+	int socket_queued = -1;     // Bytes in the socket at the last measurement, -1 if the OS cannot tell us
+	bool idle = false;          // Ran out of things to send since the last measurement
+	bool throttled = false;     // Holding records back since the socket already has as much as the link can send in time
+	int scale = 1;              // 2 when the windows are being sent at half size
+	std::chrono::steady_clock::time_point scale_changed;
+	int size[COCKPIT_MAX_WINDOWS][2] = {}; // Width and height the client asked for each window to be sent at, 0 for full size
+	bool header_updates = false; // Client sent TCP_HEADERS_COMMAND, so is sent a changed header rather than disconnected
+};
+std::list<network_client_t> connections;
+std::atomic<int> network_client_count(0); // Lets the render thread skip capturing when nobody is listening
+bool network_shm_active = false; // A shared memory reader is also waiting for frames
+
+void network_update_client_count() {
+	network_client_count = (int)connections.size() + (network_shm_active ? 1 : 0);
+}
 char header[TCP_INTRO_HEADER];
 
 void recompute_header() {
@@ -74,6 +231,899 @@ void recompute_header() {
 		hptr += sprintf(hptr, "%s %d %d %d %d\n", _g_window_name[i], _g_texture_lbrt[i][0], _g_texture_lbrt[i][1], _g_texture_lbrt[i][2], _g_texture_lbrt[i][3]);
 	}
 	hptr += sprintf(hptr, "__EOF__\n");
+	// Older clients stop reading at __EOF__, newer ones can pick one of these by sending "PROTOCOL <name>"
+	hptr += sprintf(hptr, "PROTOCOLS %s %s %s %s\n", TCP_PROTOCOL_VERSION, TCP_DELTA_PROTOCOL, TCP_V4_PROTOCOL, TCP_V4_DELTA_PROTOCOL);
+	// Clients can send "MULTICAST" to receive the windows from this group instead, as XTEv4-delta records
+	if (config_multicast_group[0] != '\0')
+		hptr += sprintf(hptr, "MULTICAST %s %d\n", config_multicast_group, config_multicast_port);
+}
+
+// Zeros for the XTEv3 padding, every record points at this rather than having its own
+static const unsigned char network_padding[1024] = { 0 };
+
+// Each record is a 16 byte header followed by the data padded out to 1024 bytes. The header is '!', a 5 char type,
+// 1 byte for the window id, '_', 4 bytes for the number of bytes of data, and then 4 bytes that depend on the type.
+void make_record(network_record_t &record, const char *type, int id, const std::shared_ptr<const std::vector<unsigned char>> &payload, const char *extra) {
+	record.window = (id == XTEV4_STREAM_ID) ? -1 : id;
+	record.payload = payload;
+	unsigned char *out = record.header;
+
+	// 7 char header and 1 byte for the window id (8 bytes total)
+	*out++ = '!';
+	memcpy(out, type, 5);
+	out += 5;
+	*out++ = (unsigned char)id;
+	*out++ = '_';
+
+	// 4 bytes little-endian for the number of bytes of data so we can easily skip it if necessary
+	unsigned int num_bytes = payload ? (unsigned int)payload->size() : 0;
+	for (int ch = 0; ch < 4; ch++)
+		*out++ = (unsigned char)(num_bytes >> (ch * 8));
+
+	// Pad the header out with another 4 bytes
+	memcpy(out, extra, 4);
+	out += 4;
+	record.header_size = out - record.header;
+
+	// Null bytes after the data to pad it out to 1024 byte blocks
+	record.padding = 1024 - num_bytes % 1024;
+}
+
+// Unsigned LEB128, 7 bits at a time with the top bit set on every byte except the last
+unsigned char *write_varint(unsigned char *out, uint64_t value) {
+	while (value >= 0x80) {
+		*out++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (unsigned char)value;
+	return out;
+}
+
+// XTEv4 records start with a varint of the number of bytes that follow, so a client can skip any record it does not
+// understand. Then 1 byte for the window id, 1 byte for the codec, varints for the frame sequence number and the
+// capture time in microseconds since 1970, any varints for the codec (tile size and count for XTEV4_CODEC_TILES),
+// and finally the data itself with no padding.
+void make_record_v4(network_record_t &record, int id, int codec, const capture_frame_t *frame, const std::shared_ptr<const std::vector<unsigned char>> &payload, int tiles) {
+	record.window = (id == XTEV4_STREAM_ID) ? -1 : id;
+	record.payload = payload;
+	record.padding = 0;
+	unsigned char fields[sizeof(record.header)];
+	unsigned char *out = fields;
+	*out++ = (unsigned char)id;
+	*out++ = (unsigned char)codec;
+	// Stream records like XTEV4_CODEC_HEADER are not part of a frame
+	out = write_varint(out, frame ? frame->sequence : 0);
+	out = write_varint(out, frame ? frame->capture_usec : capture_time_usec());
+	if (codec == XTEV4_CODEC_TILES) {
+		out = write_varint(out, DELTA_TILE_SIZE);
+		out = write_varint(out, tiles);
+	} else if ((codec == XTEV4_CODEC_PNG_SCALED) || (codec == XTEV4_CODEC_JPEG)) {
+		// The full size of the window, so the client can stretch the image back out
+		out = write_varint(out, frame->layout[id].width);
+		out = write_varint(out, frame->layout[id].height);
+	}
+	size_t fields_size = out - fields;
+	out = write_varint(record.header, fields_size + payload->size());
+	memcpy(out, fields, fields_size);
+	record.header_size = (out - record.header) + fields_size;
+}
+
+// Records already queued for a client use the old framing, so they are dropped and the client is sent an XTEv4
+// record in the old framing to mark where the new framing starts. The dropped windows are sent again as keyframes.
+void network_switch_to_v4(network_client_t &client) {
+	for (auto q = client.queue.begin(); q != client.queue.end(); ) {
+		if (q->window >= 0)
+			q = client.queue.erase(q);
+		else
+			++q;
+	}
+	network_record_t record;
+	make_record(record, TCP_V4_PROTOCOL, XTEV4_STREAM_ID, NULL, "____");
+	client.queue.push_back(record);
+	client.v4 = true;
+}
+
+// A window shrunk for the clients that asked for it smaller or cannot keep up. Clients wanting the same size share it.
+struct network_sized_t {
+	int width, height;
+	int quality;                // JPEG quality for clients that are sent this window as a JPEG, 0 for a PNG
+	bool wanted = false;        // Some client wants the window at this size on the current frame
+	bool keyframe = false;      // One of them needs it even if nothing has changed
+	bool send = false;          // Sent on the current frame
+	bool encode = false;        // Compressed again on the current frame, rather than sending the same data as last time
+	uint64_t hash = 0;          // capture_hash_window() of the pixels in data
+	std::chrono::steady_clock::time_point sent;
+	std::shared_ptr<std::vector<unsigned char>> data;
+	network_record_t record;
+};
+
+// Most recent whole window PNG of each window. New clients are sent these straight after the header, so they have
+// something to show without waiting for the next capture, and windows that have not changed are sent again from here
+// instead of being compressed again. Each image is a new buffer that is never changed, so it can be shared with any
+// clients still sending an older one. The QOI and JPEG clients have their own copies, which are only made while any
+// are connected.
+struct network_cached_t {
+	std::shared_ptr<const std::vector<unsigned char>> image;
+	uint64_t hash = 0;          // capture_hash_window() of the pixels it was compressed from
+	int quality = 0;            // JPEG quality it was compressed with
+};
+network_cached_t window_cache[COCKPIT_MAX_WINDOWS];
+network_cached_t window_qoi[COCKPIT_MAX_WINDOWS];
+network_cached_t window_jpeg[COCKPIT_MAX_WINDOWS];
+
+network_sized_t *network_find_sized(std::vector<network_sized_t> &sizes, int width, int height, int quality) {
+	for (auto &sized : sizes)
+		if ((sized.width == width) && (sized.height == height) && (sized.quality == quality))
+			return &sized;
+	return NULL;
+}
+
+// JPEG quality a window is sent to a client with, which is 0 for a lossless image unless the window has a quality in
+// the config and the client listed JPEG in CODECS
+int network_client_jpeg_quality(const network_client_t &client, const int *window_quality, int i) {
+	return (client.codecs & (1u << XTEV4_CODEC_JPEG)) ? window_quality[i] : JPEG_QUALITY_OFF;
+}
+
+// Size a window is sent to a client at, which is smaller than the window if the client asked for that with SIZE or cannot
+// keep up. Returns false for the full size, or for clients that can only decode full size images.
+bool network_client_window_size(const network_client_t &client, const capture_window_t *win, int i, int &width, int &height) {
+	width = win->width;
+	height = win->height;
+	if (!client.v4 || !(client.codecs & (1u << XTEV4_CODEC_PNG_SCALED)))
+		return false;
+	if ((client.size[i][0] > 0) && (client.size[i][1] > 0)) {
+		// Never bigger than the window, since the client can stretch it just as well as we can
+		if (client.size[i][0] < width)
+			width = client.size[i][0];
+		if (client.size[i][1] < height)
+			height = client.size[i][1];
+	}
+	width = (width + client.scale - 1) / client.scale;
+	height = (height + client.scale - 1) / client.scale;
+	return (width != win->width) || (height != win->height);
+}
+
+// The aircraft changed, so send the new header in the client's framing. Queued records are for the old windows and are
+// dropped, anything after the header is for the new windows and every one of them starts with a keyframe. The
+// client is expected to SUBSCRIBE again, and ask for SIZE again if it wants that.
+void network_send_header_update(network_client_t &client) {
+	for (auto q = client.queue.begin(); q != client.queue.end(); ) {
+		if (q->window >= 0)
+			q = client.queue.erase(q);
+		else
+			++q;
+	}
+	network_record_t record;
+	auto payload = std::make_shared<std::vector<unsigned char>>(header, header + TCP_INTRO_HEADER);
+	if (client.v4)
+		make_record_v4(record, XTEV4_STREAM_ID, XTEV4_CODEC_HEADER, NULL, payload, 0);
+	else
+		make_record(record, "HEADR", XTEV4_STREAM_ID, payload, "____");
+	client.queue.push_back(record);
+	client.need_keyframe = ~0u;
+	memset(client.size, 0, sizeof(client.size));
+}
+
+void network_client_command(network_client_t &client, const std::string &line) {
+	if (line == "PROTOCOL " TCP_DELTA_PROTOCOL) {
+		log_printf("Client on socket %d switched to protocol %s\n", (int)client.sock, TCP_DELTA_PROTOCOL);
+		client.delta = true;
+		client.need_keyframe = ~0u;
+	} else if ((line == "PROTOCOL " TCP_V4_PROTOCOL) || (line == "PROTOCOL " TCP_V4_DELTA_PROTOCOL)) {
+		log_printf("Client on socket %d switched to protocol %s\n", (int)client.sock, line.c_str() + 9);
+		if (!client.v4)
+			network_switch_to_v4(client);
+		client.delta = (line == "PROTOCOL " TCP_V4_DELTA_PROTOCOL);
+		client.need_keyframe = ~0u;
+	} else if (line == "MULTICAST") {
+		if (config_multicast_group[0] == '\0') {
+			log_printf("Client on socket %d asked for multicast, which is not turned on\n", (int)client.sock);
+		} else {
+			log_printf("Client on socket %d switched to multicast\n", (int)client.sock);
+			client.multicast = true;
+			client.need_keyframe = ~0u;
+		}
+	} else if (line.compare(0, 7, "CODECS ") == 0) {
+		// XTEv4 codecs the client can decode on top of PNG and TILES, which every XTEv4 client has to handle. JPEG is
+		// the only one XTEv3 clients can ask for too, and they are sent it in the same record as a PNG.
+		client.codecs = (1u << XTEV4_CODEC_PNG) | (1u << XTEV4_CODEC_TILES);
+		if (line.find(" SCALED") != std::string::npos)
+			client.codecs |= 1u << XTEV4_CODEC_PNG_SCALED;
+		if (line.find(" QOI") != std::string::npos)
+			client.codecs |= 1u << XTEV4_CODEC_QOI;
+		if (line.find(" JPEG") != std::string::npos)
+			client.codecs |= 1u << XTEV4_CODEC_JPEG;
+		log_printf("Client on socket %d accepts XTEv4 codecs 0x%X\n", (int)client.sock, client.codecs);
+	} else if (line.compare(0, 5, "SIZE ") == 0) {
+		// SIZE followed by a window id and the width and height the client is showing it at, or 0 0 to go back to full size
+		int id, width, height;
+		if ((sscanf(line.c_str() + 5, "%d %d %d", &id, &width, &height) != 3) || (id < 0) || (id >= COCKPIT_MAX_WINDOWS) || (width < 0) || (height < 0)) {
+			log_printf("Ignoring bad command [%s] from client on socket %d\n", line.c_str(), (int)client.sock);
+		} else if (!client.v4) {
+			log_printf("Client on socket %d asked for window %d at %dx%d, which needs XTEv4\n", (int)client.sock, id, width, height);
+		} else {
+			if ((width == 0) || (height == 0))
+				width = height = 0;
+			log_printf("Client on socket %d wants window %d at %dx%d\n", (int)client.sock, id, width, height);
+			// Asking for a size means the client can decode the smaller images, and the delta clients need a fresh
+			// keyframe since the tiles only ever apply to a full size image
+			client.codecs |= 1u << XTEV4_CODEC_PNG_SCALED;
+			if ((client.size[id][0] != width) || (client.size[id][1] != height))
+				client.need_keyframe |= 1u << id;
+			client.size[id][0] = width;
+			client.size[id][1] = height;
+		}
+	} else if (line == TCP_HEADERS_COMMAND) {
+		log_printf("Client on socket %d will be sent header updates\n", (int)client.sock);
+		client.header_updates = true;
+	} else if (line == "KEYFRAME") {
+		// Client lost track of a window, for example it switched to showing a different one
+		client.need_keyframe = ~0u;
+	} else if ((line == "SUBSCRIBE") || (line.compare(0, 10, "SUBSCRIBE ") == 0)) {
+		// Either SUBSCRIBE ALL, or SUBSCRIBE followed by the window ids the client wants to receive
+		uint32_t windows = 0;
+		const char *rest = line.c_str() + 9;
+		while (*rest != '\0') {
+			char *end;
+			long id = strtol(rest, &end, 10);
+			if (end == rest) {
+				if (!strncmp(rest, " ALL", 4))
+					windows = ~0u;
+				break;
+			}
+			if ((id >= 0) && (id < COCKPIT_MAX_WINDOWS))
+				windows |= 1u << id;
+			rest = end;
+		}
+		log_printf("Client on socket %d subscribed to windows 0x%X\n", (int)client.sock, windows);
+		// Any window the client has not been getting needs to be sent in full
+		client.need_keyframe |= windows & ~client.windows;
+		client.windows = windows;
+		// Nothing queued for the other windows is needed any more, like the cached windows sent after the header
+		for (auto q = client.queue.begin(); q != client.queue.end(); ) {
+			if ((q->window >= 0) && !(windows & (1u << q->window)))
+				q = client.queue.erase(q);
+			else
+				++q;
+		}
+	} else {
+		log_printf("Ignoring unknown command [%s] from client on socket %d\n", line.c_str(), (int)client.sock);
+	}
+}
+
+// Read any commands the client has sent, returns false if the client has disconnected
+bool network_read_client(network_client_t &client) {
+	char buffer[1024];
+	int bytes = recv(client.sock, buffer, sizeof(buffer), 0);
+	if ((bytes == SOCKET_ERROR) && (WSAGetLastError() == WSAEWOULDBLOCK))
+		return true;
+	if (bytes <= 0) {
+		log_printf("Connection closed by client on socket %d\n", (int)client.sock);
+		return false;
+	}
+	client.input.append(buffer, bytes);
+	size_t eol;
+	while ((eol = client.input.find('\n')) != std::string::npos) {
+		std::string line = client.input.substr(0, eol);
+		client.input.erase(0, eol + 1);
+		if (!line.empty() && (line.back() == '\r'))
+			line.pop_back();
+		network_client_command(client, line);
+	}
+	if (client.input.size() > 1024) {
+		log_printf("Discarding overly long command from client on socket %d\n", (int)client.sock);
+		client.input.clear();
+	}
+	return true;
+}
+
+// Point iovecs at the parts of a record from offset onwards, returns how many were used (at most 3)
+int network_record_iovecs(const network_record_t &record, size_t offset, network_iovec_t *iov) {
+	const unsigned char *parts[3] = { record.header, record.payload ? record.payload->data() : NULL, network_padding };
+	size_t sizes[3] = { record.header_size, record.payload ? record.payload->size() : 0, record.padding };
+	int count = 0;
+	for (int p = 0; p < 3; p++) {
+		if (offset >= sizes[p]) {
+			offset -= sizes[p];
+			continue;
+		}
+		NETWORK_IOVEC_SET(iov[count], parts[p] + offset, sizes[p] - offset);
+		count++;
+		offset = 0;
+	}
+	return count;
+}
+
+// Bytes sitting in the socket that the other end has not acknowledged yet, or -1 if there is no way to tell
+int network_socket_queued(SOCKET sock) {
+	int queued = -1;
+#if LIN
+	if (ioctl(sock, SIOCOUTQ, &queued) != 0)
+		queued = -1;
+#elif APL
+	socklen_t length = sizeof(queued);
+	if (getsockopt(sock, SOL_SOCKET, SO_NWRITE, &queued, &length) != 0)
+		queued = -1;
+#endif
+	return queued;
+}
+
+// Move the next record to send out of the queue if needed, and list it along with as many of the queued ones as
+// fit into a single send. Returns how many there are, or 0 when there is nothing to send right now.
+int network_client_pending(network_client_t &client, const network_record_t **records) {
+	// Once we know how fast the link is, only give the socket as much as it can send within the latency target. The
+	// rest waits in our queue where newer frames replace it, rather than going stale in the socket.
+	size_t budget = ~(size_t)0;
+	client.throttled = false;
+	if ((client.rate > 0) && (config_latency_msec > 0)) {
+		size_t allowed = (size_t)(client.rate * config_latency_msec / 1000);
+		if (allowed < NETWORK_MIN_BUDGET)
+			allowed = NETWORK_MIN_BUDGET;
+		int queued = network_socket_queued(client.sock);
+		if ((queued >= 0) && ((size_t)queued >= allowed)) {
+			client.throttled = (client.sending.size() > 0) || !client.queue.empty();
+			return 0;
+		}
+		budget = allowed - ((queued > 0) ? queued : 0);
+	}
+
+	if (client.sending.size() == 0) {
+		if (client.queue.empty()) {
+			client.idle = true;
+			return 0;
+		}
+		client.sending = client.queue.front();
+		client.queue.pop_front();
+		client.sending_offset = 0;
+	}
+	int count = 0;
+	records[count++] = &client.sending;
+	size_t total = client.sending.size() - client.sending_offset;
+	for (auto &q : client.queue) {
+		if ((count >= NETWORK_MAX_IOVEC / 3) || (total >= budget))
+			break;
+		records[count++] = &q;
+		total += q.size();
+	}
+	return count;
+}
+
+// Point iovecs at a list of records, skipping offset bytes at the start. Returns how many were used, and the bytes.
+int network_records_iovecs(const network_record_t *const *records, int count, size_t offset, network_iovec_t *iov, size_t &total) {
+	int used = 0;
+	total = 0;
+	for (int r = 0; r < count; r++) {
+		used += network_record_iovecs(*records[r], (r == 0) ? offset : 0, iov + used);
+		total += records[r]->size() - ((r == 0) ? offset : 0);
+	}
+	return used;
+}
+
+// Account for bytes that were sent from the start of the pending records. Any record that was even partly sent
+// can no longer be replaced, so it moves out of the queue.
+void network_client_sent(network_client_t &client, size_t sent) {
+	client.accepted += sent;
+	while (sent > 0) {
+		size_t remaining = client.sending.size() - client.sending_offset;
+		if (sent < remaining) {
+			client.sending_offset += sent;
+			break;
+		}
+		sent -= remaining;
+		client.sending = network_record_t();
+		if (sent > 0) {
+			client.sending = client.queue.front();
+			client.queue.pop_front();
+			client.sending_offset = 0;
+		}
+	}
+}
+
+// Send as much of the queue as the socket will take without blocking, returns false if the connection failed
+bool network_flush_client(network_client_t &client) {
+	while (true) {
+		const network_record_t *records[NETWORK_MAX_IOVEC / 3];
+		int count = network_client_pending(client, records);
+		if (count == 0)
+			return true;
+
+		// Gather the rest of the current record and as many of the queued ones as fit into a single send
+		network_iovec_t iov[NETWORK_MAX_IOVEC];
+		size_t total;
+		int iovs = network_records_iovecs(records, count, client.sending_offset, iov, total);
+		int bytes = network_sendv(client.sock, iov, iovs);
+		if (bytes == SOCKET_ERROR) {
+			if (WSAGetLastError() == WSAEWOULDBLOCK)
+				return true; // Socket buffer is full, poll() will say when there is room again
+			log_printf("Connection closed: TCP send of %zu bytes failed with code %d\n", total, WSAGetLastError());
+			return false;
+		}
+		network_client_sent(client, bytes);
+		if ((size_t)bytes < total)
+			return true; // Only part of it fitted, so wait for poll() rather than getting EWOULDBLOCK straight away
+	}
+}
+
+// Every NETWORK_RATE_MSEC, work out how fast the client has been taking data from the bytes that left the socket.
+// This only shows the speed of the link if the socket never ran dry, otherwise it is just how much we sent, so the
+// rate is left alone. It cannot have run dry if we always had more to give it, or if it started with more than it sent. If the client cannot keep up with NETWORK_TARGET_FPS, and it can decode them, it is sent
+// half size windows instead. Every so often it is tried at full size again, in case the link has got better.
+void network_measure_client(network_client_t &client, double seconds, std::chrono::steady_clock::time_point now) {
+	int queued = network_socket_queued(client.sock);
+	if ((queued >= 0) && (client.socket_queued >= 0)) {
+		double drained = (double)client.accepted - (queued - client.socket_queued);
+		if ((drained > 0) && (!client.idle || (client.socket_queued >= drained)))
+			client.rate = (client.rate > 0) ? (client.rate * 0.7 + drained / seconds * 0.3) : (drained / seconds);
+	}
+	if (client.offered_frames > 0) {
+		double fps = client.offered_frames / seconds;
+		if (fps > NETWORK_TARGET_FPS)
+			fps = NETWORK_TARGET_FPS;
+		double need = (double)client.offered * client.scale * client.scale / client.offered_frames * fps;
+		client.need = (client.need > 0) ? (client.need * 0.7 + need * 0.3) : need;
+	}
+	client.socket_queued = queued;
+	client.accepted = 0;
+	client.offered = 0;
+	client.offered_frames = 0;
+	client.idle = false;
+
+	auto since = now - client.scale_changed;
+	bool can_scale = client.v4 && (client.codecs & (1u << XTEV4_CODEC_PNG_SCALED)) && (config_latency_msec > 0);
+	if (can_scale && (client.scale == 1) && (client.rate > 0) && (client.rate < client.need) && (since >= std::chrono::milliseconds(NETWORK_SCALE_SETTLE_MSEC))) {
+		log_printf("Client on socket %d takes %.0f KB/sec but needs %.0f KB/sec, sending half size windows\n", (int)client.sock, client.rate / 1024, client.need / 1024);
+		client.scale = 2;
+		client.scale_changed = now;
+	} else if ((client.scale == 2) && (!can_scale || (since >= std::chrono::milliseconds(NETWORK_SCALE_PROBE_MSEC)))) {
+		// The rate is kept so the socket stays within the latency target, and it creeps up if the link has got faster
+		log_printf("Client on socket %d is trying full size windows again\n", (int)client.sock);
+		client.scale = 1;
+		client.scale_changed = now;
+		client.need = 0;
+		client.need_keyframe = ~0u;
+	}
+}
+
+// Queue up a record for a client. If the client has not started sending an older record for the same window yet,
+// that one is stale and is replaced, so a slow client only ever has one record per window waiting. Deltas cannot be
+// replaced like that since each one builds on the last, so both are dropped and the window gets a keyframe instead.
+void network_queue_client(network_client_t &client, const network_record_t &record) {
+	for (auto q = client.queue.begin(); (record.window >= 0) && (q != client.queue.end()); ++q) {
+		if (q->window != record.window)
+			continue;
+		if (!client.delta || record.keyframe) {
+			*q = record;
+		} else {
+			client.queue.erase(q);
+			client.need_keyframe |= 1u << record.window;
+		}
+		return;
+	}
+	client.queue.push_back(record);
+}
+
+void network_close_client(network_client_t &client) {
+	closesocket(client.sock);
+	client.sock = INVALID_SOCKET;
+}
+
+// Remove any clients that were closed while looping over them
+void network_remove_closed() {
+	for (auto c = connections.begin(); c != connections.end(); ) {
+		if (c->sock == INVALID_SOCKET)
+			c = connections.erase(c);
+		else
+			++c;
+	}
+	network_update_client_count();
+}
+
+// Optional io_uring backend for Linux, which hands the sends for every client to the kernel with a single system
+// call instead of one per client, and uses zero-copy sends for the bigger ones when the kernel supports it. This is
+// picked with "send_backend io_uring", and anything that goes wrong setting it up falls back to the normal sockets.
+// It uses the system calls directly since the plugin is not linked against liburing.
+#if NETWORK_IO_URING
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup    425
+#define __NR_io_uring_enter    426
+#define __NR_io_uring_register 427
+#endif
+#define NETWORK_URING_OP_SENDMSG_ZC 48 // IORING_OP_SENDMSG_ZC, which is missing from the 6.0 headers
+
+// One send handed to the kernel. The records are copied in here so that the buffers stay alive until the kernel is
+// done with them, which for a zero-copy send is only once the data has been acknowledged by the other end.
+struct network_uring_send_t {
+	network_client_t *client;
+	network_record_t records[NETWORK_MAX_IOVEC / 3];
+	network_iovec_t iov[NETWORK_MAX_IOVEC];
+	struct msghdr msg;
+	size_t total;
+	int result;
+	bool done = false;          // The result of the send has come back
+	bool notify_pending = false; // Zero-copy send that is still using the buffers
+};
+
+struct network_uring_t {
+	int fd = -1;
+	void *ring = MAP_FAILED;
+	size_t ring_size = 0;
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+	size_t sqes_size = 0;
+	unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+	bool zerocopy = false;
+	int config = -1;            // config_send_backend the last time we looked, so a failed setup is not retried every loop
+	std::list<network_uring_send_t> sends;
+} network_uring;
+
+void network_uring_close() {
+	if (network_uring.ring != MAP_FAILED)
+		munmap(network_uring.ring, network_uring.ring_size);
+	if (network_uring.sqes != MAP_FAILED)
+		munmap(network_uring.sqes, network_uring.sqes_size);
+	if (network_uring.fd >= 0)
+		::close(network_uring.fd);
+	network_uring.ring = MAP_FAILED;
+	network_uring.sqes = (struct io_uring_sqe *)MAP_FAILED;
+	network_uring.fd = -1;
+	network_uring.sends.clear();
+}
+
+bool network_uring_open() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	network_uring.fd = (int)syscall(__NR_io_uring_setup, NETWORK_URING_ENTRIES, &params);
+	if (network_uring.fd < 0) {
+		log_printf("Could not set up io_uring, using normal sockets instead: %d\n", errno);
+		return false;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		log_printf("io_uring is too old, using normal sockets instead\n");
+		network_uring_close();
+		return false;
+	}
+
+	// The submission and completion rings share one mapping, and the submission entries have their own
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	network_uring.ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+	network_uring.ring = mmap(NULL, network_uring.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, network_uring.fd, IORING_OFF_SQ_RING);
+	network_uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	network_uring.sqes = (struct io_uring_sqe *)mmap(NULL, network_uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, network_uring.fd, IORING_OFF_SQES);
+	if ((network_uring.ring == MAP_FAILED) || (network_uring.sqes == MAP_FAILED)) {
+		log_printf("Could not map the io_uring, using normal sockets instead: %d\n", errno);
+		network_uring_close();
+		return false;
+	}
+	char *ring = (char *)network_uring.ring;
+	network_uring.sq_head = (unsigned *)(ring + params.sq_off.head);
+	network_uring.sq_tail = (unsigned *)(ring + params.sq_off.tail);
+	network_uring.sq_array = (unsigned *)(ring + params.sq_off.array);
+	network_uring.sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+	network_uring.sq_entries = params.sq_entries;
+	network_uring.cq_head = (unsigned *)(ring + params.cq_off.head);
+	network_uring.cq_tail = (unsigned *)(ring + params.cq_off.tail);
+	network_uring.cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+	network_uring.cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	// Ask the kernel which operations it has, since zero-copy sendmsg only arrived in 6.1
+	std::vector<unsigned char> buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+	struct io_uring_probe *probe = (struct io_uring_probe *)buffer.data();
+	if ((syscall(__NR_io_uring_register, network_uring.fd, IORING_REGISTER_PROBE, probe, 256) < 0) ||
+		(probe->ops_len <= IORING_OP_SENDMSG) || !(probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED)) {
+		log_printf("io_uring does not support sendmsg, using normal sockets instead\n");
+		network_uring_close();
+		return false;
+	}
+	network_uring.zerocopy = (probe->ops_len > NETWORK_URING_OP_SENDMSG_ZC) && (probe->ops[NETWORK_URING_OP_SENDMSG_ZC].flags & IO_URING_OP_SUPPORTED);
+	log_printf("Sending with io_uring, zero-copy is %s\n", network_uring.zerocopy ? "available" : "not available");
+	return true;
+}
+
+// Open or close the ring whenever the config changes
+void network_uring_update() {
+	if (network_uring.config == config_send_backend)
+		return;
+	if ((config_send_backend != NETWORK_SEND_IO_URING) && (network_uring.fd >= 0)) {
+		// Zero-copy sends still in flight own pages that the kernel is reading from, so wait for them to finish
+		for (auto &s : network_uring.sends)
+			if (s.notify_pending)
+				return;
+		log_printf("Sending with normal sockets\n");
+		network_uring_close();
+	}
+	network_uring.config = config_send_backend;
+	if ((config_send_backend == NETWORK_SEND_IO_URING) && (network_uring.fd < 0))
+		network_uring_open();
+}
+
+// Collect the completions, which are the results of each send and later on the notifications that the kernel has
+// finished with the buffers of a zero-copy send
+void network_uring_reap() {
+	unsigned head = *network_uring.cq_head;
+	unsigned tail = __atomic_load_n(network_uring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &network_uring.cqes[head & network_uring.cq_mask];
+		network_uring_send_t *send = (network_uring_send_t *)(uintptr_t)cqe->user_data;
+		if (cqe->flags & IORING_CQE_F_NOTIF) {
+			send->notify_pending = false;
+		} else {
+			send->result = cqe->res;
+			send->done = true;
+			send->notify_pending = (cqe->flags & IORING_CQE_F_MORE) != 0;
+		}
+	}
+	__atomic_store_n(network_uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Flush a group of clients with one system call for each round, where a round sends as much as fits into a single
+// sendmsg for every client. Clients that sent everything they were given go around again with the rest of their queue.
+void network_uring_flush(std::vector<network_client_t *> &clients) {
+	std::vector<network_client_t *> pending = clients;
+	std::vector<network_client_t *> again;
+	std::vector<network_uring_send_t *> round;
+	bool failed = false;
+	while (!pending.empty() && !failed) {
+		round.clear();
+		again.clear();
+		unsigned tail = *network_uring.sq_tail;
+		for (auto c : pending) {
+			if (round.size() >= network_uring.sq_entries) {
+				again.push_back(c); // More clients than the ring holds, so they go in the next round
+				continue;
+			}
+			const network_record_t *records[NETWORK_MAX_IOVEC / 3];
+			int count = network_client_pending(*c, records);
+			if (count == 0)
+				continue;
+			network_uring.sends.emplace_back();
+			network_uring_send_t *send = &network_uring.sends.back();
+			const network_record_t *copies[NETWORK_MAX_IOVEC / 3];
+			for (int r = 0; r < count; r++) {
+				send->records[r] = *records[r];
+				copies[r] = &send->records[r];
+			}
+			send->client = c;
+			memset(&send->msg, 0, sizeof(send->msg));
+			send->msg.msg_iov = send->iov;
+			send->msg.msg_iovlen = network_records_iovecs(copies, count, c->sending_offset, send->iov, send->total);
+
+			struct io_uring_sqe *sqe = &network_uring.sqes[tail & network_uring.sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = (network_uring.zerocopy && (send->total >= NETWORK_ZEROCOPY_MIN)) ? NETWORK_URING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+			sqe->fd = c->sock;
+			sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+			sqe->len = 1;
+			sqe->msg_flags = SEND_FLAGS | MSG_DONTWAIT; // Full sockets fail straight away like they would with sendmsg
+			sqe->user_data = (uint64_t)(uintptr_t)send;
+			network_uring.sq_array[tail & network_uring.sq_mask] = tail & network_uring.sq_mask;
+			tail++;
+			round.push_back(send);
+		}
+		if (round.empty()) {
+			pending.swap(again);
+			continue;
+		}
+		__atomic_store_n(network_uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		// The sockets are non-blocking so every send completes straight away, the wait is only in case one does not
+		unsigned submit = (unsigned)round.size();
+		size_t waiting = round.size();
+		while (waiting > 0) {
+			int result = (int)syscall(__NR_io_uring_enter, network_uring.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			if ((result < 0) && (errno != EINTR)) {
+				// Should never happen, so give up on io_uring and let poll() and the sockets carry on with the sends
+				log_printf("io_uring_enter failed with %d, going back to normal sockets\n", errno);
+				for (auto s : round)
+					if (!s->done)
+						s->result = -EAGAIN;
+				failed = true;
+				break;
+			}
+			if (result > 0)
+				submit -= ((unsigned)result < submit) ? result : submit;
+			network_uring_reap();
+			waiting = 0;
+			for (auto s : round)
+				waiting += s->done ? 0 : 1;
+		}
+
+		pending.clear();
+		for (auto s : round) {
+			network_client_t *c = s->client;
+			if ((s->result == -EINVAL) || (s->result == -EOPNOTSUPP)) {
+				if (network_uring.zerocopy) {
+					log_printf("Zero-copy send failed with %d, turning it off\n", -s->result);
+					network_uring.zerocopy = false;
+					pending.push_back(c);
+					continue;
+				}
+			}
+			if (s->result == -EAGAIN)
+				continue; // Socket buffer is full, poll() will say when there is room again
+			if (s->result < 0) {
+				log_printf("Connection closed: TCP send of %zu bytes failed with code %d\n", s->total, -s->result);
+				network_close_client(*c);
+				continue;
+			}
+			network_client_sent(*c, s->result);
+			if ((size_t)s->result == s->total)
+				pending.push_back(c);
+		}
+		pending.insert(pending.end(), again.begin(), again.end());
+	}
+
+	// Anything the kernel has finished with can go, including zero-copy sends from earlier frames
+	if (failed) {
+		network_uring_close();
+		return;
+	}
+	network_uring_reap();
+	network_uring.sends.remove_if([](const network_uring_send_t &s) { return s.done && !s.notify_pending; });
+}
+#endif
+
+// Flush a group of clients, closing any that fail
+void network_flush_clients(std::vector<network_client_t *> &clients) {
+#if NETWORK_IO_URING
+	if (network_uring.fd >= 0) {
+		network_uring_flush(clients);
+		return;
+	}
+#endif
+	for (auto c : clients)
+		if (!network_flush_client(*c))
+			network_close_client(*c);
+}
+
+// Lets the render thread wake up poll() as soon as it has published a new frame, using a UDP socket connected
+// to itself since that works the same everywhere, including Windows which cannot poll() a pipe
+std::atomic<SOCKET> network_wake_socket(INVALID_SOCKET);
+
+void network_wakeup(void) {
+	SOCKET sock = network_wake_socket;
+	if (sock != INVALID_SOCKET)
+		send(sock, "!", 1, 0);
+}
+
+SOCKET network_open_wake_socket() {
+	SOCKET sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	struct sockaddr_in addr;
+	ZeroMemory(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+#if LIN || APL
+	socklen_t addr_len = sizeof(addr);
+#else
+	int addr_len = sizeof(addr);
+#endif
+	u_long non_block = 1;
+	if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) ||
+		(getsockname(sock, (struct sockaddr *)&addr, &addr_len) == SOCKET_ERROR) ||
+		(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) ||
+		(ioctlsocket(sock, FIONBIO, &non_block) == SOCKET_ERROR)) {
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+	return sock;
+}
+
+// Multicast viewers all share one stream, which is sent like a single XTEv4-delta client that wants every window any
+// of them subscribed to. They still connect over TCP to get the header and send commands, but are not sent any
+// windows on it. A viewer that loses a record the parity cannot rebuild asks for a KEYFRAME like any other client.
+SOCKET multicast_socket = INVALID_SOCKET;
+char multicast_open_group[sizeof(config_multicast_group)]; // What the socket was opened for, so a config change reopens it
+int multicast_open_port = 0;
+uint32_t multicast_record_id = 0;
+network_client_t multicast_viewers;
+
+bool network_open_multicast() {
+	if ((multicast_socket != INVALID_SOCKET) && !strcmp(multicast_open_group, config_multicast_group) && (multicast_open_port == config_multicast_port))
+		return true;
+	if (multicast_socket != INVALID_SOCKET) {
+		closesocket(multicast_socket);
+		multicast_socket = INVALID_SOCKET;
+	}
+	if (config_multicast_group[0] == '\0')
+		return false;
+	strcpy(multicast_open_group, config_multicast_group);
+	multicast_open_port = config_multicast_port;
+
+	struct addrinfo hints, *result = NULL;
+	ZeroMemory(&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	char port[16];
+	sprintf(port, "%d", multicast_open_port);
+	if (getaddrinfo(multicast_open_group, port, &hints, &result) != 0) {
+		log_printf("Could not resolve multicast group %s port %s\n", multicast_open_group, port);
+		return false;
+	}
+	// The default TTL of 1 keeps the stream on the local network. Connecting a UDP socket just sets where it sends to
+	SOCKET sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	int send_buffer = MULTICAST_SEND_BUFFER;
+	u_long non_block = 1;
+	if ((sock == INVALID_SOCKET) ||
+		(setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&send_buffer, sizeof(send_buffer)) == SOCKET_ERROR) ||
+		(connect(sock, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR) ||
+		(ioctlsocket(sock, FIONBIO, &non_block) == SOCKET_ERROR)) {
+		log_printf("Could not open multicast socket for group %s port %s: %d\n", multicast_open_group, port, WSAGetLastError());
+		if (sock != INVALID_SOCKET)
+			closesocket(sock);
+		freeaddrinfo(result);
+		return false;
+	}
+	freeaddrinfo(result);
+	log_printf("Multicasting to group %s port %s\n", multicast_open_group, port);
+	multicast_socket = sock;
+	return true;
+}
+
+// Each datagram is a MULTICAST_HEADER byte header followed by up to MULTICAST_CHUNK_SIZE bytes of the record. The header
+// is "XTEM", then little-endian 4 bytes for the record id (one more than the last record), 4 bytes for the length of
+// the record, 2 bytes for the chunk index, 2 bytes for the number of data chunks, 1 byte for the window id, 1 byte for
+// the number of data chunks covered by each parity chunk (0 for none), and 2 zero bytes. Data chunks come first, then
+// a parity chunk for each group, which is the XOR of the chunks in the group with the last chunk padded with zeros.
+// Returns false if the socket did not take all of the datagrams.
+bool network_multicast_record(const network_record_t &record) {
+	static std::vector<unsigned char> flat;
+	flat.assign(record.header, record.header + record.header_size);
+	if (record.payload)
+		flat.insert(flat.end(), record.payload->begin(), record.payload->end());
+	flat.resize(flat.size() + record.padding, 0);
+
+	int parity = (config_multicast_parity < 0) ? 0 : ((config_multicast_parity > 255) ? 255 : config_multicast_parity);
+	size_t length = flat.size();
+	int chunks = (int)((length + MULTICAST_CHUNK_SIZE - 1) / MULTICAST_CHUNK_SIZE);
+	// The parity chunks are numbered after the data chunks, so all of them have to fit in the 2 byte chunk index
+	int parity_chunks = (parity == 0) ? 0 : (chunks + parity - 1) / parity;
+	if ((chunks > 0xFFFF) || (chunks + parity_chunks > 0x10000)) {
+		log_printf("Record of %zu bytes for window %d is too big to multicast\n", length, record.window);
+		return false;
+	}
+	uint32_t id = ++multicast_record_id;
+	unsigned char packet[MULTICAST_HEADER + MULTICAST_CHUNK_SIZE];
+	unsigned char xor_chunk[MULTICAST_CHUNK_SIZE];
+	memcpy(packet, "XTEM", 4);
+	for (int b = 0; b < 4; b++) {
+		packet[4 + b] = (unsigned char)(id >> (b * 8));
+		packet[8 + b] = (unsigned char)(length >> (b * 8));
+	}
+	packet[14] = (unsigned char)chunks;
+	packet[15] = (unsigned char)(chunks >> 8);
+	packet[16] = (unsigned char)((record.window < 0) ? XTEV4_STREAM_ID : record.window);
+	packet[17] = (unsigned char)parity;
+	packet[18] = packet[19] = 0;
+
+	for (int c = 0; c < chunks; c++) {
+		size_t offset = (size_t)c * MULTICAST_CHUNK_SIZE;
+		size_t bytes = (length - offset < MULTICAST_CHUNK_SIZE) ? length - offset : MULTICAST_CHUNK_SIZE;
+		packet[12] = (unsigned char)c;
+		packet[13] = (unsigned char)(c >> 8);
+		memcpy(packet + MULTICAST_HEADER, flat.data() + offset, bytes);
+		if (send(multicast_socket, (const char *)packet, (int)(MULTICAST_HEADER + bytes), SEND_FLAGS) == SOCKET_ERROR)
+			return false;
+		if (parity == 0)
+			continue;
+		if (c % parity == 0)
+			memset(xor_chunk, 0, sizeof(xor_chunk));
+		for (size_t b = 0; b < bytes; b++)
+			xor_chunk[b] ^= flat[offset + b];
+		if ((c % parity == parity - 1) || (c == chunks - 1)) {
+			int index = chunks + c / parity;
+			packet[12] = (unsigned char)index;
+			packet[13] = (unsigned char)(index >> 8);
+			memcpy(packet + MULTICAST_HEADER, xor_chunk, MULTICAST_CHUNK_SIZE);
+			if (send(multicast_socket, (const char *)packet, MULTICAST_HEADER + MULTICAST_CHUNK_SIZE, SEND_FLAGS) == SOCKET_ERROR)
+				return false;
+		}
+	}
+	return true;
 }
 
 void TCPListenerFunction()
@@ -86,9 +1136,9 @@ void TCPListenerFunction()
 	struct addrinfo *result = NULL;
 	struct addrinfo hints;
 
-	int iSendResult;
-
 	// This thread was spawned by the main plugin, so recompute the header now, we know it is valid
+	config_apply();
+	network_apply_header();
 	recompute_header();
 	last_cockpit_texture_seq = cockpit_texture_seq;
 
@@ -107,8 +1157,10 @@ void TCPListenerFunction()
 	hints.ai_protocol = IPPROTO_TCP;
 	hints.ai_flags = AI_PASSIVE;
 	
-	log_printf("Opening up socket to listen on port %s\n", TCP_PLUGIN_PORT);
-	iResult = getaddrinfo(NULL, TCP_PLUGIN_PORT, &hints, &result);
+	char port[16];
+	sprintf(port, "%d", config_tcp_port);
+	log_printf("Opening up socket to listen on port %s\n", port);
+	iResult = getaddrinfo(NULL, port, &hints, &result);
 	if (iResult != 0) {
 		log_printf("Fatal: getaddrinfo failed with error: %d\n", iResult);
 		WSACleanup();
@@ -160,30 +1212,98 @@ void TCPListenerFunction()
 		return;
 	}
 
-	log_printf("Waiting for incoming TCP connections on port %s\n", TCP_PLUGIN_PORT);
+	SOCKET wake_socket = network_open_wake_socket();
+	if (wake_socket == INVALID_SOCKET)
+		log_printf("Could not open the wake up socket, will check for new frames every %d msec instead: %d\n", NETWORK_POLL_MSEC, WSAGetLastError());
+	network_wake_socket = wake_socket;
 
+	log_printf("Waiting for incoming TCP connections on port %s\n", port);
+
+	std::vector<struct pollfd> fds;
+	bool no_texture_logged = false;
+	auto last_measure = std::chrono::steady_clock::now();
 	while (1) {
-		// Check if there are any new connections, it is ok to not have any new ones and just maintain what we have
-		SOCKET newClientSocket = INVALID_SOCKET;
-		newClientSocket = accept(ListenSocket, NULL, NULL);
-		if (newClientSocket == INVALID_SOCKET) {
-			// See if the error was fatal or no new connection
-			if (WSAGetLastError() != WSAEWOULDBLOCK) {
-				log_printf("Fatal: accept failed with error: %d\n", WSAGetLastError());
-				closesocket(ListenSocket);
-				WSACleanup();
-				return;
-			}
+		// Sleep until there is a new connection, a client is readable or has room to send, or a new frame is ready.
+		// With no clients there is nothing to do apart from checking for an aircraft change once a second.
+		config_apply();
+		network_apply_header();
+		network_shm_active = shm_reader_active();
+#if NETWORK_IO_URING
+		network_uring_update();
+#endif
+		network_update_client_count();
+		fds.clear();
+		struct pollfd pfd;
+		pfd.fd = ListenSocket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		fds.push_back(pfd);
+		if (wake_socket != INVALID_SOCKET) {
+			pfd.fd = wake_socket;
+			fds.push_back(pfd);
+		}
+		size_t first_client = fds.size();
+		bool throttled = false;
+		for (auto &c : connections) {
+			pfd.fd = c.sock;
+			// Throttled clients are writable but are holding back on purpose, so they are checked again after a short sleep
+			pfd.events = POLLIN | ((((c.sending.size() > 0) || !c.queue.empty()) && !c.throttled) ? POLLOUT : 0);
+			fds.push_back(pfd);
+			throttled |= c.throttled;
+		}
+		int timeout = (connections.empty() && !network_shm_active) ? 1000 : (((wake_socket != INVALID_SOCKET) && !throttled) ? 100 : NETWORK_POLL_MSEC);
+		iResult = poll(fds.data(), (unsigned long)fds.size(), timeout);
+		if (iResult == SOCKET_ERROR) {
+			log_printf("Fatal: poll failed with error: %d\n", WSAGetLastError());
+			for (auto &c : connections)
+				closesocket(c.sock);
+			closesocket(ListenSocket);
+			WSACleanup();
+			return;
+		}
 
-			// If we don't have any connections, then lets sleep to rate limit this thread and loop around
-			if (connections.size() == 0) {
-				// log_printf("No incoming connection found, sleeping for 1 second ...\n");
-				Sleep(1000);
-				continue;
-			}
+		// Empty out the wake up socket, any number of wake ups just means there is a frame to look at
+		if ((wake_socket != INVALID_SOCKET) && (fds[1].revents & POLLIN)) {
+			char drain[64];
+			while (recv(wake_socket, drain, sizeof(drain), 0) > 0) { }
+		}
+
+		// Service the clients before accepting new ones, since the poll results are in the same order as the list
+		size_t index = first_client;
+		std::vector<network_client_t *> writable;
+		for (auto &c : connections) {
+			short revents = fds[index++].revents;
+			if ((revents & (POLLIN | POLLHUP | POLLERR)) && !network_read_client(c))
+				network_close_client(c);
+			else if (revents & POLLOUT)
+				writable.push_back(&c);
+		}
+		for (auto &c : connections)
+			if (c.throttled && (c.sock != INVALID_SOCKET))
+				writable.push_back(&c);
+		network_flush_clients(writable);
+		network_remove_closed();
+
+		auto measure_now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> measure_seconds = measure_now - last_measure;
+		if (measure_seconds >= std::chrono::milliseconds(NETWORK_RATE_MSEC)) {
+			for (auto &c : connections)
+				if (!c.multicast)
+					network_measure_client(c, measure_seconds.count(), measure_now);
+			last_measure = measure_now;
 		}
-		else {
-			int iOptVal = TCP_SEND_BUFFER; // Make sure this is very large to prevent WSAEWOULDBLOCK=10035 when the network gets clogged up
+
+		// Accept every connection that is waiting, it is ok to not have any new ones and just maintain what we have
+		while (fds[0].revents & POLLIN) {
+			SOCKET newClientSocket = accept(ListenSocket, NULL, NULL);
+			if (newClientSocket == INVALID_SOCKET) {
+				// See if the error was fatal or no new connection
+				if (WSAGetLastError() != WSAEWOULDBLOCK)
+					log_printf("Accept failed with error: %d\n", WSAGetLastError());
+				break;
+			}
+
+			int iOptVal = TCP_SEND_BUFFER; // Kept small so that stale frames wait in our queue where they can be replaced
 #if LIN || APL
 			socklen_t iOptLen = sizeof(int);
 #else
@@ -193,8 +1313,8 @@ void TCPListenerFunction()
 			if (iResult == SOCKET_ERROR) {
 				log_printf("Fatal: failed to set SO_SNDBUF to %d: %d\n", TCP_SEND_BUFFER, WSAGetLastError());
 				closesocket(newClientSocket);
-				for (auto s : connections)
-					closesocket(s);
+				for (auto &c : connections)
+					closesocket(c.sock);
 				WSACleanup();
 				return;
 			}
@@ -202,168 +1322,395 @@ void TCPListenerFunction()
 			if (iResult == SOCKET_ERROR) {
 				log_printf("Fatal: failed to query SO_SNDBUF: %d\n", WSAGetLastError());
 				closesocket(newClientSocket);
-				for (auto s : connections)
-					closesocket(s);
+				for (auto &c : connections)
+					closesocket(c.sock);
 				WSACleanup();
 				return;
 			}
 
-			u_long non_block = 0;
+			// Clients are never allowed to block the thread, anything that does not fit is queued until poll() says there is room
+			u_long non_block = 1;
 			iResult = ioctlsocket(newClientSocket, FIONBIO, &non_block);
 			if (iResult == SOCKET_ERROR) {
-				log_printf("Fatal: failed to set blocking mode on socket: %d\n", WSAGetLastError());
+				log_printf("Fatal: failed to set non-blocking mode on socket: %d\n", WSAGetLastError());
 				closesocket(newClientSocket);
-				for (auto s : connections)
-					closesocket(s);
+				for (auto &c : connections)
+					closesocket(c.sock);
 				WSACleanup();
 				return;
 			}
+#if APL
+			int no_sigpipe = 1;
+			setsockopt(newClientSocket, SOL_SOCKET, SO_NOSIGPIPE, (char *)&no_sigpipe, sizeof(no_sigpipe));
+#endif
 
 			log_printf("Accepted new connection, texture seq is %d, total connections is %zu, SO_SNDBUF is %d from %d\n", cockpit_texture_seq, connections.size(), iOptVal, TCP_SEND_BUFFER);
 
-			iSendResult = send(newClientSocket, header, TCP_INTRO_HEADER, 0);
-			if (iSendResult == SOCKET_ERROR) {
-				log_printf("TCP header send failed with code %d for %d bytes, closing this socket down\n", WSAGetLastError(), TCP_INTRO_HEADER);
-				closesocket(newClientSocket);
+			network_client_t client;
+			client.sock = newClientSocket;
+			network_record_t record;
+			record.payload = std::make_shared<std::vector<unsigned char>>(header, header + TCP_INTRO_HEADER);
+			network_queue_client(client, record);
+			// Every client starts on XTEv3 with all the windows, so send what we already have in that framing. Anything
+			// the client then turns out not to want is dropped from the queue, or replaced by newer records
+			for (int i = 0; i < COCKPIT_MAX_WINDOWS; i++) {
+				if (!window_cache[i].image)
+					continue;
+				make_record(record, "_____", i, window_cache[i].image, "____");
+				network_queue_client(client, record);
 			}
-			else if (iSendResult != TCP_INTRO_HEADER) {
-				log_printf("Fatal: TCP transmission was %d bytes but expected to send %d bytes\n", iSendResult, TCP_INTRO_HEADER);
-				for (auto s : connections)
-					closesocket(s);
-				WSACleanup();
-				return;
+			if (network_flush_client(client)) {
+				connections.push_back(client);
+				network_update_client_count();
 			}
 			else {
-				// log_printf("Successfully sent header of %d bytes\n", TCP_INTRO_HEADER);
-				connections.push_back(newClientSocket);
+				log_printf("TCP header send failed, closing this socket down\n");
+				closesocket(newClientSocket);
 			}
 		}
 
-		std::vector<unsigned char> out_data;
-		std::vector<unsigned char> png_data;
+		// Records are indexed by framing as well, with 0 for XTEv3 and 1 for XTEv4
+		static network_record_t full_record[2][COCKPIT_MAX_WINDOWS]; // Record of the whole window
+		static network_record_t tile_record[2][COCKPIT_MAX_WINDOWS]; // Record of the changed tiles
+		static network_record_t qoi_record[COCKPIT_MAX_WINDOWS]; // Record of the whole window for QOI clients, always XTEv4
+		static network_record_t jpeg_record[2][COCKPIT_MAX_WINDOWS]; // Record of the whole window for JPEG clients
+		// Encoder output gets a new buffer every frame, since clients that are behind may still be sending the old one
+		static std::shared_ptr<std::vector<unsigned char>> tile_data[COCKPIT_MAX_WINDOWS];
+		static std::vector<unsigned char> reference[COCKPIT_MAX_WINDOWS]; // What the delta clients are currently showing
+		static uint64_t window_hash[COCKPIT_MAX_WINDOWS];
+		static std::chrono::steady_clock::time_point window_sent[COCKPIT_MAX_WINDOWS];
+		static std::chrono::steady_clock::time_point window_keyframe[COCKPIT_MAX_WINDOWS];
+		static bool window_changed[COCKPIT_MAX_WINDOWS];
+		static std::vector<network_sized_t> window_sized[COCKPIT_MAX_WINDOWS]; // Smaller copies of the window, at most a few each
+		static int window_tiles[COCKPIT_MAX_WINDOWS]; // Tiles for the delta clients, 0 for nothing, -1 for a keyframe
 
 		if (last_cockpit_texture_seq != cockpit_texture_seq) {
-			log_printf("Network: Texture sequence number has increased from %d to %d, so closing all connections to force restart\n", last_cockpit_texture_seq, cockpit_texture_seq);
-			for (auto s : connections)
-				closesocket(s);
-			connections.clear();
+			// Clients that can take the new header on their existing connection keep going, the rest have to reconnect
+			log_printf("Network: Texture sequence number has increased from %d to %d, so sending the new header or closing connections to force restart\n", last_cockpit_texture_seq, cockpit_texture_seq);
 			recompute_header();
+			// Nothing from the old aircraft can be compared against or reused, even for windows that are the same size
+			for (int i = 0; i < COCKPIT_MAX_WINDOWS; i++) {
+				window_cache[i] = window_qoi[i] = window_jpeg[i] = network_cached_t();
+				reference[i].clear();
+				window_hash[i] = 0;
+				window_sized[i].clear();
+			}
+			std::vector<network_client_t *> updated;
+			for (auto c = connections.begin(); c != connections.end(); ) {
+				if (c->header_updates && !c->multicast) {
+					network_send_header_update(*c);
+					updated.push_back(&*c);
+					++c;
+				} else {
+					closesocket(c->sock);
+					c = connections.erase(c);
+				}
+			}
+			network_update_client_count();
+			network_flush_clients(updated);
+			network_remove_closed();
 		}
 		last_cockpit_texture_seq = cockpit_texture_seq;
 
 		if (cockpit_texture_id <= 0) {
-			log_printf("No texture is currently found, nothing to transmit ... sleeping for 1 second\n");
-			Sleep(1000);
+			if (!no_texture_logged)
+				log_printf("No texture is currently found, nothing to transmit\n");
+			no_texture_logged = true;
 			continue;
 		}
-		else if (texture_pointer == NULL) {
-			// log_printf("Texture id is valid but no texture is ready, will wait 10 msec\n");
-			Sleep(10); // Cannot ever exceed 100 fps
+		no_texture_logged = false;
+
+		// Pick up the newest frame from the render thread, which keeps capturing into its own buffer while we encode this one
+		const capture_frame_t *frame = capture_acquire_frame();
+		if (frame == NULL) {
+			// log_printf("Texture id is valid but no texture is ready, waiting for the next one\n");
 			continue;
 		}
+		else if (frame->texture_seq != cockpit_texture_seq) {
+			// Captured just before the aircraft changed, the window layout no longer matches the header
+			continue;
+		}
+		if (network_shm_active)
+			shm_publish_frame(frame);
 
 		// Debug code that draws a grid to the buffer to check if it is working
 		/*
-		for (int y = 0; y < cockpit_texture_height; y += 16)
-			for (int x = 0; x < cockpit_texture_width; x += 16) {
-				if (y % 16 == 0 || x % 16 == 0) {
-					int ofs = (y * cockpit_texture_width + x) * 4;
-					texture_pointer[ofs] = 0xFF; // Set red pixel, draw a grid
+		unsigned char *pixels = (unsigned char *)frame->pixels.data();
+		for (int i = 0; i < frame->count; i++)
+			for (int y = 0; y < frame->layout[i].height; y += 16)
+				for (int x = 0; x < frame->layout[i].width; x += 16) {
+					int ofs = frame->layout[i].offset + (y * frame->layout[i].width + x) * 4;
+					pixels[ofs] = 0xFF; // Set red pixel, draw a grid
 				}
-			}
 		*/
 
-		// Reset the output buffer
-		out_data.clear();
-
-		// Encode each window in the texture as a separate image
-		for (int i = 0; i < cockpit_window_limit; i++) {
-
-			// Compute sub-image dimensions
-			int x1 = _g_texture_lbrt[i][0]; // L
-			int y1 = cockpit_texture_height - _g_texture_lbrt[i][1]; // B
-			int x2 = _g_texture_lbrt[i][2]; // R
-			int y2 = cockpit_texture_height - _g_texture_lbrt[i][3]; // T
-			int in_stride = cockpit_texture_width * 4;
-			int out_stride = (x2 - x1) * 4;
-			int out_rows = -(y2 - y1);
-			if (out_stride < 0)
-				log_printf("Error! Negative out_stride value %d\n", out_stride);
-			if (out_rows < 0)
-				log_printf("Error! Negative out_rows value %d\n", out_rows);
-
-			// Copy the sub-image into a temporary buffer, flip the image since it is inverted
-			unsigned char *src = texture_pointer + (y1 * in_stride) + (x1 * 4);
-			unsigned char *dest = &sub_buffer[0];
-			for (int r = 0; r < out_rows; r++) {
-				memcpy(dest, src, out_stride);
-				src -= in_stride;
-				dest += out_stride;
+		// Work out which windows each kind of client wants, so nothing is compressed that will not be sent
+		uint32_t legacy_wanted = 0, delta_wanted = 0, legacy_keyframe = 0, delta_keyframe = 0, sized_wanted = 0;
+		uint32_t png_wanted = 0, qoi_wanted = 0, jpeg_wanted = 0; // Windows whole images are wanted for, in each format
+		bool framing_wanted[2] = { false, false };
+		uint32_t multicast_windows = 0;
+		int window_quality[COCKPIT_MAX_WINDOWS]; // JPEG quality of each window for clients that can take a JPEG
+		bool jpeg_subsample = config_jpeg_subsample;
+		for (int i = 0; i < frame->count; i++) {
+			window_quality[i] = encode_window_jpeg_quality(i);
+			// Sizes nobody wanted last frame are forgotten
+			auto &sizes = window_sized[i];
+			sizes.erase(std::remove_if(sizes.begin(), sizes.end(), [](const network_sized_t &sized) { return !sized.wanted; }), sizes.end());
+			for (auto &sized : sizes)
+				sized.wanted = sized.keyframe = sized.send = sized.encode = false;
+		}
+		for (auto &c : connections) {
+			if (c.multicast) {
+				// Keyframes any viewer needs are sent to all of them
+				multicast_windows |= c.windows;
+				multicast_viewers.need_keyframe |= c.windows & c.need_keyframe;
+				c.need_keyframe = 0;
+				continue;
+			}
+			// Smaller windows are whole images only, since the tiles are worked out at full size
+			uint32_t full_windows = c.windows;
+			for (int i = 0; i < frame->count; i++) {
+				int width, height;
+				if (!(c.windows & (1u << i)) || !network_client_window_size(c, &frame->layout[i], i, width, height))
+					continue;
+				int quality = network_client_jpeg_quality(c, window_quality, i);
+				network_sized_t *sized = network_find_sized(window_sized[i], width, height, quality);
+				if (sized == NULL) {
+					window_sized[i].emplace_back();
+					sized = &window_sized[i].back();
+					sized->width = width;
+					sized->height = height;
+					sized->quality = quality;
+				}
+				sized->wanted = true;
+				sized->keyframe |= (c.need_keyframe & (1u << i)) != 0;
+				sized_wanted |= 1u << i;
+				full_windows &= ~(1u << i);
+			}
+			if (!full_windows)
+				continue;
+			framing_wanted[c.v4] = true;
+			uint32_t lossless_windows = full_windows;
+			for (int i = 0; i < frame->count; i++) {
+				if ((full_windows & (1u << i)) && network_client_jpeg_quality(c, window_quality, i)) {
+					jpeg_wanted |= 1u << i;
+					lossless_windows &= ~(1u << i);
+				}
 			}
+			if (c.v4 && (c.codecs & (1u << XTEV4_CODEC_QOI)))
+				qoi_wanted |= lossless_windows;
+			else
+				png_wanted |= lossless_windows;
+			if (c.delta) {
+				delta_wanted |= full_windows;
+				delta_keyframe |= full_windows & c.need_keyframe;
+			} else {
+				legacy_wanted |= full_windows;
+				legacy_keyframe |= full_windows & c.need_keyframe;
+			}
+		}
+		multicast_viewers.windows = 0;
+		if (multicast_windows && network_open_multicast()) {
+			multicast_viewers.windows = multicast_windows;
+			multicast_viewers.v4 = true;
+			multicast_viewers.delta = true;
+			framing_wanted[1] = true;
+			png_wanted |= multicast_windows;
+			delta_wanted |= multicast_windows;
+			delta_keyframe |= multicast_windows & multicast_viewers.need_keyframe;
+		}
+
+		// Compress each window in the texture as a separate image, spread across the encoder threads. Windows that are
+		// identical to the last one sent are skipped entirely, apart from an occasional keep-alive resend. The delta clients
+		// are sent just the tiles that changed, with a periodic keyframe of the whole window in case anything went wrong.
+		// Any delta client that needs a keyframe gets the whole window, while the others carry on with the tiles.
+		auto now = std::chrono::steady_clock::now();
+		auto keepalive = std::chrono::milliseconds(config_keepalive_msec);
+		auto keyframe = std::chrono::milliseconds(config_keyframe_msec);
+		encode_parallel_for(frame->count, [&](int i) {
+			uint32_t bit = 1u << i;
+			window_changed[i] = false;
+			window_tiles[i] = 0;
+			if (!((legacy_wanted | delta_wanted | sized_wanted) & bit))
+				return; // Nobody is subscribed to this window
+			uint64_t hash = capture_hash_window(frame, i);
+			bool hash_changed = (hash != window_hash[i]);
+			bool keepalive_due = (config_keepalive_msec > 0) && (now - window_sent[i] >= keepalive);
+			bool keyframe_due = (config_keyframe_msec > 0) && (now - window_keyframe[i] >= keyframe);
+			window_hash[i] = hash;
 
-			// Compress the RGBA image as an RGB image with lodepng
-			png_data.clear();
-			lodepng::State state;
-			state.info_raw.colortype = LCT_RGBA; // Input type
-			state.info_raw.bitdepth = 8;
-			state.info_png.color.colortype = LCT_RGB; // Output type
-			state.info_png.color.bitdepth = 8;
-			state.encoder.auto_convert = 0; // Must provide this or will ignore the input/output types
-			unsigned error = lodepng::encode(png_data, &sub_buffer[0], x2 - x1, -(y2 - y1), state);
-
-			// 7 char header and 1 byte for the window id (8 bytes total)
-			out_data.insert(out_data.end(), '!');
-			for (int ch = 0; ch < 5; ch++)
-				out_data.insert(out_data.end(), '_');
-			out_data.insert(out_data.end(), (unsigned char)i);
-			out_data.insert(out_data.end(), '_');
-
-			// 4 bytes for the number of bytes of PNG data so we can easily skip it if necessary
-			unsigned int num_png_bytes = (unsigned int)png_data.size();
-			for (int ch = 0; ch < 4; ch++) {
-				out_data.insert(out_data.end(), *(((unsigned char *)&num_png_bytes)+ch));
+			window_changed[i] = (legacy_wanted & bit) && (hash_changed || keepalive_due || (legacy_keyframe & bit));
+			if (window_changed[i])
+				window_sent[i] = now;
+			for (auto &sized : window_sized[i]) {
+				sized.send = sized.wanted && (hash_changed || sized.keyframe || ((config_keepalive_msec > 0) && (now - sized.sent >= keepalive)));
+				if (sized.send) {
+					sized.sent = now;
+					sized.encode = !sized.data || (sized.hash != hash);
+					sized.hash = hash;
+				}
 			}
 
-			// Pad the header out with another 4 bytes of nothing
-			for (int ch = 0; ch < 4; ch++)
-				out_data.insert(out_data.end(), '_');
+			if (delta_wanted & bit) {
+				if (keyframe_due) {
+					window_tiles[i] = -1;
+					encode_window_reference(reference[i], frame, i);
+				} else if (hash_changed) {
+					tile_data[i] = std::make_shared<std::vector<unsigned char>>();
+					window_tiles[i] = encode_window_delta(*tile_data[i], frame, i, reference[i]);
+				} else if (delta_keyframe & bit) {
+					// A client being sent the whole window starts from this frame, and the reference may be older if
+					// there were no delta clients for a while, so the next tiles have to be worked out from here
+					encode_window_reference(reference[i], frame, i);
+				}
+				if (window_tiles[i] < 0)
+					window_keyframe[i] = now;
+			}
 
-			// We have written out 16 bytes of header, now write out the PNG data
-			out_data.insert(out_data.end(), png_data.begin(), png_data.end());
+			// Keep-alives and keyframes of a window that has not changed since it was last compressed reuse the cached image
+			bool whole = window_changed[i] || (window_tiles[i] < 0) || (delta_keyframe & bit);
+			if (whole && (png_wanted & bit) && (!window_cache[i].image || (window_cache[i].hash != hash))) {
+				auto png = std::make_shared<std::vector<unsigned char>>();
+				encode_window_png(*png, frame, i);
+				window_cache[i].image = png;
+				window_cache[i].hash = hash;
+			}
+			if (whole && (qoi_wanted & bit) && (!window_qoi[i].image || (window_qoi[i].hash != hash))) {
+				auto qoi = std::make_shared<std::vector<unsigned char>>();
+				encode_window_qoi(*qoi, frame, i);
+				window_qoi[i].image = qoi;
+				window_qoi[i].hash = hash;
+			}
+			if (whole && (jpeg_wanted & bit) && (!window_jpeg[i].image || (window_jpeg[i].hash != hash) || (window_jpeg[i].quality != window_quality[i]))) {
+				auto jpeg = std::make_shared<std::vector<unsigned char>>();
+				encode_window_jpeg(*jpeg, frame, i, window_quality[i], jpeg_subsample);
+				window_jpeg[i].image = jpeg;
+				window_jpeg[i].hash = hash;
+				window_jpeg[i].quality = window_quality[i];
+			}
+		});
 
-			// Add null bytes to the end to pad the PNG data out to 1024 byte blocks
-			int pad = 1024 - png_data.size() % 1024;
-			for (int ch = 0; ch < pad; ch++)
-				out_data.insert(out_data.end(), 0x00);
+		// Then shrink and compress the smaller copies, as a second pass so several sizes of one big window are spread
+		// across the threads too
+		std::vector<std::pair<int, network_sized_t *>> sized_jobs;
+		for (int i = 0; i < frame->count; i++)
+			for (auto &sized : window_sized[i])
+				if (sized.encode)
+					sized_jobs.push_back(std::make_pair(i, &sized));
+		if (!sized_jobs.empty()) {
+			encode_parallel_for((int)sized_jobs.size(), [&](int j) {
+				network_sized_t *sized = sized_jobs[j].second;
+				sized->data = std::make_shared<std::vector<unsigned char>>();
+				if (sized->quality)
+					encode_window_jpeg_resized(*sized->data, frame, sized_jobs[j].first, sized->width, sized->height, sized->quality, jpeg_subsample);
+				else
+					encode_window_png_resized(*sized->data, frame, sized_jobs[j].first, sized->width, sized->height);
+			});
 		}
 
-		// Now that the image is compressed, we can throw away the texture capture and tell the main thread to start capturing a new one immediately
-		texture_pointer = NULL;
+		// Build the records for each window once, and share them between all the clients that want them
+		for (int i = 0; i < frame->count; i++) {
+			for (auto &sized : window_sized[i]) {
+				sized.record = network_record_t();
+				if (sized.send)
+					make_record_v4(sized.record, i, sized.quality ? XTEV4_CODEC_JPEG : XTEV4_CODEC_PNG_SCALED, frame, sized.data, 0);
+			}
+			bool whole = window_changed[i] || (window_tiles[i] < 0) || (delta_keyframe & (1u << i));
+			qoi_record[i] = network_record_t();
+			if (whole && (qoi_wanted & (1u << i)))
+				make_record_v4(qoi_record[i], i, XTEV4_CODEC_QOI, frame, window_qoi[i].image, 0);
+			for (int v4 = 0; v4 < 2; v4++) {
+				full_record[v4][i] = network_record_t();
+				tile_record[v4][i] = network_record_t();
+				jpeg_record[v4][i] = network_record_t();
+				if (!framing_wanted[v4])
+					continue;
+				if (whole && (jpeg_wanted & (1u << i))) {
+					if (v4)
+						make_record_v4(jpeg_record[v4][i], i, XTEV4_CODEC_JPEG, frame, window_jpeg[i].image, 0);
+					else
+						make_record(jpeg_record[v4][i], "_____", i, window_jpeg[i].image, "____");
+				}
+				if (whole && (png_wanted & (1u << i))) {
+					if (v4)
+						make_record_v4(full_record[v4][i], i, XTEV4_CODEC_PNG, frame, window_cache[i].image, 0);
+					else
+						make_record(full_record[v4][i], "_____", i, window_cache[i].image, "____");
+				}
+				if (window_tiles[i] > 0) {
+					if (v4) {
+						make_record_v4(tile_record[v4][i], i, XTEV4_CODEC_TILES, frame, tile_data[i], window_tiles[i]);
+					} else {
+						// Tile size and number of tiles as 2 byte little-endian values
+						char extra[4] = { DELTA_TILE_SIZE & 0xFF, DELTA_TILE_SIZE >> 8, (char)(window_tiles[i] & 0xFF), (char)(window_tiles[i] >> 8) };
+						make_record(tile_record[v4][i], "DELTA", i, tile_data[i], extra);
+					}
+					tile_record[v4][i].keyframe = false;
+				}
+			}
+		}
 
-		// Send the compressed data to the socket
-		for (auto s = connections.begin(); s != connections.end(); ) {
-			// log_printf("Sending PNG data to socket %zu\n", *s);
-			iSendResult = send(*s, (const char *)out_data.data(), (int)out_data.size(), 0);
-			if (iSendResult == SOCKET_ERROR) {
-				log_printf("Connection closed: TCP PNG send of %zu bytes failed with code %d\n", out_data.size(), WSAGetLastError());
-				closesocket(*s);
-				s = connections.erase(s); // Increment iterator
+		// Pick the record a client needs for a window, if any
+		auto select_record = [&](network_client_t &c, int i) -> const network_record_t * {
+			uint32_t bit = 1u << i;
+			const network_record_t *record = NULL;
+			const network_record_t *full = (c.v4 && (c.codecs & (1u << XTEV4_CODEC_QOI))) ? &qoi_record[i] : &full_record[c.v4][i];
+			int quality = network_client_jpeg_quality(c, window_quality, i);
+			if (quality)
+				full = &jpeg_record[c.v4][i];
+			int width, height;
+			if (network_client_window_size(c, &frame->layout[i], i, width, height)) {
+				network_sized_t *sized = network_find_sized(window_sized[i], width, height, quality);
+				if ((sized != NULL) && sized->send)
+					record = &sized->record;
+			} else if (!c.delta) {
+				if (window_changed[i])
+					record = full;
+			} else if ((c.need_keyframe & bit) || (window_tiles[i] < 0)) {
+				record = full;
+			} else if (window_tiles[i] > 0) {
+				record = &tile_record[c.v4][i];
 			}
-			else if (iSendResult != out_data.size()) {
-				log_printf("Fatal: TCP transmission was %d bytes but expected to send %zu bytes\n", iSendResult, out_data.size());
-				for (auto s : connections)
-					closesocket(s);
-				WSACleanup();
-				return;
+			c.need_keyframe &= ~bit;
+			return record;
+		};
+
+		// Queue the records on each socket in window order, the clients keep showing the previous image for any that are
+		// left out. Nothing is sent if none of the windows for a client changed. Then send to them all at once.
+		std::vector<network_client_t *> sending;
+		for (auto &c : connections) {
+			size_t offered = 0;
+			for (int i = 0; i < frame->count; i++) {
+				if (c.multicast || !(c.windows & (1u << i)))
+					continue;
+				const network_record_t *record = select_record(c, i);
+				if (record != NULL) {
+					network_queue_client(c, *record);
+					offered += record->size();
+				}
 			}
-			else {
-				// log_printf("Successfully sent PNG image of %dx%d with %d compressed bytes\n", cockpit_texture_width, cockpit_texture_height, iSendResult);
-				++s; // Increment iterator
+			if (offered > 0) {
+				c.offered += offered;
+				c.offered_frames++;
 			}
+			sending.push_back(&c);
+		}
+		network_flush_clients(sending);
+		network_remove_closed();
+
+		// Multicast has no queue, so anything that does not fit in the socket buffer is lost and sent again as a keyframe
+		for (int i = 0; i < frame->count; i++) {
+			if (!(multicast_viewers.windows & (1u << i)))
+				continue;
+			const network_record_t *record = select_record(multicast_viewers, i);
+			if ((record != NULL) && !network_multicast_record(*record))
+				multicast_viewers.need_keyframe |= 1u << i;
 		}
 	}
 
 	// Unreachable code - shut down everything
+	network_wake_socket = INVALID_SOCKET;
+	closesocket(wake_socket);
 	closesocket(ListenSocket);
 	WSACleanup();
 }
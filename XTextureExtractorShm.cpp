@@ -0,0 +1,210 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+#undef UNICODE
+#define WIN32_LEAN_AND_MEAN
+
+#include "XTextureExtractor.h"
+#include "shm-reader/xte_shm.h"
+#include <stdint.h>
+#include <stddef.h>
+#if LIN || APL
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Publishes the raw captured windows into shared memory, for readers on the same machine that want the pixels
+// without any PNG encoding or sockets. The layout is in shm-reader/xte_shm.h, which has a small library for reading
+// it. Everything here is only called from the network thread.
+
+static_assert(COCKPIT_MAX_WINDOWS <= XTE_SHM_MAX_WINDOWS, "Shared memory layout does not have room for every window");
+static_assert((uint64_t)MAX_TEXTURE_WIDTH * MAX_TEXTURE_HEIGHT * 4 <= XTE_SHM_SLOT_BYTES, "Shared memory slot is smaller than the texture");
+
+xte_shm_header_t *shm_header = NULL;
+uint32_t shm_next_sequence = 0;
+uint64_t shm_last_attempt_usec = 0;
+#if IBM
+HANDLE shm_handle = NULL;
+uint64_t shm_committed[XTE_SHM_SLOTS]; // Pages are only committed as the frames grow
+#endif
+
+void shm_close(void) {
+	if (shm_header == NULL)
+		return;
+	shm_header->magic = 0; // Readers that still have it mapped will see this and let go
+#if IBM
+	UnmapViewOfFile(shm_header);
+	CloseHandle(shm_handle);
+	shm_handle = NULL;
+#else
+	munmap(shm_header, XTE_SHM_TOTAL_BYTES);
+#if LIN
+	unlink("/dev/shm/" XTE_SHM_NAME);
+#else
+	shm_unlink("/" XTE_SHM_NAME);
+#endif
+#endif
+	shm_header = NULL;
+	log_printf("Closed shared memory segment %s\n", XTE_SHM_NAME);
+}
+
+bool shm_open_segment(void) {
+	void *mapped = NULL;
+#if IBM
+	// Reserve the whole thing but leave it uncommitted, so the 200MB only costs what the windows actually use
+	shm_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_RESERVE,
+		(DWORD)(XTE_SHM_TOTAL_BYTES >> 32), (DWORD)(XTE_SHM_TOTAL_BYTES & 0xFFFFFFFF), "Local\\" XTE_SHM_NAME);
+	if (shm_handle == NULL) {
+		log_printf("Could not create shared memory segment %s, error %lu\n", XTE_SHM_NAME, GetLastError());
+		return false;
+	}
+	mapped = MapViewOfFile(shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, XTE_SHM_TOTAL_BYTES);
+	if ((mapped == NULL) || (VirtualAlloc(mapped, XTE_SHM_HEADER_BYTES, MEM_COMMIT, PAGE_READWRITE) == NULL)) {
+		log_printf("Could not map shared memory segment %s, error %lu\n", XTE_SHM_NAME, GetLastError());
+		if (mapped != NULL)
+			UnmapViewOfFile(mapped);
+		CloseHandle(shm_handle);
+		shm_handle = NULL;
+		return false;
+	}
+	for (int s = 0; s < XTE_SHM_SLOTS; s++)
+		shm_committed[s] = 0;
+#else
+	// Linux has shm_open() in librt which we do not link against, but it is only a file in /dev/shm anyway
+#if LIN
+	int fd = open("/dev/shm/" XTE_SHM_NAME, O_RDWR | O_CREAT, 0666);
+#else
+	int fd = shm_open("/" XTE_SHM_NAME, O_RDWR | O_CREAT, 0666);
+#endif
+	if (fd < 0) {
+		log_printf("Could not create shared memory segment %s\n", XTE_SHM_NAME);
+		return false;
+	}
+	// The file is sparse, so only the pages that are written take any memory. macOS only allows one ftruncate()
+	// on shared memory, so leave it alone when a previous run already made it the right size.
+	struct stat st;
+	if (((fstat(fd, &st) != 0) || ((uint64_t)st.st_size != XTE_SHM_TOTAL_BYTES)) && (ftruncate(fd, XTE_SHM_TOTAL_BYTES) != 0)) {
+		log_printf("Could not resize shared memory segment %s to %llu bytes\n", XTE_SHM_NAME, (unsigned long long)XTE_SHM_TOTAL_BYTES);
+		close(fd);
+		return false;
+	}
+	mapped = mmap(NULL, XTE_SHM_TOTAL_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		log_printf("Could not map shared memory segment %s\n", XTE_SHM_NAME);
+		return false;
+	}
+#endif
+	shm_header = (xte_shm_header_t *)mapped;
+	shm_header->magic = 0;
+	shm_header->version = XTE_SHM_VERSION;
+	shm_header->size = XTE_SHM_TOTAL_BYTES;
+	for (int s = 0; s < XTE_SHM_SLOTS; s++) {
+		shm_header->slot_offset[s] = XTE_SHM_HEADER_BYTES + s * XTE_SHM_SLOT_BYTES;
+		shm_header->slots[s].seqlock.store(0, std::memory_order_relaxed);
+	}
+	shm_header->latest.store(XTE_SHM_SLOTS, std::memory_order_relaxed);
+	shm_header->reader_usec.store(0, std::memory_order_relaxed);
+	shm_header->writer_usec.store(capture_time_usec(), std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	shm_header->magic = XTE_SHM_MAGIC;
+	log_printf("Publishing windows in shared memory segment %s\n", XTE_SHM_NAME);
+	return true;
+}
+
+// Called every time around the network loop, opens or closes the segment to match the config and returns
+// true when a reader has asked for a frame recently enough that it is worth capturing for them
+bool shm_reader_active(void) {
+	if (!config_shared_memory) {
+		shm_close();
+		return false;
+	}
+	uint64_t now = capture_time_usec();
+	if (shm_header == NULL) {
+		if (now - shm_last_attempt_usec < 10 * 1000000)
+			return false;
+		shm_last_attempt_usec = now;
+		if (!shm_open_segment())
+			return false;
+	}
+	shm_header->writer_usec.store(now, std::memory_order_relaxed);
+	uint64_t reader_usec = shm_header->reader_usec.load(std::memory_order_relaxed);
+	return (reader_usec > 0) && ((now < reader_usec) || (now - reader_usec < XTE_SHM_READER_TIMEOUT_USEC));
+}
+
+void shm_publish_frame(const capture_frame_t *frame) {
+	if (shm_header == NULL)
+		return;
+	uint32_t latest = shm_header->latest.load(std::memory_order_relaxed);
+	uint32_t index = (latest < XTE_SHM_SLOTS) ? (latest + 1) % XTE_SHM_SLOTS : 0;
+	xte_shm_slot_t *slot = &shm_header->slots[index];
+	unsigned char *pixels = (unsigned char *)shm_header + shm_header->slot_offset[index];
+	int count = (frame->count < XTE_SHM_MAX_WINDOWS) ? frame->count : XTE_SHM_MAX_WINDOWS;
+
+	uint64_t bytes = 0;
+	for (int i = 0; i < count; i++)
+		bytes += (uint64_t)frame->layout[i].width * frame->layout[i].height * 4;
+	if (bytes > XTE_SHM_SLOT_BYTES)
+		return; // Cannot happen while the windows fit inside the texture
+#if IBM
+	if (bytes > shm_committed[index]) {
+		if (VirtualAlloc(pixels, (SIZE_T)bytes, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+			log_printf("Could not commit %llu bytes of shared memory, error %lu\n", (unsigned long long)bytes, GetLastError());
+			return;
+		}
+		shm_committed[index] = bytes;
+	}
+#endif
+
+	// Readers copying out of this slot will see the seqlock change and throw away what they got
+	uint32_t seqlock = slot->seqlock.load(std::memory_order_relaxed);
+	slot->seqlock.store(seqlock + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->sequence = shm_next_sequence++;
+	slot->capture_usec = frame->capture_usec;
+	slot->texture_seq = frame->texture_seq;
+	slot->count = count;
+	snprintf(slot->aircraft, sizeof(slot->aircraft), "%s", cockpit_aircraft_name);
+	uint64_t offset = 0;
+	for (int i = 0; i < count; i++) {
+		const capture_window_t *win = &frame->layout[i];
+		xte_shm_window_t *out = &slot->windows[i];
+		snprintf(out->name, sizeof(out->name), "%s", _g_window_name[i]);
+		out->width = win->width;
+		out->height = win->height;
+		out->offset = offset;
+		// The capture is bottom row first like GL, but everything else wants the top row first
+		size_t stride = (size_t)win->width * 4;
+		const unsigned char *src = frame->pixels.data() + win->offset;
+		unsigned char *dst = pixels + offset;
+		for (int y = 0; y < win->height; y++)
+			memcpy(dst + (size_t)y * stride, src + (size_t)(win->height - 1 - y) * stride, stride);
+		offset += (uint64_t)stride * win->height;
+	}
+
+	slot->seqlock.store(seqlock + 2, std::memory_order_release);
+	shm_header->latest.store(index, std::memory_order_release);
+}
@@ -27,6 +27,9 @@ object Const {
     val TCP_PLUGIN_PORT = 52500
     val TCP_INTRO_HEADER = 4096
     val TCP_PLUGIN_VERSION = "XTEv3"
+    val TCP_DELTA_PROTOCOL = "XTEv3-delta"
+    val TCP_HEADERS_COMMAND = "HEADERS"
+    val TCP_CODECS_COMMAND = "CODECS JPEG"
     val BECN_PORT = 49707
     val BECN_ADDRESS = "239.255.1.1"
     val ERROR_NETWORK_SLEEP: Long = 1000 // Number of msec to wait on network failure
@@ -120,6 +120,7 @@ open class MainActivity : Activity(), TCPBitmapClient.OnTCPBitmapEvent, Multicas
             commit()
         }
         Log.d(Const.TAG, "Changed window for texture 1 to $window1Idx=[${windowNames[window1Idx]}]")
+        tcp_extplane?.subscribe(window1Idx, window2Idx)
     }
 
     fun changeWindow2() {
@@ -134,6 +135,7 @@ open class MainActivity : Activity(), TCPBitmapClient.OnTCPBitmapEvent, Multicas
             commit()
         }
         Log.d(Const.TAG, "Changed window for texture 2 to $window2Idx=[${windowNames[window2Idx]}]")
+        tcp_extplane?.subscribe(window1Idx, window2Idx)
     }
 
     // Handle D-pad events to change the windows
@@ -475,6 +477,7 @@ open class MainActivity : Activity(), TCPBitmapClient.OnTCPBitmapEvent, Multicas
                 putInt("window_2_idx", window2Idx)
                 commit()
             }
+            tcpRef.subscribe(window1Idx, window2Idx)
         } catch (e: IOException) {
             Log.e(Const.TAG, "IOException processing header - $e")
             networkingFatal("Invalid header data")
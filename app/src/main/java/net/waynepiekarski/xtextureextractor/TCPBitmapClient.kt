@@ -29,7 +29,8 @@ import java.net.*
 import kotlin.concurrent.thread
 import java.io.*
 import android.graphics.BitmapFactory
-import android.os.Build
+import android.graphics.Canvas
+import android.graphics.Rect
 
 
 class TCPBitmapClient (private var address: InetAddress, private var port: Int, private var callback: OnTCPBitmapEvent) {
@@ -39,6 +40,11 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
     private lateinit var outputStreamWriter: OutputStreamWriter
     private lateinit var dataInputStream: DataInputStream
 
+    // With the delta protocol the server only sends the tiles that changed, so keep a copy of each window being shown
+    private var deltaProtocol = false
+    private val deltaBitmaps = HashMap<Int, Bitmap>()
+    private var keyframeRequested = false
+
     interface OnTCPBitmapEvent {
         fun onReceiveTCPBitmap(windowId: Int, image: Bitmap, tcpRef: TCPBitmapClient)
         fun onReceiveTCPHeader(header: ByteArray, tcpRef: TCPBitmapClient)
@@ -58,7 +64,8 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
         // The socketThread loop will now clean up everything
     }
 
-    fun writeln(str: String) {
+    // Commands are written from both the socket thread and the background thread
+    @Synchronized fun writeln(str: String) {
         if (cancelled) {
             Log.d(Const.TAG, "Skipping write to cancelled socket: [$str]")
             return
@@ -73,6 +80,12 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
         }
     }
 
+    // Ask the plugin to only send the windows being shown, older plugins ignore this and send everything
+    fun subscribe(vararg windows: Int) {
+        val ids = windows.distinct().joinToString(" ")
+        MainActivity.doBgThread { writeln("SUBSCRIBE $ids") }
+    }
+
     private fun closeBuffers() {
         // Call close on the top level buffers which will propagate to the original socket
         // and cause any pending reads and writes to fail
@@ -131,14 +144,30 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
         }
         if (!cancelled) {
             MainActivity.doUiThread { callback.onReceiveTCPHeader(header, this) }
+
+            // Newer plugins list the protocols they support after __EOF__
+            val lines = String(header).substringBefore(0x00.toChar()).split('\n')
+            val protocols = lines.getOrNull(lines.indexOfFirst { it.contains("__EOF__") } + 1)
+            if ((protocols != null) && protocols.startsWith("PROTOCOLS ") && protocols.split(' ').contains(Const.TCP_DELTA_PROTOCOL)) {
+                writeln("PROTOCOL ${Const.TCP_DELTA_PROTOCOL}")
+                deltaProtocol = true
+            }
+            // Keep the connection open when the aircraft changes, older plugins ignore this and still disconnect
+            writeln(Const.TCP_HEADERS_COMMAND)
+            // Windows the plugin has a jpeg_quality for are sent as JPEG, which is a lot smaller over WiFi
+            writeln(Const.TCP_CODECS_COMMAND)
         }
 
         // Start reading from the socket, any writes happen from another thread
         var reason: String? = null
         while (!cancelled) {
             // Each window transmission starts with !_____X_ where X is a binary byte 0x00 to 0xFF
+            // Changed tiles with the delta protocol start with !DELTAX_ instead
             var windowId: Int = -1
             var expectedBytes: Int = -1
+            var isDelta = false
+            var tileSize = 0
+            var tileCount = 0
             try {
                 val a = dataInputStream.readByte().toChar()
                 val b = dataInputStream.readByte().toChar()
@@ -148,7 +177,21 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
                 val f = dataInputStream.readByte().toChar()
                 windowId = dataInputStream.readByte().toInt()
                 val h = dataInputStream.readByte().toChar()
-                if ((a != '!') || (b != '_') || (c != '_') || (d != '_') || (e != '_') || (f != '_') || (h != '_')) {
+                if ((a == '!') && (b == 'H') && (c == 'E') && (d == 'A') && (e == 'D') && (f == 'R')) {
+                    // New header after the aircraft changed, padded out like any other record. The windows that
+                    // follow are the new ones, and each starts with a whole image
+                    val length = Integer.reverseBytes(dataInputStream.readInt())
+                    dataInputStream.skipBytes(4)
+                    val newHeader = ByteArray(length)
+                    dataInputStream.readFully(newHeader)
+                    dataInputStream.skipBytes(1024 - (length % 1024))
+                    deltaBitmaps.clear()
+                    keyframeRequested = false
+                    MainActivity.doUiThread { callback.onReceiveTCPHeader(newHeader, this) }
+                    continue
+                }
+                isDelta = deltaProtocol && (b == 'D') && (c == 'E') && (d == 'L') && (e == 'T') && (f == 'A')
+                if ((a != '!') || (!isDelta && ((b != '_') || (c != '_') || (d != '_') || (e != '_') || (f != '_'))) || (h != '_')) {
                     reason = "Image header invalid ![$a] _[$b] _[$c] _[$d] _[$e] _[$f] W[$windowId] _[$h]"
                     cancelled = true
                     break
@@ -161,14 +204,20 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
                 expectedBytes = (((((b3 * 256) + b2) * 256) + b1) * 256) + b0
                 // Log.d(Const.TAG, "Found header for window $windowId with $expectedBytes bytes of PNG data (lsb)b0=$b0, b1=$b1, b2=$b2, (msb)b3=$b3")
 
-                val w = dataInputStream.readByte().toChar()
-                val x = dataInputStream.readByte().toChar()
-                val y = dataInputStream.readByte().toChar()
-                val z = dataInputStream.readByte().toChar()
-                if ((w != '_') || (x != '_') || (y != '_') || (z != '_')) {
-                    reason = "Image second header invalid _[$w] _[$x] _[$y] _[$z]"
-                    cancelled = true
-                    break
+                if (isDelta) {
+                    // Tile size and number of tiles as 2 byte values
+                    tileSize = dataInputStream.readUnsignedByte() + dataInputStream.readUnsignedByte() * 256
+                    tileCount = dataInputStream.readUnsignedByte() + dataInputStream.readUnsignedByte() * 256
+                } else {
+                    val w = dataInputStream.readByte().toChar()
+                    val x = dataInputStream.readByte().toChar()
+                    val y = dataInputStream.readByte().toChar()
+                    val z = dataInputStream.readByte().toChar()
+                    if ((w != '_') || (x != '_') || (y != '_') || (z != '_')) {
+                        reason = "Image second header invalid _[$w] _[$x] _[$y] _[$z]"
+                        cancelled = true
+                        break
+                    }
                 }
             } catch (e: IOException) {
                 Log.d(Const.TAG, "Failed to receive window header, connection has failed")
@@ -176,23 +225,48 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
                 break
             }
 
-            if ((windowId == callback.getWindow1Index()) || (windowId == callback.getWindow2Index())) {
-                // Read the raw PNG data and decode it
-                var bitmap: Bitmap?
+            val windowShown = (windowId == callback.getWindow1Index()) || (windowId == callback.getWindow2Index())
+            if (!windowShown)
+                deltaBitmaps.remove(windowId) // Deltas for this window are being skipped, so the copy is now out of date
+            if (windowShown && deltaProtocol) {
+                // Every record has to be applied in order, since each delta builds on the previous one
+                var bitmap: Bitmap? = null
                 try {
-                    if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.KITKAT) {
-                        // The image decoder in >= API 19 correctly reads all the bytes for the image
-                        bitmap = BitmapFactory.decodeStream(dataInputStream)
-                    } else {
-                        // Android versions earlier than API 19 have a bug where decodeStream does not read up all
-                        // remaining bytes and the stream gets out of sync. So we read the data manually into a
-                        // buffer and then pass it in for decoding. If I could measure the bytes read in decodeStream
-                        // we could do this more efficiently.
-                        val pngData = ByteArray(expectedBytes)
-                        dataInputStream.readFully(pngData)
-                        val byteArrayInputStream = ByteArrayInputStream(pngData)
-                        bitmap = BitmapFactory.decodeStream(byteArrayInputStream)
+                    val data = ByteArray(expectedBytes)
+                    dataInputStream.readFully(data)
+                    if (!isDelta) {
+                        val image = BitmapFactory.decodeByteArray(data, 0, data.size)
+                        if (image != null) {
+                            deltaBitmaps[windowId] = image.copy(Bitmap.Config.ARGB_8888, true)
+                            keyframeRequested = false
+                        }
+                    } else if (deltaBitmaps[windowId] != null) {
+                        applyTiles(deltaBitmaps[windowId]!!, data, tileSize, tileCount)
+                    } else if (!keyframeRequested) {
+                        // Only have deltas for a window we have not seen yet, so ask for all of it
+                        writeln("KEYFRAME")
+                        keyframeRequested = true
                     }
+                    bitmap = deltaBitmaps[windowId]?.copy(Bitmap.Config.ARGB_8888, false)
+                } catch (e: IOException) {
+                    Log.d(Const.TAG, "Exception during socket read or delta decode $e")
+                    cancelled = true
+                    reason = "Delta decode failure"
+                    break
+                }
+                if (bitmap != null)
+                    MainActivity.doUiThread { callback.onReceiveTCPBitmap(windowId, bitmap, this) }
+            } else if (windowShown) {
+                // Read the raw PNG or JPEG data and decode it
+                var bitmap: Bitmap?
+                try {
+                    // Android versions earlier than API 19 have a bug where decodeStream does not read up all
+                    // remaining bytes and the stream gets out of sync, and the JPEG decoder does not always read
+                    // exactly to the end of the image either. So we read the data manually into a buffer and then
+                    // pass it in for decoding.
+                    val imageData = ByteArray(expectedBytes)
+                    dataInputStream.readFully(imageData)
+                    bitmap = BitmapFactory.decodeByteArray(imageData, 0, imageData.size)
                 } catch (e: IOException) {
                     Log.d(Const.TAG, "Exception during socket read or bitmap decode $e")
                     bitmap = null
@@ -236,6 +310,21 @@ class TCPBitmapClient (private var address: InetAddress, private var port: Int,
         MainActivity.doUiThread { callback.onDisconnectTCP(reason, this) }
     }
 
+    // Delta data is a list of 2 byte tile x,y pairs, followed by a PNG with each tile stacked vertically in the same order
+    private fun applyTiles(bitmap: Bitmap, data: ByteArray, tileSize: Int, tileCount: Int) {
+        val tiles = BitmapFactory.decodeByteArray(data, tileCount * 4, data.size - tileCount * 4)
+            ?: throw IOException("Invalid PNG tile data")
+        val canvas = Canvas(bitmap)
+        for (t in 0 until tileCount) {
+            val tx = (data[t * 4].toInt() and 0xFF) + (data[t * 4 + 1].toInt() and 0xFF) * 256
+            val ty = (data[t * 4 + 2].toInt() and 0xFF) + (data[t * 4 + 3].toInt() and 0xFF) * 256
+            val x = tx * tileSize
+            val y = ty * tileSize
+            // Tiles on the right and bottom edges are clipped by the bitmap
+            canvas.drawBitmap(tiles, Rect(0, t * tileSize, tileSize, (t + 1) * tileSize), Rect(x, y, x + tileSize, y + tileSize), null)
+        }
+    }
+
     // Constructor starts a new thread to handle the blocking outbound connection
     init {
         Log.d(Const.TAG, "Created thread to connect to $address:$port")
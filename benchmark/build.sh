@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Builds the encoder and send benchmarks, which need the X-Plane SDK headers but not X-Plane
+cd `dirname $0`
+set -x
+if [ "`uname`" == "Darwin" ]; then
+  clang++ -std=c++17 -O2 -Wno-deprecated-declarations \
+    -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DAPL -DGL_SILENCE_DEPRECATION \
+    -I../SDK/CHeaders/XPLM encode_bench.cpp ../XTextureExtractorEncode.cpp ../XTextureExtractorJpeg.cpp ../relay/xte_qoi.cpp ../lodepng/lodepng.cpp \
+    -o encode_bench
+else
+  g++ -std=c++17 -O2 \
+    -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DLIN \
+    -I../SDK/CHeaders/XPLM encode_bench.cpp ../XTextureExtractorEncode.cpp ../XTextureExtractorJpeg.cpp ../relay/xte_qoi.cpp ../lodepng/lodepng.cpp \
+    -lpthread -o encode_bench
+  g++ -std=c++17 -O2 \
+    -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DLIN \
+    -I../SDK/CHeaders/XPLM send_bench.cpp ../XTextureExtractorEncode.cpp ../XTextureExtractorJpeg.cpp ../relay/xte_qoi.cpp ../lodepng/lodepng.cpp \
+    -lpthread -o send_bench
+fi
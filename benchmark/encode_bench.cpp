@@ -0,0 +1,251 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Compresses every window of the sample texture-*.png files in the top directory with each PNG preset and with QOI,
+// using the plugin's own encoder, and prints the time and size for each along with how long lodepng and the QOI
+// decoder in relay/ take to decode them again. This is where the tables in the README come from. Times are for a
+// single thread, run it from the benchmark directory after building with build.sh. "encode_bench threads [N]"
+// instead compresses every window on the encoder pool like the network thread does, with 1 up to N threads.
+
+#include "../XTextureExtractor.h"
+#include "../lodepng/lodepng.h"
+#include "../relay/xte_qoi.h"
+#include <string>
+#include <chrono>
+#include <thread>
+
+// Everything the encoder expects from the rest of the plugin
+char _g_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_encode_threads = 1;
+int config_png_preset = PNG_PRESET_BALANCED;
+int config_jpeg_quality = JPEG_QUALITY_OFF;
+int config_jpeg_subsample = true;
+int config_window_count = 0;
+char config_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_window_png_preset[COCKPIT_MAX_WINDOWS];
+int config_window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+
+void XPLMDebugString(const char *s) {
+	fputs(s, stderr);
+}
+
+#define BENCH_REPEATS 5
+#define BENCH_QOI     PNG_PRESET_COUNT
+#define BENCH_JPEG    (PNG_PRESET_COUNT + 1) // Only encoded, since there is no JPEG decoder here
+#define BENCH_JPEG_QUALITY 85
+#define BENCH_COUNT   (PNG_PRESET_COUNT + 2)
+
+// Each sample texture and the .tex file with its windows
+static const char *bench_textures[][2] = {
+	{ "Cessna_172SP", "Cessna_172SP" },
+	{ "cirrus-sr22", "Cirrus SR22" },
+	{ "crj200", "CRJ200" },
+	{ "falcon7", "falcon7" },
+	{ "lancair-legacy", "Legacy" },
+	{ "mg787", "b7879" },
+	{ "toliss-A340", "A340-600_XP11" },
+	{ "xp12-A330", "A330" },
+	{ "xp12-F14", "F-14D" },
+	{ "xp747", "747-400" },
+	{ "bell429", "Bell429" },
+};
+
+// Cut the windows out of a texture into a frame laid out like the capture, with the bottom row first
+static bool bench_load(capture_frame_t &frame, const char *texture, const char *tex) {
+	std::vector<unsigned char> image;
+	unsigned tw, th;
+	if (lodepng::decode(image, tw, th, std::string("../texture-") + texture + ".png", LCT_RGBA, 8))
+		return false;
+	FILE *fp = fopen((std::string("../XTextureExtractor-Data/") + tex + ".acf.tex").c_str(), "r");
+	if (fp == NULL)
+		return false;
+	char line[1024];
+	frame.count = 0;
+	frame.pixels.clear();
+	fgets(line, sizeof(line), fp); // Aircraft and texture size
+	while ((fgets(line, sizeof(line), fp) != NULL) && (frame.count < COCKPIT_MAX_WINDOWS)) {
+		int l, b, r, t;
+		if ((sscanf(line, "%255s %d %d %d %d", _g_window_name[frame.count], &l, &b, &r, &t) != 5) || (r <= l) || (t <= b) || (r > (int)tw) || (t > (int)th))
+			continue;
+		capture_window_t *win = &frame.layout[frame.count++];
+		win->x = l;
+		win->y = b;
+		win->width = r - l;
+		win->height = t - b;
+		win->offset = frame.pixels.size();
+		size_t stride = (size_t)win->width * 4;
+		frame.pixels.resize(win->offset + stride * win->height);
+		for (int y = 0; y < win->height; y++)
+			memcpy(&frame.pixels[win->offset + (win->height - 1 - y) * stride], &image[((th - t + y) * (size_t)tw + l) * 4], stride);
+	}
+	fclose(fp);
+	return frame.count > 0;
+}
+
+static double bench_msec(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / BENCH_REPEATS;
+}
+
+struct bench_result_t {
+	double encode_msec = 0, decode_msec = 0;
+	size_t bytes = 0;
+};
+
+// Encode and decode every window with one PNG preset, or with QOI or JPEG
+static bench_result_t bench_run(const capture_frame_t &frame, int preset) {
+	bench_result_t result;
+	std::vector<std::vector<unsigned char>> images(frame.count);
+	config_png_preset = preset;
+	auto start = std::chrono::steady_clock::now();
+	for (int repeat = 0; repeat < BENCH_REPEATS; repeat++)
+		for (int i = 0; i < frame.count; i++) {
+			if (preset < PNG_PRESET_COUNT)
+				encode_window_png(images[i], &frame, i);
+			else if (preset == BENCH_QOI)
+				encode_window_qoi(images[i], &frame, i);
+			else
+				encode_window_jpeg(images[i], &frame, i, BENCH_JPEG_QUALITY, true);
+		}
+	result.encode_msec = bench_msec(start);
+	if (preset == BENCH_JPEG) {
+		for (int i = 0; i < frame.count; i++)
+			result.bytes += images[i].size();
+		result.decode_msec = -1;
+		return result;
+	}
+
+	std::vector<unsigned char> rgba;
+	start = std::chrono::steady_clock::now();
+	for (int repeat = 0; repeat < BENCH_REPEATS; repeat++)
+		for (int i = 0; i < frame.count; i++) {
+			int width, height;
+			unsigned w, h;
+			rgba.clear(); // lodepng appends to whatever is already there
+			if (preset < PNG_PRESET_COUNT)
+				lodepng::decode(rgba, w, h, images[i], LCT_RGBA, 8);
+			else if (!xte_qoi_decode(images[i].data(), images[i].size(), rgba, width, height))
+				printf("QOI decode of window %d failed\n", i);
+		}
+	result.decode_msec = bench_msec(start);
+
+	for (int i = 0; i < frame.count; i++) {
+		result.bytes += images[i].size();
+		// Both are lossless, so check the last window decoded matches what went in apart from the alpha
+		int width = 0, height = 0;
+		unsigned w, h;
+		rgba.clear();
+		if (preset < PNG_PRESET_COUNT) {
+			lodepng::decode(rgba, w, h, images[i], LCT_RGBA, 8);
+			width = w;
+			height = h;
+		} else {
+			xte_qoi_decode(images[i].data(), images[i].size(), rgba, width, height);
+		}
+		const capture_window_t *win = &frame.layout[i];
+		bool match = (width == win->width) && (height == win->height);
+		for (int y = 0; match && (y < height); y++)
+			for (int x = 0; match && (x < width); x++)
+				match = !memcmp(&rgba[((size_t)y * width + x) * 4], &frame.pixels[win->offset + ((size_t)(height - 1 - y) * width + x) * 4], 3);
+		if (!match)
+			printf("Window %d does not match after decoding\n", i);
+	}
+	return result;
+}
+
+static void bench_print(const bench_result_t &result) {
+	if (result.decode_msec < 0)
+		printf("   %6.1f ms %9s %6zu KB", result.encode_msec, "-", result.bytes / 1024);
+	else
+		printf("   %6.1f ms %6.1f ms %6zu KB", result.encode_msec, result.decode_msec, result.bytes / 1024);
+}
+
+// Frames per second for all the sample textures one after the other with the balanced preset, as the number of
+// encoder threads goes up. Each texture is one batch for the pool, so the biggest window in it sets a limit.
+static void bench_threads(int max_threads) {
+	std::vector<capture_frame_t> frames(sizeof(bench_textures) / sizeof(bench_textures[0]));
+	for (size_t t = 0; t < frames.size(); t++) {
+		if (!bench_load(frames[t], bench_textures[t][0], bench_textures[t][1])) {
+			printf("Could not load %s\n", bench_textures[t][0]);
+			return;
+		}
+	}
+	config_png_preset = PNG_PRESET_BALANCED;
+	std::vector<std::vector<unsigned char>> images(COCKPIT_MAX_WINDOWS);
+	printf("%7s %10s %8s %8s\n", "threads", "encode", "fps", "speedup");
+	double single = 0;
+	for (int threads = 1; threads <= max_threads; threads++) {
+		config_encode_threads = threads;
+		auto start = std::chrono::steady_clock::now();
+		// One pass first, so starting the threads and filling the palettes is not counted
+		for (int repeat = -1; repeat < BENCH_REPEATS; repeat++) {
+			if (repeat == 0)
+				start = std::chrono::steady_clock::now();
+			for (auto &frame : frames)
+				encode_parallel_for(frame.count, [&](int i) { encode_window_png(images[i], &frame, i); });
+		}
+		double msec = bench_msec(start);
+		if (threads == 1)
+			single = msec;
+		printf("%7d %7.1f ms %8.2f %7.2fx\n", threads, msec, 1000.0 / msec, single / msec);
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char **argv) {
+	if ((argc > 1) && !strcmp(argv[1], "threads")) {
+		// Up to one thread per core, or however many are given after it
+		int max_threads = (argc > 2) ? atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+		if (max_threads > COCKPIT_MAX_WINDOWS)
+			max_threads = COCKPIT_MAX_WINDOWS;
+		bench_threads(max_threads);
+		return 0;
+	}
+	const char *names[BENCH_COUNT] = { "stored", "fast", "balanced", "small", "qoi", "jpeg" };
+	bench_result_t total[BENCH_COUNT];
+	printf("%-16s %7s", "texture", "Mpixels");
+	for (int p = 0; p < BENCH_COUNT; p++)
+		printf("   %-8s encode   decode     size", names[p]);
+	printf("\n");
+	for (auto &texture : bench_textures) {
+		capture_frame_t frame;
+		if (!bench_load(frame, texture[0], texture[1])) {
+			printf("Could not load %s\n", texture[0]);
+			continue;
+		}
+		printf("%-16s %7.2f", texture[0], frame.pixels.size() / 4e6);
+		for (int p = 0; p < BENCH_COUNT; p++) {
+			bench_result_t result = bench_run(frame, p);
+			total[p].encode_msec += result.encode_msec;
+			total[p].decode_msec += result.decode_msec;
+			total[p].bytes += result.bytes;
+			bench_print(result);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	printf("%-16s %7s", "total", "");
+	for (int p = 0; p < BENCH_COUNT; p++)
+		bench_print(total[p]);
+	printf("\n");
+	return 0;
+}
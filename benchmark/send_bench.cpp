@@ -0,0 +1,270 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Sends one large record a frame to 1, 8 and 32 clients over loopback, with the plugin's own send queue and send
+// backends, and prints how much CPU time the sending takes on the network thread for each frame. This is where the
+// socket and io_uring comparison for send_backend comes from. The clients are sockets on another thread that read
+// and throw away everything they get. Loopback copies the data even for zero-copy sends, so this only shows the
+// saving from batching the system calls, and a real network card is needed to see the rest.
+//
+// The network code is included directly rather than linked, since the client and record structures are private
+// to it. Run it from the benchmark directory after building with build.sh, with an optional number of seconds for
+// each run.
+
+#include "../XTextureExtractorNetwork.cpp"
+#include <time.h>
+
+// Everything the network code expects from the rest of the plugin, none of which is used here
+GLint cockpit_texture_id = 0;
+GLint cockpit_texture_width = 0;
+GLint cockpit_texture_height = 0;
+int cockpit_texture_seq = 0;
+char cockpit_aircraft_name[256] = "";
+char cockpit_aircraft_filename[256] = "";
+int cockpit_window_limit = 0;
+char _g_window_name[COCKPIT_MAX_WINDOWS][256];
+int _g_texture_lbrt[COCKPIT_MAX_WINDOWS][4];
+int config_capture_mode = CAPTURE_MODE_PBO;
+int config_encode_threads = 1;
+int config_keepalive_msec = NETWORK_KEEPALIVE_MSEC;
+int config_keyframe_msec = DELTA_KEYFRAME_MSEC;
+char config_multicast_group[64] = "";
+int config_multicast_port = MULTICAST_PORT;
+int config_multicast_parity = MULTICAST_PARITY;
+int config_shared_memory = false;
+int config_send_backend = NETWORK_SEND_SOCKET;
+int config_latency_msec = 0; // No rate control, every client is offered every frame
+int config_tcp_port = 0;
+int config_png_preset = PNG_PRESET_BALANCED;
+int config_jpeg_quality = JPEG_QUALITY_OFF;
+int config_jpeg_subsample = true;
+int config_window_count = 0;
+char config_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_window_png_preset[COCKPIT_MAX_WINDOWS];
+int config_window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+
+void XPLMDebugString(const char *s) {
+	// Kept quiet so the log lines from opening each ring do not break up the table
+}
+
+uint64_t capture_time_usec(void) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+const capture_frame_t *capture_acquire_frame(void) {
+	return NULL;
+}
+
+bool shm_reader_active(void) {
+	return false;
+}
+
+void shm_publish_frame(const capture_frame_t *frame) {
+}
+
+#define BENCH_RECORD_BYTES (577 * 1024) // About the size of a 1024x768 display of noise as a PNG
+#define BENCH_FRAME_MSEC   33
+#define BENCH_BACKENDS     3
+
+static const char *bench_backends[BENCH_BACKENDS] = { "socket", "io_uring", "io_uring no zc" };
+
+static double bench_thread_usec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+// Connect count sockets to ourselves, with the server ends set up like the plugin does for a new client
+static bool bench_connect(int count, std::vector<SOCKET> &servers, std::vector<SOCKET> &readers) {
+	SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if ((bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listener, count) != 0) ||
+		(getsockname(listener, (struct sockaddr *)&addr, &addr_len) != 0)) {
+		printf("Could not listen on loopback: %d\n", errno);
+		closesocket(listener);
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		SOCKET reader = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(reader, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			printf("Could not connect to loopback: %d\n", errno);
+			closesocket(reader);
+			break;
+		}
+		SOCKET server = accept(listener, NULL, NULL);
+		int send_buffer = TCP_SEND_BUFFER;
+		setsockopt(server, SOL_SOCKET, SO_SNDBUF, (char *)&send_buffer, sizeof(send_buffer));
+		u_long non_block = 1;
+		ioctlsocket(server, FIONBIO, &non_block);
+#if APL
+		int no_sigpipe = 1;
+		setsockopt(server, SOL_SOCKET, SO_NOSIGPIPE, (char *)&no_sigpipe, sizeof(no_sigpipe));
+#endif
+		readers.push_back(reader);
+		servers.push_back(server);
+	}
+	closesocket(listener);
+	return (int)servers.size() == count;
+}
+
+// Read and throw away everything that arrives until told to stop, returns the number of bytes
+static void bench_drain(std::vector<SOCKET> readers, std::atomic<bool> *stop, size_t *received) {
+	std::vector<struct pollfd> fds(readers.size());
+	std::vector<char> buffer(1024 * 1024);
+	for (size_t i = 0; i < readers.size(); i++) {
+		fds[i].fd = readers[i];
+		fds[i].events = POLLIN;
+	}
+	while (!*stop) {
+		if (poll(fds.data(), (unsigned long)fds.size(), 100) <= 0)
+			continue;
+		for (auto &fd : fds) {
+			if (!(fd.revents & POLLIN))
+				continue;
+			ssize_t bytes = recv(fd.fd, buffer.data(), buffer.size(), 0);
+			if (bytes > 0)
+				*received += bytes;
+		}
+	}
+}
+
+// Send to count clients for the given number of seconds, and return the CPU time per frame in microseconds
+static double bench_run(int count, int seconds, size_t &received) {
+	std::vector<SOCKET> servers, readers;
+	received = 0;
+	if (!bench_connect(count, servers, readers))
+		return -1;
+	std::list<network_client_t> clients;
+	std::vector<network_client_t *> all;
+	for (auto sock : servers) {
+		clients.emplace_back();
+		clients.back().sock = sock;
+		clients.back().v4 = true;
+		all.push_back(&clients.back());
+	}
+	std::atomic<bool> stop(false);
+	std::thread drain(bench_drain, readers, &stop, &received);
+
+	// One new record a frame, which replaces the last one for any client that has not started sending it yet
+	auto payload = std::make_shared<std::vector<unsigned char>>(BENCH_RECORD_BYTES);
+	for (size_t i = 0; i < payload->size(); i++)
+		(*payload)[i] = (unsigned char)(i * 2654435761u >> 24);
+	capture_frame_t frame;
+	frame.count = 1;
+	frame.sequence = 0;
+	frame.capture_usec = capture_time_usec();
+	double cpu = 0;
+	int frames = 0;
+	auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+	auto next = std::chrono::steady_clock::now();
+	std::vector<struct pollfd> fds(servers.size());
+	while (std::chrono::steady_clock::now() < end) {
+		network_record_t record;
+		frame.sequence++;
+		make_record_v4(record, 0, XTEV4_CODEC_PNG, &frame, payload, 0);
+		double start = bench_thread_usec();
+		for (auto c : all)
+			network_queue_client(*c, record);
+		network_flush_clients(all);
+		cpu += bench_thread_usec() - start;
+		frames++;
+
+		// Keep sending whatever is left as the sockets empty out until the next frame, like poll() does in the plugin
+		next += std::chrono::milliseconds(BENCH_FRAME_MSEC);
+		while (true) {
+			int wait = (int)std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+			if (wait <= 0)
+				break;
+			std::vector<network_client_t *> writable;
+			for (size_t i = 0; i < servers.size(); i++) {
+				fds[i].fd = servers[i];
+				fds[i].events = POLLOUT;
+				fds[i].revents = 0;
+			}
+			if (poll(fds.data(), (unsigned long)fds.size(), wait) <= 0)
+				continue;
+			size_t i = 0;
+			for (auto c : all)
+				if ((fds[i++].revents & POLLOUT) && ((c->sending.size() > 0) || !c->queue.empty()))
+					writable.push_back(c);
+			if (writable.empty()) {
+				std::this_thread::sleep_until(next);
+				break;
+			}
+			start = bench_thread_usec();
+			network_flush_clients(writable);
+			cpu += bench_thread_usec() - start;
+		}
+	}
+
+	stop = true;
+	drain.join();
+	for (auto c : all)
+		if (c->sock != INVALID_SOCKET)
+			closesocket(c->sock);
+	for (auto sock : readers)
+		closesocket(sock);
+	return cpu / frames;
+}
+
+int main(int argc, char **argv) {
+	int seconds = (argc > 1) ? atoi(argv[1]) : 10;
+	const int client_counts[] = { 1, 8, 32 };
+	printf("CPU time per frame on the network thread to send a %d KB record to each client\n", BENCH_RECORD_BYTES / 1024);
+	printf("%7s", "clients");
+	for (int b = 0; b < BENCH_BACKENDS; b++)
+		printf(" %19s", bench_backends[b]);
+	printf("\n");
+	for (int count : client_counts) {
+		printf("%7d", count);
+		for (int b = 0; b < BENCH_BACKENDS; b++) {
+			double usec = -1;
+			size_t received = 0;
+#if NETWORK_IO_URING
+			// A fresh ring for each run, since sends left over from the last one point at clients that are gone
+			config_send_backend = (b == 0) ? NETWORK_SEND_SOCKET : NETWORK_SEND_IO_URING;
+			network_uring_update();
+			if ((b == 2) && (network_uring.fd >= 0))
+				network_uring.zerocopy = false;
+			if ((b == 0) || (network_uring.fd >= 0))
+				usec = bench_run(count, seconds, received);
+			network_uring_close();
+			network_uring.config = -1;
+#else
+			if (b == 0)
+				usec = bench_run(count, seconds, received);
+#endif
+			if (usec < 0)
+				printf(" %19s", "-");
+			else
+				printf(" %8.0f us %3zuMB/s", usec, received / seconds / (1024 * 1024));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -28,10 +28,17 @@ import java.awt.*;
 import java.awt.event.MouseAdapter;
 import java.awt.event.MouseEvent;
 import java.awt.image.BufferedImage;
+import java.awt.image.DataBufferInt;
 import java.io.*;
+import java.net.DatagramPacket;
+import java.net.InetAddress;
+import java.net.MulticastSocket;
 import java.net.Socket;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.util.ArrayList;
 import java.util.Arrays;
+import java.util.List;
 import java.util.ListIterator;
 
 public class XTextureExtractor extends JFrame {
@@ -39,6 +46,18 @@ public class XTextureExtractor extends JFrame {
     static final int TCP_PORT = 52500;
     static final int TCP_INTRO_HEADER = 4096;
     static final String TCP_PLUGIN_VERSION = "XTEv3";
+    static final String TCP_DELTA_PROTOCOL = "XTEv3-delta";
+    static final String TCP_V4_PROTOCOL = "XTEv4";
+    static final String TCP_V4_DELTA_PROTOCOL = "XTEv4-delta";
+    static final int XTEV4_CODEC_PNG = 0;
+    static final int XTEV4_CODEC_TILES = 1;
+    static final int XTEV4_CODEC_PNG_SCALED = 2;
+    static final int XTEV4_CODEC_HEADER = 3;
+    static final int XTEV4_CODEC_QOI = 4;
+    static final int XTEV4_CODEC_JPEG = 5;
+    static final int XTEV4_STREAM_ID = 0xFF;
+    static final String TCP_HEADERS_COMMAND = "HEADERS";
+    static final int MULTICAST_HEADER = 20;
 
     public JLabel mLabel;
     public JFrame mFrame;
@@ -46,13 +65,35 @@ public class XTextureExtractor extends JFrame {
     static public int screenNumber = 0;
     static public boolean windowFullscreen = false;
     static public boolean windowGeometry = false;
+    static public boolean deltaAllowed = true;
+    static public boolean multicastAllowed = false;
+    static public boolean qoiAllowed = false;
+    static public boolean jpegAllowed = false;
     static public int windowGeometryX, windowGeometryY, windowGeometryW, windowGeometryH;
     String windowAircraft;
     Boolean windowPacked = false;
     ArrayList<String> windowNames = new ArrayList<String>();
 
-    byte[] newPngData = null;
-    Object newPngDataSync = new Object();
+    BufferedImage newImage = null;
+    Object newImageSync = new Object();
+
+    // With the delta protocol the server only sends the tiles that changed, so keep a copy of the window to apply them to
+    OutputStream outputStream = null;
+    boolean deltaProtocol = false;
+    BufferedImage deltaImage = null;
+    int deltaWindow = -1;
+    boolean keyframeRequested = false;
+
+    // XTEv4 records have no padding, and start once the server sends an XTEv4 record in the old framing
+    boolean v4Requested = false;
+    boolean v4Framing = false;
+
+    // XTEv4 plugins shrink the window to the size it is shown at, so it does not have to be scaled down here every frame
+    int sizeWindow = -1, sizeWidth = 0, sizeHeight = 0;
+
+    // Set from the header when using multicast, the TCP connection is then only used for commands
+    String multicastGroup = null;
+    int multicastPort = 0;
 
     public XTextureExtractor(String hostname) {
         mFrame = this;
@@ -95,6 +136,8 @@ public class XTextureExtractor extends JFrame {
                     windowActive = 0;
                 windowPacked = false;
                 System.err.println("Detected window click, adjusted to " + windowActive);
+                if (outputStream != null)
+                    sendCommand("SUBSCRIBE " + windowActive);
             }
         });
 
@@ -114,61 +157,402 @@ public class XTextureExtractor extends JFrame {
     }
 
     public void displayLoop(JLabel label) {
-        synchronized(newPngDataSync) {
-            while(true) {
+        while(true) {
+            BufferedImage _image;
+            synchronized(newImageSync) {
                 try {
-                    while(newPngData == null)
-                        newPngDataSync.wait();
+                    while(newImage == null)
+                        newImageSync.wait();
                 } catch (InterruptedException e) {
                     System.err.println("wait() call failed - " + e);
                     System.exit(1);
                 }
+                _image = newImage;
+                newImage = null;
+            }
 
-                ByteArrayInputStream byteArrayInputStream = new ByteArrayInputStream(newPngData);
-
-                // Read the raw PNG data and put it in the window if it is a match
-                BufferedImage _image = null;
-                try {
-                    _image = ImageIO.read(byteArrayInputStream);
-                } catch (IOException e) {
-                    System.err.println("Failed to decode image - " + e);
-                    System.exit(1);
+            int iw = _image.getWidth();
+            int ih = _image.getHeight();
+            Image image = _image;
+
+            // System.err.println("Storing image " + windowId);
+
+            // If the window has been laid out once, then resize the image to fit this
+            if (windowPacked || windowFullscreen || windowGeometry) {
+                int lw = label.getWidth();
+                int lh = label.getHeight();
+                if ((lw <= 1) || (lh <= 1)) {
+                    lw = iw;
+                    lh = ih;
+                    System.err.println("Fixing up empty image to size " + lw + "x" + lh);
+                } else if (v4Requested && (multicastGroup == null) && ((sizeWindow != windowActive) || (sizeWidth != lw) || (sizeHeight != lh))) {
+                    sizeWindow = windowActive;
+                    sizeWidth = lw;
+                    sizeHeight = lh;
+                    sendCommand("SIZE " + sizeWindow + " " + sizeWidth + " " + sizeHeight);
                 }
-                int iw = _image.getWidth();
-                int ih = _image.getHeight();
-                Image image = _image;
-
-                // System.err.println("Storing image " + windowId);
-
-                // If the window has been laid out once, then resize the image to fit this
-                if (windowPacked || windowFullscreen || windowGeometry) {
-                    int lw = label.getWidth();
-                    int lh = label.getHeight();
-                    if ((lw <= 1) || (lh <= 1)) {
-                        lw = iw;
-                        lh = ih;
-                        System.err.println("Fixing up empty image to size " + lw + "x" + lh);
-                    }
+                if ((iw != lw) || (ih != lh))
                     image = image.getScaledInstance(lw, lh, Image.SCALE_SMOOTH);
+            }
+
+            // Store the image into an icon for display
+            ImageIcon ic = new ImageIcon(image);
+            label.setIcon(ic);
+
+            // If the window has a new image then pack it to do layout
+            if (!windowPacked && !windowFullscreen && !windowGeometry) {
+                mFrame.setTitle("XTextureExtractor: " + windowAircraft + " " + windowNames.get(windowActive));
+                mFrame.pack();
+                windowPacked = true;
+            }
+        }
+    }
+
+    public BufferedImage decodePng(byte[] data, int offset) throws IOException {
+        BufferedImage image = ImageIO.read(new ByteArrayInputStream(data, offset, data.length - offset));
+        if (image == null)
+            throw new IOException("Invalid PNG data");
+        return image;
+    }
+
+    // QOI images from https://qoiformat.org, which the plugin sends instead of PNG with --qoi. They are bigger, but take
+    // much less CPU to compress and decode, so are better on a wired network. The plugin always sends 3 channels.
+    public static BufferedImage decodeQoi(byte[] data) throws IOException {
+        ByteBuffer header = ByteBuffer.wrap(data);
+        if ((data.length < 22) || (header.getInt(0) != 0x716F6966)) // "qoif"
+            throw new IOException("Invalid QOI data");
+        int width = header.getInt(4);
+        int height = header.getInt(8);
+        if ((width <= 0) || (height <= 0) || ((long)width * height > 64 * 1024 * 1024))
+            throw new IOException("Invalid QOI size " + width + "x" + height);
+        BufferedImage image = new BufferedImage(width, height, BufferedImage.TYPE_INT_RGB);
+        int[] pixels = ((DataBufferInt)image.getRaster().getDataBuffer()).getData();
+        int[] index = new int[64];
+        int r = 0, g = 0, b = 0, a = 255;
+        int pos = 14;
+        int end = data.length - 8;
+        int out = 0;
+        try {
+            while (out < pixels.length) {
+                int run = 1;
+                int op = data[pos++] & 0xFF;
+                if (op == 0xFE) {
+                    r = data[pos++] & 0xFF;
+                    g = data[pos++] & 0xFF;
+                    b = data[pos++] & 0xFF;
+                } else if (op == 0xFF) {
+                    r = data[pos++] & 0xFF;
+                    g = data[pos++] & 0xFF;
+                    b = data[pos++] & 0xFF;
+                    a = data[pos++] & 0xFF;
+                } else if ((op & 0xC0) == 0x00) {
+                    int px = index[op];
+                    r = (px >> 16) & 0xFF;
+                    g = (px >> 8) & 0xFF;
+                    b = px & 0xFF;
+                    a = px >>> 24;
+                } else if ((op & 0xC0) == 0x40) {
+                    r = (r + ((op >> 4) & 3) - 2) & 0xFF;
+                    g = (g + ((op >> 2) & 3) - 2) & 0xFF;
+                    b = (b + (op & 3) - 2) & 0xFF;
+                } else if ((op & 0xC0) == 0x80) {
+                    int dg = (op & 0x3F) - 32;
+                    int rb = data[pos++] & 0xFF;
+                    r = (r + dg + (rb >> 4) - 8) & 0xFF;
+                    g = (g + dg) & 0xFF;
+                    b = (b + dg + (rb & 0x0F) - 8) & 0xFF;
+                } else {
+                    run = (op & 0x3F) + 1;
                 }
+                if (pos > end)
+                    throw new IOException("Truncated QOI data");
+                int px = (a << 24) | (r << 16) | (g << 8) | b;
+                index[(r * 3 + g * 5 + b * 7 + a * 11) & 63] = px;
+                for (; (run > 0) && (out < pixels.length); run--)
+                    pixels[out++] = px;
+            }
+        } catch (ArrayIndexOutOfBoundsException e) {
+            throw new IOException("Truncated QOI data");
+        }
+        return image;
+    }
 
-                // Store the image into an icon for display
-                ImageIcon ic = new ImageIcon(image);
-                label.setIcon(ic);
+    // The plugin sends smaller images when the network cannot keep up or the window is shown smaller. Once the window is
+    // laid out the display loop scales them to fit, but before that they are stretched back so it is packed at full size
+    public BufferedImage decodeImage(byte[] data, int fullWidth, int fullHeight) throws IOException {
+        boolean qoi = (data.length >= 4) && (data[0] == 'q') && (data[1] == 'o') && (data[2] == 'i') && (data[3] == 'f');
+        BufferedImage image = qoi ? decodeQoi(data) : decodePng(data, 0);
+        if ((fullWidth <= 0) || (fullHeight <= 0) || ((image.getWidth() == fullWidth) && (image.getHeight() == fullHeight)))
+            return image;
+        if (windowPacked || windowFullscreen || windowGeometry)
+            return image;
+        BufferedImage full = new BufferedImage(fullWidth, fullHeight, BufferedImage.TYPE_INT_RGB);
+        Graphics2D g = full.createGraphics();
+        g.setRenderingHint(RenderingHints.KEY_INTERPOLATION, RenderingHints.VALUE_INTERPOLATION_BILINEAR);
+        g.drawImage(image, 0, 0, fullWidth, fullHeight, null);
+        g.dispose();
+        return full;
+    }
+
+    public void showImage(BufferedImage image) {
+        // Pass the image over to the display thread, replacing any it has not got to yet
+        synchronized(newImageSync) {
+            newImage = image;
+            newImageSync.notify();
+        }
+    }
+
+    // Commands are sent from both the network and the UI threads
+    public synchronized void sendCommand(String command) {
+        try {
+            outputStream.write((command + "\n").getBytes());
+            outputStream.flush();
+        } catch (IOException e) {
+            System.err.println("Failed to send command [" + command + "] - " + e);
+            System.exit(1);
+        }
+    }
+
+    // Delta data is a list of 2 byte tile x,y pairs, followed by a PNG with each tile stacked vertically in the same order
+    public void applyTiles(BufferedImage image, byte[] data, int tileSize, int tileCount) throws IOException {
+        BufferedImage tiles = decodePng(data, tileCount * 4);
+        Graphics2D g = image.createGraphics();
+        for (int t = 0; t < tileCount; t++) {
+            int tx = (data[t * 4] & 0xFF) + (data[t * 4 + 1] & 0xFF) * 256;
+            int ty = (data[t * 4 + 2] & 0xFF) + (data[t * 4 + 3] & 0xFF) * 256;
+            int x = tx * tileSize;
+            int y = ty * tileSize;
+            // Tiles on the right and bottom edges are clipped by the image
+            g.drawImage(tiles, x, y, x + tileSize, y + tileSize, 0, t * tileSize, tileSize, (t + 1) * tileSize, null);
+        }
+        g.dispose();
+    }
+
+    public BufferedImage copyImage(BufferedImage image) {
+        BufferedImage copy = new BufferedImage(image.getWidth(), image.getHeight(), BufferedImage.TYPE_INT_RGB);
+        Graphics2D g = copy.createGraphics();
+        g.drawImage(image, 0, 0, null);
+        g.dispose();
+        return copy;
+    }
+
+    // Unsigned LEB128 varints used by the XTEv4 framing
+    public static long readVarint(DataInputStream in) throws IOException {
+        long value = 0;
+        for (int shift = 0; ; shift += 7) {
+            int b = in.readUnsignedByte();
+            value |= (long)(b & 0x7F) << shift;
+            if (b < 0x80)
+                return value;
+        }
+    }
+
+    public static long readVarint(byte[] data, int[] pos) {
+        long value = 0;
+        for (int shift = 0; ; shift += 7) {
+            int b = data[pos[0]++] & 0xFF;
+            value |= (long)(b & 0x7F) << shift;
+            if (b < 0x80)
+                return value;
+        }
+    }
+
+    // One XTEv4 record, after the length: window id, codec, frame sequence, capture time, then any codec fields
+    static class RecordV4 {
+        int windowId;
+        boolean isDelta = false;
+        int tileSize = 0;
+        int tileCount = 0;
+        int fullWidth = 0;
+        int fullHeight = 0;
+        boolean isHeader = false;
+        byte[] payload;
+
+        RecordV4(byte[] record, int offset) {
+            int[] pos = { offset + 2 };
+            windowId = record[offset] & 0xFF;
+            int codec = record[offset + 1] & 0xFF;
+            readVarint(record, pos); // Frame sequence
+            readVarint(record, pos); // Capture time in microseconds
+            if (codec == XTEV4_CODEC_TILES) {
+                isDelta = true;
+                tileSize = (int)readVarint(record, pos);
+                tileCount = (int)readVarint(record, pos);
+            } else if ((codec == XTEV4_CODEC_PNG_SCALED) || (codec == XTEV4_CODEC_JPEG)) {
+                fullWidth = (int)readVarint(record, pos);
+                fullHeight = (int)readVarint(record, pos);
+            } else if ((codec == XTEV4_CODEC_HEADER) && (windowId == XTEV4_STREAM_ID)) {
+                isHeader = true;
+            } else if ((codec != XTEV4_CODEC_PNG) && (codec != XTEV4_CODEC_QOI)) {
+                windowId = -1; // Unknown codec, so skip it
+            }
+            payload = Arrays.copyOfRange(record, pos[0], record.length);
+        }
+    }
 
-                // If the window has a new image then pack it to do layout
-                if (!windowPacked && !windowFullscreen && !windowGeometry) {
-                    mFrame.setTitle("XTextureExtractor: " + windowAircraft + " " + windowNames.get(windowActive));
-                    mFrame.pack();
-                    windowPacked = true;
+    // Every record for the active window has to be applied in order, since each delta builds on the previous one
+    public void applyDeltaRecord(boolean isDelta, byte[] data, int tileSize, int tileCount, int fullWidth, int fullHeight) throws IOException {
+        if (deltaWindow != windowActive) {
+            // Switched windows, so the deltas cannot be applied until a whole image arrives
+            deltaImage = null;
+            deltaWindow = windowActive;
+            keyframeRequested = false;
+        }
+        if (!isDelta) {
+            deltaImage = copyImage(decodeImage(data, fullWidth, fullHeight));
+            keyframeRequested = false;
+        } else if (deltaImage != null) {
+            applyTiles(deltaImage, data, tileSize, tileCount);
+        } else if (!keyframeRequested) {
+            sendCommand("KEYFRAME");
+            keyframeRequested = true;
+        }
+        if (deltaImage != null)
+            showImage(copyImage(deltaImage));
+    }
+
+    // The plugin splits each XTEv4-delta record into datagrams with a parity chunk for every few data chunks, see
+    // network_multicast_record() in XTextureExtractorNetwork.cpp. A record is used as soon as it can be put back
+    // together, and if one never can be the deltas stop until a keyframe arrives. The TCP connection is still
+    // needed for commands, and closes if the aircraft changes.
+    public void multicastLoop(String group, int port, DataInputStream tcpStream) {
+        new Thread(new Runnable() {
+            @Override
+            public void run() {
+                try {
+                    while (tcpStream.read() >= 0) { }
+                } catch (IOException e) { }
+                System.err.println("Control connection closed");
+                System.exit(1);
+            }
+        }).start();
+
+        try {
+            MulticastSocket socket = new MulticastSocket(port);
+            socket.setReceiveBufferSize(4 * 1024 * 1024);
+            socket.joinGroup(InetAddress.getByName(group));
+            System.err.println("Joined multicast group " + group + " port " + port);
+            byte[] buffer = new byte[65536];
+            DatagramPacket packet = new DatagramPacket(buffer, buffer.length);
+            long recordId = -1;      // Record being put back together
+            boolean complete = true;
+            byte[][] chunks = null;
+            while (true) {
+                socket.receive(packet);
+                ByteBuffer header = ByteBuffer.wrap(buffer, 0, packet.getLength()).order(ByteOrder.LITTLE_ENDIAN);
+                if ((packet.getLength() < MULTICAST_HEADER) || (buffer[0] != 'X') || (buffer[1] != 'T') || (buffer[2] != 'E') || (buffer[3] != 'M'))
+                    continue;
+                long id = header.getInt(4) & 0xFFFFFFFFL;
+                int length = header.getInt(8);
+                int index = header.getShort(12) & 0xFFFF;
+                int count = header.getShort(14) & 0xFFFF;
+                int windowId = buffer[16] & 0xFF;
+                int parity = buffer[17] & 0xFF;
+                if (id < recordId)
+                    continue; // Arrived late, the record has already been given up on
+                if (id != recordId) {
+                    if (!complete || ((recordId >= 0) && (id != recordId + 1))) {
+                        // Lost a record, which could have been a delta for the active window
+                        System.err.println("Lost multicast record before " + id);
+                        deltaImage = null;
+                    }
+                    recordId = id;
+                    complete = (windowId != windowActive); // Nothing to put together for the other windows
+                    chunks = new byte[count + ((parity > 0) ? (count + parity - 1) / parity : 0)][];
+                }
+                if (complete || (index >= chunks.length))
+                    continue;
+                chunks[index] = Arrays.copyOfRange(buffer, MULTICAST_HEADER, packet.getLength());
+
+                // Rebuild a missing data chunk from its parity chunk and the rest of its group
+                for (int g = 0; (parity > 0) && (g < chunks.length - count); g++) {
+                    int first = g * parity;
+                    int last = Math.min(count, first + parity);
+                    int missing = -1, missingCount = 0;
+                    for (int c = first; c < last; c++)
+                        if (chunks[c] == null) {
+                            missing = c;
+                            missingCount++;
+                        }
+                    if ((missingCount != 1) || (chunks[count + g] == null))
+                        continue;
+                    byte[] rebuilt = chunks[count + g].clone();
+                    for (int c = first; c < last; c++)
+                        if (c != missing)
+                            for (int b = 0; b < chunks[c].length; b++)
+                                rebuilt[b] ^= chunks[c][b];
+                    int size = Math.min(rebuilt.length, length - missing * rebuilt.length);
+                    chunks[missing] = Arrays.copyOf(rebuilt, size);
                 }
 
-                // Now that the image is displayed, we can prepare to accept another
-                newPngData = null;
+                boolean ready = true;
+                for (int c = 0; c < count; c++)
+                    if (chunks[c] == null)
+                        ready = false;
+                if (!ready)
+                    continue;
+                byte[] record = new byte[length];
+                int offset = 0;
+                for (int c = 0; c < count; c++) {
+                    System.arraycopy(chunks[c], 0, record, offset, chunks[c].length);
+                    offset += chunks[c].length;
+                }
+                complete = true;
+
+                // Skip over the varint length, the record is always complete
+                int[] pos = { 0 };
+                readVarint(record, pos);
+                RecordV4 r = new RecordV4(record, pos[0]);
+                if (r.windowId == windowActive)
+                    applyDeltaRecord(r.isDelta, r.payload, r.tileSize, r.tileCount, r.fullWidth, r.fullHeight);
             }
+        } catch (IOException e) {
+            System.err.println("Multicast receive failed - " + e);
+            System.exit(1);
         }
     }
 
+    // Reads the plugin version, aircraft and texture, then the window list up to __EOF__, and returns the version
+    public String readHeaderWindows(BufferedReader bufferedReader) throws IOException {
+        String version = bufferedReader.readLine().split(" ")[0];
+        windowAircraft = bufferedReader.readLine();
+        String[] texture = bufferedReader.readLine().split(" ");
+        int textureWidth = Integer.parseInt(texture[0]);
+        int textureHeight = Integer.parseInt(texture[1]);
+        System.err.println("Plugin version [" + version + "], aircraft [" + windowAircraft + "], texture " + textureWidth + "x" + textureHeight);
+        windowNames.clear();
+        while (true) {
+            String line = bufferedReader.readLine();
+            if (line == null || line.contains("__EOF__"))
+                break;
+            String[] window = line.split(" ");
+            String name = window[0];
+            windowNames.add(name);
+            int l = Integer.parseInt(window[1]);
+            int t = Integer.parseInt(window[2]);
+            int r = Integer.parseInt(window[3]);
+            int b = Integer.parseInt(window[4]);
+            System.err.println("Window [" + name + "] = (" + l + "," + t + ")->(" + r + "," + b + ")");
+        }
+        return version;
+    }
+
+    // Newer plugins send the header again on the same connection when the aircraft changes, instead of closing it
+    public void headerUpdate(byte[] header) throws IOException {
+        System.err.println("Received header update");
+        String version = readHeaderWindows(new BufferedReader(new InputStreamReader(new ByteArrayInputStream(header))));
+        if (!version.equals(TCP_PLUGIN_VERSION) || (windowNames.size() <= 0))
+            throw new IOException("Invalid header update for version [" + version + "] with " + windowNames.size() + " windows");
+        if (windowActive >= windowNames.size())
+            windowActive = 0;
+        // Everything after the header starts again with keyframes of the new windows
+        deltaImage = null;
+        deltaWindow = -1;
+        windowPacked = false;
+        sizeWindow = -1;
+        sendCommand("SUBSCRIBE " + windowActive);
+    }
+
     public void networkLoop(String hostname) {
         Boolean cancelled = false;
 
@@ -177,6 +561,7 @@ public class XTextureExtractor extends JFrame {
         try {
             Socket socket = new Socket(hostname, TCP_PORT);
             dataInputStream = new DataInputStream(socket.getInputStream());
+            outputStream = socket.getOutputStream();
         } catch (IOException e) {
             System.err.println("Failed to make connection - " + e);
             System.exit(1);
@@ -195,26 +580,36 @@ public class XTextureExtractor extends JFrame {
                 System.err.println("Received raw header [" + headerStr + "] before PNG stream");
                 try {
                     BufferedReader bufferedReader = new BufferedReader(new InputStreamReader(new ByteArrayInputStream(header)));
-                    String version = bufferedReader.readLine().split(" ")[0];
-                    windowAircraft = bufferedReader.readLine();
-                    String[] texture = bufferedReader.readLine().split(" ");
-                    int textureWidth = Integer.parseInt(texture[0]);
-                    int textureHeight = Integer.parseInt(texture[1]);
-                    System.err.println("Plugin version [" + version + "], aircraft [" + windowAircraft + "], texture " + textureWidth + "x" + textureHeight);
-                    String line = null;
-                    windowNames.clear();
-                    while (true) {
-                        line = bufferedReader.readLine();
-                        if (line == null || line.contains("__EOF__"))
-                            break;
-                        String[] window = line.split(" ");
-                        String name = window[0];
-                        windowNames.add(name);
-                        int l = Integer.parseInt(window[1]);
-                        int t = Integer.parseInt(window[2]);
-                        int r = Integer.parseInt(window[3]);
-                        int b = Integer.parseInt(window[4]);
-                        System.err.println("Window [" + name + "] = (" + l + "," + t + ")->(" + r + "," + b + ")");
+                    String version = readHeaderWindows(bufferedReader);
+                    // Newer plugins list the protocols they support after __EOF__, pick the best one we can use
+                    String line = bufferedReader.readLine();
+                    List<String> protocols = ((line != null) && line.startsWith("PROTOCOLS ")) ? Arrays.asList(line.split(" ")) : new ArrayList<String>();
+                    line = bufferedReader.readLine();
+                    if (multicastAllowed && (line != null) && line.startsWith("MULTICAST ")) {
+                        // The group is always sent deltas, so this overrides --nodelta
+                        String[] multicast = line.split(" ");
+                        multicastGroup = multicast[1];
+                        multicastPort = Integer.parseInt(multicast[2]);
+                        protocols = new ArrayList<String>(); // Windows come from the group instead
+                    } else if (multicastAllowed) {
+                        System.err.println("Plugin does not have multicast turned on, using TCP instead");
+                    }
+                    String protocol = null;
+                    if (deltaAllowed && protocols.contains(TCP_V4_DELTA_PROTOCOL))
+                        protocol = TCP_V4_DELTA_PROTOCOL;
+                    else if (protocols.contains(TCP_V4_PROTOCOL))
+                        protocol = TCP_V4_PROTOCOL;
+                    else if (deltaAllowed && protocols.contains(TCP_DELTA_PROTOCOL))
+                        protocol = TCP_DELTA_PROTOCOL;
+                    if (protocol != null) {
+                        System.err.println("Requesting protocol " + protocol);
+                        sendCommand("PROTOCOL " + protocol);
+                        deltaProtocol = protocol.endsWith("-delta");
+                        v4Requested = protocol.startsWith(TCP_V4_PROTOCOL);
+                        if (v4Requested)
+                            sendCommand("CODECS PNG TILES SCALED" + (qoiAllowed ? " QOI" : "") + (jpegAllowed ? " JPEG" : ""));
+                        else if (jpegAllowed)
+                            sendCommand("CODECS JPEG");
                     }
                     if (!version.equals(TCP_PLUGIN_VERSION)) {
                         System.err.println("Version [" + version + "] is not expected [" + TCP_PLUGIN_VERSION + "]");
@@ -230,6 +625,15 @@ public class XTextureExtractor extends JFrame {
                         System.err.println("Manual window id " + windowActive + " is out of bounds " + windowNames.size() + " so setting to 0");
                         windowActive = 0;
                     }
+                    // Only the active window is shown, so ask for just that one. Older plugins ignore this and send everything
+                    if (multicastGroup != null) {
+                        sendCommand("MULTICAST");
+                        deltaProtocol = true;
+                    } else {
+                        // Keep the connection open when the aircraft changes, older plugins ignore this and still disconnect
+                        sendCommand(TCP_HEADERS_COMMAND);
+                    }
+                    sendCommand("SUBSCRIBE " + windowActive);
                 } catch (IOException e) {
                     System.err.println("IOException invalid header data - " + e);
                     System.exit(1);
@@ -243,40 +647,96 @@ public class XTextureExtractor extends JFrame {
             }
         }
 
+        if (!cancelled && (multicastGroup != null)) {
+            multicastLoop(multicastGroup, multicastPort, dataInputStream);
+            return;
+        }
+
         while (!cancelled) {
             // Each window transmission starts with !_____X_ where X is a binary byte 0x00 to 0xFF
+            // Changed tiles with the delta protocol start with !DELTAX_ instead
             int windowId = -1;
             int expectedBytes = -1;
+            boolean isDelta = false;
+            int tileSize = 0;
+            int tileCount = 0;
+            int fullWidth = 0;
+            int fullHeight = 0;
+            byte[] payload = null; // XTEv4 reads the whole record up front
             try {
-                // We sometimes end up with PNG data, run a sliding window until we find the next header
-                char a = (char)dataInputStream.readByte();
-                char b = (char)dataInputStream.readByte();
-                char c = (char)dataInputStream.readByte();
-                char d = (char)dataInputStream.readByte();
-                char e = (char)dataInputStream.readByte();
-                char f = (char)dataInputStream.readByte();
-                char g = (char)dataInputStream.readByte();
-                char h = (char)dataInputStream.readByte();
-                if ((a != '!') || (b != '_') || (c != '_') || (d != '_') || (e != '_') || (f != '_') || (h != '_')) {
-                    System.err.println("Image header invalid ![" + a + "] _[" + b + "] _[" + c + "] _[" + d + "] _[" + e + "] _[" + f + "] W[" + windowId + "] _[" + h + "]");
-                    System.exit(1);
-                }
-                windowId = (int) g;
-
-                // Read the number of upcoming PNG bytes
-                int b0 = (int)(dataInputStream.readByte()) & 0xFF;
-                int b1 = (int)(dataInputStream.readByte()) & 0xFF;
-                int b2 = (int)(dataInputStream.readByte()) & 0xFF;
-                int b3 = (int)(dataInputStream.readByte()) & 0xFF;
-                expectedBytes = (((((b3 * 256) + b2) * 256) + b1) * 256) + b0;
-
-                char w = (char)dataInputStream.readByte();
-                char x = (char)dataInputStream.readByte();
-                char y = (char)dataInputStream.readByte();
-                char z = (char)dataInputStream.readByte();
-                if ((w != '_') || (x != '_') || (y != '_') || (z != '_')) {
-                    System.err.println("Image second header invalid _[" + w + "] _[" + x + "] _[" + y + "] _[" + z + "]");
-                    System.exit(1);
+                if (v4Framing) {
+                    // Length of the rest of the record, followed by the record itself
+                    int length = (int)readVarint(dataInputStream);
+                    byte[] record = new byte[length];
+                    dataInputStream.readFully(record);
+                    RecordV4 r = new RecordV4(record, 0);
+                    if (r.isHeader) {
+                        headerUpdate(r.payload);
+                        continue;
+                    }
+                    windowId = r.windowId;
+                    isDelta = r.isDelta;
+                    tileSize = r.tileSize;
+                    tileCount = r.tileCount;
+                    fullWidth = r.fullWidth;
+                    fullHeight = r.fullHeight;
+                    payload = r.payload;
+                    expectedBytes = payload.length;
+                } else {
+                    // We sometimes end up with PNG data, run a sliding window until we find the next header
+                    char a = (char)dataInputStream.readByte();
+                    char b = (char)dataInputStream.readByte();
+                    char c = (char)dataInputStream.readByte();
+                    char d = (char)dataInputStream.readByte();
+                    char e = (char)dataInputStream.readByte();
+                    char f = (char)dataInputStream.readByte();
+                    char g = (char)dataInputStream.readByte();
+                    char h = (char)dataInputStream.readByte();
+                    isDelta = deltaProtocol && (b == 'D') && (c == 'E') && (d == 'L') && (e == 'T') && (f == 'A');
+                    if (v4Requested && (a == '!') && (b == 'X') && (c == 'T') && (d == 'E') && (e == 'v') && (f == '4')) {
+                        // Everything after this record uses the XTEv4 framing, skip the rest of it and its padding
+                        int length = Integer.reverseBytes(dataInputStream.readInt());
+                        dataInputStream.skipBytes(4 + length + 1024 - (length % 1024));
+                        v4Framing = true;
+                        continue;
+                    }
+                    if ((a == '!') && (b == 'H') && (c == 'E') && (d == 'A') && (e == 'D') && (f == 'R')) {
+                        // New header after the aircraft changed, padded out like any other record
+                        int length = Integer.reverseBytes(dataInputStream.readInt());
+                        dataInputStream.skipBytes(4);
+                        byte[] data = new byte[length];
+                        dataInputStream.readFully(data);
+                        dataInputStream.skipBytes(1024 - (length % 1024));
+                        headerUpdate(data);
+                        continue;
+                    }
+                    if ((a != '!') || (!isDelta && ((b != '_') || (c != '_') || (d != '_') || (e != '_') || (f != '_'))) || (h != '_')) {
+                        System.err.println("Image header invalid ![" + a + "] _[" + b + "] _[" + c + "] _[" + d + "] _[" + e + "] _[" + f + "] W[" + windowId + "] _[" + h + "]");
+                        System.exit(1);
+                    }
+                    windowId = (int) g;
+
+                    // Read the number of upcoming PNG bytes
+                    int b0 = (int)(dataInputStream.readByte()) & 0xFF;
+                    int b1 = (int)(dataInputStream.readByte()) & 0xFF;
+                    int b2 = (int)(dataInputStream.readByte()) & 0xFF;
+                    int b3 = (int)(dataInputStream.readByte()) & 0xFF;
+                    expectedBytes = (((((b3 * 256) + b2) * 256) + b1) * 256) + b0;
+
+                    if (isDelta) {
+                        // Tile size and number of tiles as 2 byte values
+                        tileSize = dataInputStream.readUnsignedByte() + dataInputStream.readUnsignedByte() * 256;
+                        tileCount = dataInputStream.readUnsignedByte() + dataInputStream.readUnsignedByte() * 256;
+                    } else {
+                        char w = (char)dataInputStream.readByte();
+                        char x = (char)dataInputStream.readByte();
+                        char y = (char)dataInputStream.readByte();
+                        char z = (char)dataInputStream.readByte();
+                        if ((w != '_') || (x != '_') || (y != '_') || (z != '_')) {
+                            System.err.println("Image second header invalid _[" + w + "] _[" + x + "] _[" + y + "] _[" + z + "]");
+                            System.exit(1);
+                        }
+                    }
                 }
             } catch (IOException e) {
                 System.err.println("Failed to receive window header, connection has failed");
@@ -284,29 +744,44 @@ public class XTextureExtractor extends JFrame {
             }
 
             try {
-              if ((windowId != windowActive) || (newPngData != null)) {
-                    // Skip the PNG data if the window is not active or if we are still processing a previous image
-                    dataInputStream.skipBytes(expectedBytes);
+              if (windowId != windowActive) {
+                    // Skip the PNG data if the window is not active
+                    if (payload == null)
+                        dataInputStream.skipBytes(expectedBytes);
+                } else if (!deltaProtocol) {
+                    if (newImage != null) {
+                        // Skip the PNG data if we are still processing a previous image
+                        if (payload == null)
+                            dataInputStream.skipBytes(expectedBytes);
+                    } else {
+                        // Read the expected PNG data into a buffer and decode it for the display thread
+                        byte[] pngData = payload;
+                        if (pngData == null) {
+                            pngData = new byte[expectedBytes];
+                            dataInputStream.readFully(pngData);
+                        }
+                        showImage(decodeImage(pngData, fullWidth, fullHeight));
+                    }
                 } else {
-                    // Read the expected PNG data into a buffer
-                    byte[] pngData = new byte[expectedBytes];
-                    dataInputStream.readFully(pngData);
-
-                    // Pass the PNG data over to the display thread
-                    synchronized(newPngDataSync) {
-                        newPngData = pngData;
-                        newPngDataSync.notify();
+                    // Every record has to be applied in order, since each delta builds on the previous one
+                    byte[] data = payload;
+                    if (data == null) {
+                        data = new byte[expectedBytes];
+                        dataInputStream.readFully(data);
                     }
+                    applyDeltaRecord(isDelta, data, tileSize, tileCount, fullWidth, fullHeight);
                 }
 
-                // Read the ending padding nulls to 1024 bytes
-                try {
-                    int skip = 1024 - (expectedBytes % 1024);
-                    // Log.d(Const.TAG, "Skipping " + skip + " bytes to pad to 1024 bytes");
-                    dataInputStream.skipBytes(skip);
-                } catch (IOException e) {
-                    System.err.println("Failure during padding receive, connection has failed - " + e);
-                    System.exit(1);
+                // Read the ending padding nulls to 1024 bytes, XTEv4 has no padding
+                if (!v4Framing) {
+                    try {
+                        int skip = 1024 - (expectedBytes % 1024);
+                        // Log.d(Const.TAG, "Skipping " + skip + " bytes to pad to 1024 bytes");
+                        dataInputStream.skipBytes(skip);
+                    } catch (IOException e) {
+                        System.err.println("Failure during padding receive, connection has failed - " + e);
+                        System.exit(1);
+                    }
                 }
             } catch (IOException e) {
                 System.err.println("Failed to read and decode image - " + e);
@@ -322,7 +797,7 @@ public class XTextureExtractor extends JFrame {
     public static void usage(String reason) {
         System.err.println("Error: " + reason);
         System.err.println("XTextureExtractor, streams PNGs from port " + TCP_PORT);
-	System.err.println("Usage: <hostname> [--fullscreen] [--windowN] [--geometry=X,Y,W,H] [--screenN]");
+	System.err.println("Usage: <hostname> [--fullscreen] [--windowN] [--geometry=X,Y,W,H] [--screenN] [--nodelta] [--multicast] [--qoi] [--jpeg]");
     }
 
     public static void main(String[] args) {
@@ -353,6 +828,23 @@ public class XTextureExtractor extends JFrame {
                 System.err.println("Decoded manual geometry X=" + windowGeometryX + " Y=" + windowGeometryY + " W=" + windowGeometryW + " H=" + windowGeometryH);
                 windowGeometry = true;
                 iter.remove();
+            } else if (s.equals("--nodelta")) {
+                System.err.println("Disabled the delta protocol");
+                deltaAllowed = false;
+                iter.remove();
+            } else if (s.equals("--qoi")) {
+                System.err.println("Asking for QOI images instead of PNG");
+                qoiAllowed = true;
+                iter.remove();
+            } else if (s.equals("--jpeg")) {
+                // ImageIO decodes these the same as the PNG images
+                System.err.println("Asking for JPEG images of any windows the plugin has a jpeg_quality for");
+                jpegAllowed = true;
+                iter.remove();
+            } else if (s.equals("--multicast")) {
+                System.err.println("Receiving windows by multicast if the plugin has it turned on");
+                multicastAllowed = true;
+                iter.remove();
             } else if (s.startsWith("--screen")) {
                 s = s.substring("--screen".length());
                 screenNumber = Integer.parseInt(s);
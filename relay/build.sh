@@ -0,0 +1,16 @@
+#!/bin/bash
+
+# Builds the relay, which runs the plugin's network code on its own and needs the X-Plane SDK headers but not X-Plane
+cd `dirname $0`
+set -x
+if [ "`uname`" == "Darwin" ]; then
+  clang++ -std=c++17 -O2 -Wno-deprecated-declarations \
+    -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DAPL -DGL_SILENCE_DEPRECATION \
+    -I../SDK/CHeaders/XPLM xte_relay.cpp ../XTextureExtractorNetwork.cpp ../XTextureExtractorEncode.cpp ../XTextureExtractorJpeg.cpp ../shm-reader/xte_shm_reader.cpp xte_qoi.cpp ../lodepng/lodepng.cpp \
+    -o xte_relay
+else
+  g++ -std=c++17 -O2 \
+    -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DLIN \
+    -I../SDK/CHeaders/XPLM xte_relay.cpp ../XTextureExtractorNetwork.cpp ../XTextureExtractorEncode.cpp ../XTextureExtractorJpeg.cpp ../shm-reader/xte_shm_reader.cpp xte_qoi.cpp ../lodepng/lodepng.cpp \
+    -lrt -lpthread -o xte_relay
+fi
@@ -0,0 +1,90 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Follows the specification at https://qoiformat.org/qoi-specification.pdf, checking every read against the end of the data
+
+#include "xte_qoi.h"
+#include <stdint.h>
+#include <string.h>
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE    8
+#define QOI_MAX_PIXELS  (64u * 1024 * 1024) // Bigger than any texture, stops a bad header asking for huge buffers
+
+bool xte_qoi_decode(const unsigned char *data, size_t size, std::vector<unsigned char> &rgba, int &width, int &height) {
+	if ((size < QOI_HEADER_SIZE + QOI_END_SIZE) || memcmp(data, "qoif", 4))
+		return false;
+	uint32_t w = ((uint32_t)data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+	uint32_t h = ((uint32_t)data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+	if ((w == 0) || (h == 0) || (w > QOI_MAX_PIXELS / h) || ((data[12] != 3) && (data[12] != 4)))
+		return false;
+	width = (int)w;
+	height = (int)h;
+	rgba.resize((size_t)w * h * 4);
+
+	unsigned char index[64][4] = {};
+	unsigned char px[4] = { 0, 0, 0, 255 };
+	const unsigned char *in = data + QOI_HEADER_SIZE;
+	const unsigned char *end = data + size - QOI_END_SIZE;
+	unsigned char *out = rgba.data();
+	unsigned char *out_end = out + rgba.size();
+	while (out < out_end) {
+		if (in >= end)
+			return false;
+		int run = 1;
+		unsigned char b = *in++;
+		if (b == 0xFE) {
+			if (end - in < 3)
+				return false;
+			px[0] = in[0];
+			px[1] = in[1];
+			px[2] = in[2];
+			in += 3;
+		} else if (b == 0xFF) {
+			if (end - in < 4)
+				return false;
+			memcpy(px, in, 4);
+			in += 4;
+		} else if ((b & 0xC0) == 0x00) {
+			memcpy(px, index[b], 4);
+		} else if ((b & 0xC0) == 0x40) {
+			px[0] += ((b >> 4) & 3) - 2;
+			px[1] += ((b >> 2) & 3) - 2;
+			px[2] += (b & 3) - 2;
+		} else if ((b & 0xC0) == 0x80) {
+			if (in >= end)
+				return false;
+			int dg = (b & 0x3F) - 32;
+			px[0] += dg + ((*in >> 4) & 0x0F) - 8;
+			px[1] += dg;
+			px[2] += dg + (*in & 0x0F) - 8;
+			in++;
+		} else {
+			run = (b & 0x3F) + 1;
+		}
+		memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) & 63], px, 4);
+		for (; (run > 0) && (out < out_end); run--, out += 4)
+			memcpy(out, px, 4);
+	}
+	return true;
+}
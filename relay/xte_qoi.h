@@ -0,0 +1,36 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Decoder for the QOI images sent as XTEV4_CODEC_QOI, for native clients. It has no dependencies so it can be copied
+// into any other C++ client. The plugin always sends 3 channel images, but 4 channel ones are decoded as well.
+
+#ifndef XTE_QOI_H
+#define XTE_QOI_H
+
+#include <stddef.h>
+#include <vector>
+
+// Decodes to RGBA with the top row first, returns false if the data is not a complete QOI image
+bool xte_qoi_decode(const unsigned char *data, size_t size, std::vector<unsigned char> &rgba, int &width, int &height);
+
+#endif
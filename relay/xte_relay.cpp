@@ -0,0 +1,531 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Relay that takes one stream of the windows from the plugin and serves any number of clients itself, from another
+// computer or from spare cores on the X-Plane one, so X-Plane only ever pays for a single client. It runs the plugin's
+// own network code, which is why the plugin globals are defined here, and clients connect to it exactly like they
+// would to the plugin, with all the same protocols, subscriptions, sizes and rate control.
+//
+// The windows come from either the plugin's shared memory (--shm, same computer only, and the plugin then does no
+// compression at all), or from being an XTEv4-delta client of the plugin and putting the windows back together from
+// the images and tiles, with --qoi asking for whole windows as QOI which costs both ends much less CPU on a wired
+// network. Either way a TCP connection to the plugin carries the header, and any new one when the aircraft changes.
+// Build with build.sh, clients have no way to pick a port so when running on the X-Plane computer set "port" in
+// XTextureExtractor.cfg to something else and point the relay at that.
+
+#include "../XTextureExtractor.h"
+#include "../shm-reader/xte_shm.h"
+#include "../lodepng/lodepng.h"
+#include "xte_qoi.h"
+#include <stdlib.h>
+#include <signal.h>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Everything the network code expects from the rest of the plugin, filled in from the command line and the header
+GLint cockpit_texture_id = 0;
+GLint cockpit_texture_width = 0;
+GLint cockpit_texture_height = 0;
+int cockpit_texture_seq = 0;
+char cockpit_aircraft_name[256] = "";
+char cockpit_aircraft_filename[256] = "";
+int cockpit_window_limit = 0;
+char _g_window_name[COCKPIT_MAX_WINDOWS][256];
+int _g_texture_lbrt[COCKPIT_MAX_WINDOWS][4];
+int config_capture_mode = CAPTURE_MODE_PBO;
+int config_encode_threads = 0;
+int config_keepalive_msec = NETWORK_KEEPALIVE_MSEC;
+int config_keyframe_msec = DELTA_KEYFRAME_MSEC;
+char config_multicast_group[64] = "";
+int config_multicast_port = MULTICAST_PORT;
+int config_multicast_parity = MULTICAST_PARITY;
+int config_shared_memory = false;
+int config_send_backend = NETWORK_SEND_SOCKET;
+int config_latency_msec = NETWORK_LATENCY_MSEC;
+int config_tcp_port = atoi(TCP_PLUGIN_PORT);
+int config_png_preset = PNG_PRESET_BALANCED;
+int config_jpeg_quality = JPEG_QUALITY_OFF;
+int config_jpeg_subsample = true;
+int config_window_count = 0;
+char config_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_window_png_preset[COCKPIT_MAX_WINDOWS];
+int config_window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+
+void XPLMDebugString(const char *s) {
+	fputs(s, stderr);
+}
+
+uint64_t capture_time_usec(void) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// The relay is the one reading the shared memory, it never publishes any
+bool shm_reader_active(void) {
+	return false;
+}
+
+void shm_publish_frame(const capture_frame_t *frame) {
+}
+
+// The windows are put back together in relay_frame, with the same layout as the plugin's capture, and each finished
+// frame is copied to relay_published for the network thread to pick up. Whatever the network thread picked up last
+// stays in relay_acquired until it asks for another, since it is still compressing and sending from it.
+static std::mutex relay_mutex;
+static capture_frame_t relay_frame;
+static capture_frame_t relay_published;
+static capture_frame_t relay_acquired;
+static bool relay_fresh = false;
+static bool relay_network_started = false;
+static network_header_t relay_header; // Last header from the plugin, the network thread gets a copy of it
+
+const capture_frame_t *capture_acquire_frame(void) {
+	std::lock_guard<std::mutex> lock(relay_mutex);
+	if (!relay_fresh)
+		return NULL;
+	std::swap(relay_acquired, relay_published);
+	relay_fresh = false;
+	return &relay_acquired;
+}
+
+// Called with relay_mutex held
+static void relay_publish(void) {
+	relay_published = relay_frame;
+	relay_fresh = true;
+	network_wakeup();
+}
+
+// Take the window list from a plugin header, and bump the texture sequence so the network code sends it to the clients
+static bool relay_parse_header(const char *text) {
+	std::string lines(text, strnlen(text, TCP_INTRO_HEADER));
+	size_t pos = 0;
+	auto next_line = [&](std::string &line) {
+		size_t eol = lines.find('\n', pos);
+		if (eol == std::string::npos)
+			return false;
+		line = lines.substr(pos, eol - pos);
+		pos = eol + 1;
+		return true;
+	};
+	std::string version, aircraft, texture, line;
+	int width, height;
+	if (!next_line(version) || (version.compare(0, strlen(TCP_PROTOCOL_VERSION) + 1, TCP_PROTOCOL_VERSION " ") != 0) ||
+	    !next_line(aircraft) || !next_line(texture) || (sscanf(texture.c_str(), "%d %d", &width, &height) != 2)) {
+		log_printf("Relay: header from the plugin is not valid\n");
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(relay_mutex);
+	network_header_t &h = relay_header;
+	int count = 0;
+	while (next_line(line) && (line != "__EOF__") && (count < COCKPIT_MAX_WINDOWS)) {
+		int *lbrt = h.texture_lbrt[count];
+		if (sscanf(line.c_str(), "%255s %d %d %d %d", h.window_name[count], &lbrt[0], &lbrt[1], &lbrt[2], &lbrt[3]) == 5)
+			count++;
+	}
+	snprintf(h.aircraft_name, sizeof(h.aircraft_name), "%s", aircraft.c_str());
+	h.texture_width = width;
+	h.texture_height = height;
+	h.window_count = count;
+
+	// Lay the windows out one after the other, the same way the capture does
+	relay_frame.count = count;
+	size_t offset = 0;
+	for (int i = 0; i < count; i++) {
+		int l = h.texture_lbrt[i][0], b = h.texture_lbrt[i][1], r = h.texture_lbrt[i][2], t = h.texture_lbrt[i][3];
+		capture_window_t *win = &relay_frame.layout[i];
+		win->x = l;
+		win->y = height - t;
+		win->width = (r > l) ? r - l : 0;
+		win->height = (t > b) ? t - b : 0;
+		win->offset = offset;
+		offset += (size_t)win->width * win->height * 4;
+	}
+	relay_frame.pixels.assign(offset, 0);
+	relay_fresh = false;
+	relay_frame.texture_seq = ++h.texture_seq;
+	h.texture_id = 1;
+	network_publish_header(h);
+	log_printf("Relay: plugin is showing [%s] with %d windows\n", h.aircraft_name, count);
+	if (!relay_network_started) {
+		start_networking_thread();
+		relay_network_started = true;
+	}
+	return true;
+}
+
+// Copy a whole window into relay_frame, where the rows are bottom first. Called with relay_mutex held.
+static bool relay_apply_png(int id, const unsigned char *data, size_t size) {
+	if (id >= relay_frame.count)
+		return false;
+	const capture_window_t *win = &relay_frame.layout[id];
+	std::vector<unsigned char> rgba;
+	unsigned width, height;
+	if (lodepng::decode(rgba, width, height, data, size, LCT_RGBA, 8) || ((int)width != win->width) || ((int)height != win->height)) {
+		log_printf("Relay: could not decode window %d\n", id);
+		return false;
+	}
+	size_t stride = (size_t)width * 4;
+	for (unsigned y = 0; y < height; y++)
+		memcpy(&relay_frame.pixels[win->offset + (height - 1 - y) * stride], &rgba[y * stride], stride);
+	return true;
+}
+
+// Same again for a whole window sent as QOI. Called with relay_mutex held.
+static bool relay_apply_qoi(int id, const unsigned char *data, size_t size) {
+	if (id >= relay_frame.count)
+		return false;
+	const capture_window_t *win = &relay_frame.layout[id];
+	std::vector<unsigned char> rgba;
+	int width, height;
+	if (!xte_qoi_decode(data, size, rgba, width, height) || (width != win->width) || (height != win->height)) {
+		log_printf("Relay: could not decode window %d\n", id);
+		return false;
+	}
+	size_t stride = (size_t)width * 4;
+	for (int y = 0; y < height; y++)
+		memcpy(&relay_frame.pixels[win->offset + (height - 1 - y) * stride], &rgba[y * stride], stride);
+	return true;
+}
+
+// Changed tiles, in the format written by encode_window_delta(). Called with relay_mutex held.
+static bool relay_apply_tiles(int id, const unsigned char *data, size_t size, int tile, int count) {
+	if ((id >= relay_frame.count) || (size < (size_t)count * 4))
+		return false;
+	const capture_window_t *win = &relay_frame.layout[id];
+	std::vector<unsigned char> rgba;
+	unsigned width, height;
+	if (lodepng::decode(rgba, width, height, data + count * 4, size - count * 4, LCT_RGBA, 8) || ((int)width != tile) || ((int)height != tile * count)) {
+		log_printf("Relay: could not decode tiles for window %d\n", id);
+		return false;
+	}
+	for (int t = 0; t < count; t++) {
+		int x = (data[t * 4] + data[t * 4 + 1] * 256) * tile;
+		int y = (data[t * 4 + 2] + data[t * 4 + 3] * 256) * tile;
+		int pixels = (win->width - x < tile) ? win->width - x : tile;
+		for (int r = 0; (r < tile) && (y + r < win->height) && (pixels > 0); r++)
+			memcpy(&relay_frame.pixels[win->offset + ((size_t)(win->height - 1 - y - r) * win->width + x) * 4], &rgba[((size_t)t * tile + r) * tile * 4], pixels * 4);
+	}
+	return true;
+}
+
+// Blocking reads from the plugin, with a buffer so most of them do not need a system call
+struct relay_upstream_t {
+	int sock = -1;
+	unsigned char buffer[65536];
+	size_t start = 0, end = 0;
+};
+
+static bool relay_read(relay_upstream_t &up, void *out, size_t bytes) {
+	unsigned char *dest = (unsigned char *)out;
+	while (bytes > 0) {
+		if (up.start == up.end) {
+			ssize_t got = recv(up.sock, up.buffer, sizeof(up.buffer), 0);
+			if (got <= 0)
+				return false;
+			up.start = 0;
+			up.end = got;
+		}
+		size_t chunk = (bytes < up.end - up.start) ? bytes : up.end - up.start;
+		if (dest != NULL) {
+			memcpy(dest, up.buffer + up.start, chunk);
+			dest += chunk;
+		}
+		up.start += chunk;
+		bytes -= chunk;
+	}
+	return true;
+}
+
+static bool relay_read_varint(relay_upstream_t &up, uint64_t &value) {
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		unsigned char b;
+		if (!relay_read(up, &b, 1))
+			return false;
+		value |= (uint64_t)(b & 0x7F) << shift;
+		if (b < 0x80)
+			return true;
+	}
+	return false;
+}
+
+static uint64_t relay_varint(const unsigned char *&in, const unsigned char *end) {
+	uint64_t value = 0;
+	for (int shift = 0; (in < end) && (shift < 64); shift += 7) {
+		unsigned char b = *in++;
+		value |= (uint64_t)(b & 0x7F) << shift;
+		if (b < 0x80)
+			break;
+	}
+	return value;
+}
+
+// More of the current frame could already be on the way, so only hand it over once the plugin has stopped sending
+static bool relay_pending(relay_upstream_t &up) {
+	if (up.start != up.end)
+		return true;
+	struct pollfd p = { up.sock, POLLIN, 0 };
+	return poll(&p, 1, 0) > 0;
+}
+
+static void relay_command(relay_upstream_t &up, const char *command) {
+	std::string line = std::string(command) + "\n";
+	send(up.sock, line.data(), line.size(), 0);
+}
+
+static int relay_connect(const char *host, const char *port) {
+	struct addrinfo hints, *result = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &result) != 0)
+		return -1;
+	int sock = -1;
+	for (struct addrinfo *ai = result; (ai != NULL) && (sock < 0); ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if ((sock >= 0) && (connect(sock, ai->ai_addr, ai->ai_addrlen) != 0)) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	freeaddrinfo(result);
+	return sock;
+}
+
+// One connection to the plugin, returns when it closes. With shm the windows come from the shared memory instead,
+// so this only asks for the header and any changes to it.
+static void relay_upstream(const char *host, const char *port, bool shm, bool qoi) {
+	relay_upstream_t up;
+	up.sock = relay_connect(host, port);
+	if (up.sock < 0)
+		return;
+	log_printf("Relay: connected to the plugin at %s port %s\n", host, port);
+	char header[TCP_INTRO_HEADER];
+	if (!relay_read(up, header, sizeof(header)) || !relay_parse_header(header)) {
+		close(up.sock);
+		return;
+	}
+	relay_command(up, TCP_HEADERS_COMMAND);
+	if (shm) {
+		relay_command(up, "SUBSCRIBE");
+	} else {
+		relay_command(up, "PROTOCOL " TCP_V4_DELTA_PROTOCOL);
+		if (qoi)
+			relay_command(up, "CODECS PNG TILES QOI");
+		relay_command(up, "SUBSCRIBE ALL");
+	}
+
+	// Records start in the XTEv3 framing, until the plugin switches to XTEv4
+	bool v4 = false;
+	std::vector<unsigned char> record;
+	while (true) {
+		int id = -1, codec = -1, tile = 0, tiles = 0;
+		uint64_t sequence = 0, capture_usec = 0;
+		const unsigned char *data, *end;
+		if (!v4) {
+			unsigned char h[16];
+			if (!relay_read(up, h, sizeof(h)))
+				break;
+			size_t length = h[8] | (h[9] << 8) | (h[10] << 16) | ((size_t)h[11] << 24);
+			record.resize(length);
+			if (!relay_read(up, record.data(), length) || !relay_read(up, NULL, 1024 - length % 1024))
+				break;
+			id = h[6];
+			if (!memcmp(h + 1, TCP_V4_PROTOCOL, 5)) {
+				v4 = true;
+				continue;
+			} else if (!memcmp(h + 1, "HEADR", 5)) {
+				codec = XTEV4_CODEC_HEADER;
+			} else if (!memcmp(h + 1, "DELTA", 5)) {
+				codec = XTEV4_CODEC_TILES;
+				tile = h[12] | (h[13] << 8);
+				tiles = h[14] | (h[15] << 8);
+			} else if (!memcmp(h + 1, "_____", 5)) {
+				codec = XTEV4_CODEC_PNG;
+			}
+			data = record.data();
+			end = data + record.size();
+			sequence = relay_frame.sequence + 1;
+			capture_usec = capture_time_usec();
+		} else {
+			uint64_t length;
+			if (!relay_read_varint(up, length) || (length < 2) || (length > 256 * 1024 * 1024))
+				break;
+			record.resize(length);
+			if (!relay_read(up, record.data(), length))
+				break;
+			data = record.data();
+			end = data + record.size();
+			id = *data++;
+			codec = *data++;
+			sequence = relay_varint(data, end);
+			capture_usec = relay_varint(data, end);
+			if (codec == XTEV4_CODEC_TILES) {
+				tile = (int)relay_varint(data, end);
+				tiles = (int)relay_varint(data, end);
+			}
+		}
+
+		if (codec == XTEV4_CODEC_HEADER) {
+			// The aircraft changed, and every window starts again with a keyframe
+			std::string text((const char *)data, end - data);
+			text.resize(TCP_INTRO_HEADER);
+			if (!relay_parse_header(text.c_str()))
+				break;
+			continue;
+		}
+		if (shm || (codec < 0))
+			continue;
+
+		std::lock_guard<std::mutex> lock(relay_mutex);
+		// Windows from the same capture arrive one after the other, so a new sequence number means the last one is done
+		if (relay_fresh && (sequence != relay_frame.sequence))
+			relay_publish();
+		relay_frame.sequence = (unsigned)sequence;
+		relay_frame.capture_usec = capture_usec;
+		if (codec == XTEV4_CODEC_PNG)
+			relay_apply_png(id, data, end - data);
+		else if (codec == XTEV4_CODEC_TILES)
+			relay_apply_tiles(id, data, end - data, tile, tiles);
+		else if (codec == XTEV4_CODEC_QOI)
+			relay_apply_qoi(id, data, end - data);
+		relay_fresh = true;
+		if (!relay_pending(up))
+			relay_publish();
+	}
+	log_printf("Relay: connection to the plugin closed\n");
+	close(up.sock);
+}
+
+// Copy each new frame out of the plugin's shared memory, flipping the windows to be bottom first like the capture
+static void relay_shm_thread(void) {
+	xte_shm_reader_t *reader = NULL;
+	xte_shm_frame_t frame;
+	while (true) {
+		if (reader == NULL) {
+			reader = xte_shm_open();
+			if (reader == NULL) {
+				std::this_thread::sleep_for(std::chrono::seconds(1));
+				continue;
+			}
+			log_printf("Relay: reading windows from shared memory\n");
+		}
+		int result = xte_shm_acquire(reader, &frame);
+		if (result < 0) {
+			log_printf("Relay: plugin has stopped publishing to shared memory\n");
+			xte_shm_close(reader);
+			reader = NULL;
+			continue;
+		}
+		if (result == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(relay_mutex);
+		bool match = (frame.count == relay_frame.count);
+		for (int i = 0; match && (i < frame.count); i++)
+			match = (frame.windows[i].width == relay_frame.layout[i].width) && (frame.windows[i].height == relay_frame.layout[i].height);
+		if (!match)
+			continue; // Windows changed, the new header is still on its way
+		for (int i = 0; i < frame.count; i++) {
+			const capture_window_t *win = &relay_frame.layout[i];
+			size_t stride = (size_t)win->width * 4;
+			for (int y = 0; y < win->height; y++)
+				memcpy(&relay_frame.pixels[win->offset + (win->height - 1 - y) * stride], frame.pixels[i] + y * stride, stride);
+		}
+		if (!xte_shm_still_valid(reader, &frame))
+			continue; // Overwritten while copying, the next one will be along shortly
+		relay_frame.sequence = frame.sequence;
+		relay_frame.capture_usec = frame.capture_usec;
+		relay_publish();
+	}
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: xte_relay [--shm] [--qoi] [--port=N] [--multicast=GROUP] [--latency_ms=N] [--encode_threads=N] [--send_backend=io_uring] [--png_preset=NAME] [--jpeg_quality=N] [--jpeg_subsampling=444] <plugin host>[:port]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	bool shm = false, qoi = false;
+	std::string host, port = TCP_PLUGIN_PORT;
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		std::string value = (arg.find('=') != std::string::npos) ? arg.substr(arg.find('=') + 1) : "";
+		if (arg == "--shm")
+			shm = true;
+		else if (arg == "--qoi")
+			qoi = true;
+		else if (arg.compare(0, 7, "--port=") == 0)
+			config_tcp_port = atoi(value.c_str());
+		else if (arg.compare(0, 12, "--multicast=") == 0)
+			snprintf(config_multicast_group, sizeof(config_multicast_group), "%s", value.c_str());
+		else if (arg.compare(0, 13, "--latency_ms=") == 0)
+			config_latency_msec = atoi(value.c_str());
+		else if (arg.compare(0, 17, "--encode_threads=") == 0)
+			config_encode_threads = atoi(value.c_str());
+		else if (arg == "--send_backend=io_uring")
+			config_send_backend = NETWORK_SEND_IO_URING;
+		else if ((arg.compare(0, 13, "--png_preset=") == 0) && (encode_png_preset_from_name(value.c_str()) >= 0))
+			config_png_preset = encode_png_preset_from_name(value.c_str());
+		else if (arg.compare(0, 15, "--jpeg_quality=") == 0)
+			config_jpeg_quality = atoi(value.c_str());
+		else if (arg == "--jpeg_subsampling=444")
+			config_jpeg_subsample = false;
+		else if (arg == "--jpeg_subsampling=420")
+			config_jpeg_subsample = true;
+		else if ((arg[0] != '-') && host.empty())
+			host = arg;
+		else
+			usage();
+	}
+	if (host.empty())
+		usage();
+	if (host.find(':') != std::string::npos) {
+		port = host.substr(host.find(':') + 1);
+		host = host.substr(0, host.find(':'));
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if (shm)
+		std::thread(relay_shm_thread).detach();
+	while (true) {
+		relay_upstream(host.c_str(), port.c_str(), shm, qoi);
+		// Clients keep their connections, and get the windows again once the plugin is back
+		{
+			std::lock_guard<std::mutex> lock(relay_mutex);
+			relay_header.texture_id = 0;
+			network_publish_header(relay_header);
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+}
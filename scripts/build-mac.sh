@@ -6,7 +6,7 @@ set -x
 clang++ -arch x86_64 -arch arm64 \
   -std=c++17 -fPIC -Wno-deprecated-declarations \
   -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DAPL -DGL_SILENCE_DEPRECATION \
-  -ISDK/CHeaders/XPLM XTextureExtractor.cpp XTextureExtractorNetwork.cpp lodepng/lodepng.cpp \
+  -ISDK/CHeaders/XPLM XTextureExtractor.cpp XTextureExtractorCapture.cpp XTextureExtractorEncode.cpp XTextureExtractorJpeg.cpp XTextureExtractorNetwork.cpp XTextureExtractorShm.cpp lodepng/lodepng.cpp \
   -shared -rdynamic \
   -framework OpenGL -FSDK/Libraries/Mac -framework XPLM -framework XPWidgets \
   -o Plugin-XTextureExtractor-x64-Release/64/mac.xpl
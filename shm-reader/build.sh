@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Builds the example shared memory reader, which only needs the files here and lodepng
+cd `dirname $0`
+set -x
+if [ "`uname`" == "Darwin" ]; then
+  clang++ -std=c++17 -O2 shm_dump_png.cpp xte_shm_reader.cpp ../lodepng/lodepng.cpp -o shm_dump_png
+else
+  g++ -O2 shm_dump_png.cpp xte_shm_reader.cpp ../lodepng/lodepng.cpp -lrt -lpthread -o shm_dump_png
+fi
@@ -0,0 +1,78 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Example shared memory reader, which waits for a frame from the plugin and saves each window as a PNG file
+// in the current directory. Build with build.sh, and turn on shared_memory in XTextureExtractor.cfg first.
+
+#include "xte_shm.h"
+#include "../lodepng/lodepng.h"
+#include <stdio.h>
+#include <thread>
+#include <chrono>
+
+int main(int argc, char **argv) {
+	xte_shm_reader_t *reader = NULL;
+	for (int wait = 0; (reader = xte_shm_open()) == NULL; wait++) {
+		if (wait == 0)
+			fprintf(stderr, "Waiting for X-Plane, make sure shared_memory is turned on in XTextureExtractor.cfg\n");
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+
+	// The plugin only starts capturing once it sees a reader, so the first frame can take a moment to arrive
+	xte_shm_frame_t frame;
+	std::vector<unsigned char> rgba;
+	while (true) {
+		int result = xte_shm_acquire(reader, &frame);
+		if (result < 0) {
+			fprintf(stderr, "X-Plane has stopped publishing frames\n");
+			xte_shm_close(reader);
+			return 1;
+		}
+		if (result == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		fprintf(stderr, "Frame %u from [%s] has %d windows\n", frame.sequence, frame.aircraft, frame.count);
+		bool saved = true;
+		for (int i = 0; (i < frame.count) && saved; i++) {
+			const xte_shm_window_t *win = &frame.windows[i];
+			if (!xte_shm_copy_window(reader, &frame, i, rgba)) {
+				saved = false; // Overwritten while copying, so grab a newer frame
+				break;
+			}
+			char filename[128];
+			snprintf(filename, sizeof(filename), "window-%d-%s.png", i, win->name);
+			unsigned error = lodepng::encode(filename, rgba, win->width, win->height);
+			if (error) {
+				fprintf(stderr, "Could not write %s: %s\n", filename, lodepng_error_text(error));
+				xte_shm_close(reader);
+				return 1;
+			}
+			fprintf(stderr, "Saved %s at %dx%d\n", filename, win->width, win->height);
+		}
+		if (saved)
+			break;
+	}
+	xte_shm_close(reader);
+	return 0;
+}
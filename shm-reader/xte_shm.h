@@ -0,0 +1,111 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Layout of the shared memory segment that XTextureExtractor publishes the raw windows into, and a small library
+// for reading it. This is shared by the plugin and the readers, so it must not depend on the X-Plane SDK.
+//
+// The segment has a header followed by XTE_SHM_SLOTS slots of pixels. The plugin writes each new frame into the
+// slot after the newest one, so a reader has about two frames to use a slot before it is overwritten. Each slot has
+// a seqlock which is odd while the plugin is writing it, and a reader checks it has not changed once it is done
+// with the pixels, otherwise it has to throw away what it read. The plugin only captures frames while somebody is
+// reading, which it tells from reader_usec, and since X-Plane can exit without removing the segment the readers
+// watch writer_usec. Windows are RGBA with the top row first and a stride of width*4.
+
+#ifndef XTE_SHM_H
+#define XTE_SHM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#define XTE_SHM_NAME        "XTextureExtractor" // /dev/shm/XTextureExtractor on Linux, Local\XTextureExtractor on Windows
+#define XTE_SHM_MAGIC       0x53455458 // "XTES"
+#define XTE_SHM_VERSION     1
+#define XTE_SHM_SLOTS       3
+#define XTE_SHM_MAX_WINDOWS 20
+#define XTE_SHM_SLOT_BYTES  ((uint64_t)4096 * 4096 * 4) // Room for a whole 4096x4096 texture, pages are only used once written
+#define XTE_SHM_READER_TIMEOUT_USEC 2000000 // Plugin stops capturing when no reader has looked for this long
+#define XTE_SHM_WRITER_TIMEOUT_USEC 5000000 // Readers give up when the plugin has not been seen for this long
+
+struct xte_shm_window_t {
+	char name[64];
+	int32_t width, height;
+	uint64_t offset;    // Byte offset of the first row from the start of the slot pixels
+};
+
+struct xte_shm_slot_t {
+	std::atomic<uint32_t> seqlock; // Odd while the plugin is writing the slot
+	uint32_t sequence;  // Frame sequence number, increments with every captured frame
+	uint64_t capture_usec; // Wall clock time the pixels were read back, in microseconds since 1970
+	int32_t texture_seq; // Changes when the aircraft or window layout changes
+	int32_t count;      // Number of windows
+	char aircraft[256];
+	xte_shm_window_t windows[XTE_SHM_MAX_WINDOWS];
+};
+
+struct xte_shm_header_t {
+	uint32_t magic;     // XTE_SHM_MAGIC while the plugin is publishing, 0 once it has stopped
+	uint32_t version;
+	uint64_t size;      // Bytes in the whole segment
+	uint64_t slot_offset[XTE_SHM_SLOTS]; // Where the pixels for each slot start, from the start of the segment
+	std::atomic<uint32_t> latest; // Slot with the newest frame, or XTE_SHM_SLOTS before the first one
+	uint32_t reserved;
+	std::atomic<uint64_t> reader_usec; // Readers store the time here whenever they look for a frame
+	std::atomic<uint64_t> writer_usec; // The plugin stores the time here at least once a second, even with no frames
+	xte_shm_slot_t slots[XTE_SHM_SLOTS];
+};
+
+#define XTE_SHM_HEADER_BYTES (((sizeof(xte_shm_header_t) + 65535) / 65536) * 65536) // Keeps the slots page aligned everywhere
+#define XTE_SHM_TOTAL_BYTES  (XTE_SHM_HEADER_BYTES + XTE_SHM_SLOTS * XTE_SHM_SLOT_BYTES)
+
+// One frame as seen by a reader, the pixels point straight into the shared memory
+struct xte_shm_frame_t {
+	uint32_t sequence;
+	uint64_t capture_usec;
+	int texture_seq;
+	int count;
+	char aircraft[256];
+	xte_shm_window_t windows[XTE_SHM_MAX_WINDOWS];
+	const unsigned char *pixels[XTE_SHM_MAX_WINDOWS];
+	int slot;
+	uint32_t seqlock;
+};
+
+struct xte_shm_reader_t;
+
+// Map the segment, returns NULL if the plugin is not running or does not have shared_memory turned on
+xte_shm_reader_t *xte_shm_open(void);
+void xte_shm_close(xte_shm_reader_t *reader);
+
+// Fill in frame with the newest frame, without copying any pixels. Returns 1 for a new frame, 0 if there is nothing
+// newer than the last one returned, or -1 if the plugin has gone away and the reader should be closed and reopened.
+int xte_shm_acquire(xte_shm_reader_t *reader, xte_shm_frame_t *frame);
+
+// True if the frame has not been overwritten since it was acquired. Call this after using the pixels, and throw
+// away anything worked out from them if it returns false.
+bool xte_shm_still_valid(xte_shm_reader_t *reader, const xte_shm_frame_t *frame);
+
+// Copy one window of the frame out of shared memory, returns false if it was overwritten while copying
+bool xte_shm_copy_window(xte_shm_reader_t *reader, const xte_shm_frame_t *frame, int i, std::vector<unsigned char> &rgba);
+
+#endif
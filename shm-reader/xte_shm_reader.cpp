@@ -0,0 +1,159 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+#include "xte_shm.h"
+#include <string.h>
+#include <chrono>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+struct xte_shm_reader_t {
+	xte_shm_header_t *header;
+	const unsigned char *base;
+	uint32_t last_sequence;
+	bool have_last;
+#if defined(_WIN32)
+	HANDLE handle;
+#endif
+};
+
+static uint64_t xte_shm_now_usec(void) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+xte_shm_reader_t *xte_shm_open(void) {
+	void *mapped = NULL;
+#if defined(_WIN32)
+	HANDLE handle = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, "Local\\" XTE_SHM_NAME);
+	if (handle == NULL)
+		return NULL;
+	mapped = MapViewOfFile(handle, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+	if (mapped == NULL) {
+		CloseHandle(handle);
+		return NULL;
+	}
+#else
+	int fd = shm_open("/" XTE_SHM_NAME, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if ((fstat(fd, &st) != 0) || ((uint64_t)st.st_size < XTE_SHM_TOTAL_BYTES)) {
+		close(fd);
+		return NULL;
+	}
+	mapped = mmap(NULL, XTE_SHM_TOTAL_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return NULL;
+#endif
+	xte_shm_reader_t *reader = new xte_shm_reader_t;
+	reader->header = (xte_shm_header_t *)mapped;
+	reader->base = (const unsigned char *)mapped;
+	reader->have_last = false;
+#if defined(_WIN32)
+	reader->handle = handle;
+#endif
+	if ((reader->header->magic != XTE_SHM_MAGIC) || (reader->header->version != XTE_SHM_VERSION)) {
+		xte_shm_close(reader);
+		return NULL;
+	}
+	// Let the plugin know straight away that somebody wants frames
+	reader->header->reader_usec.store(xte_shm_now_usec(), std::memory_order_relaxed);
+	return reader;
+}
+
+void xte_shm_close(xte_shm_reader_t *reader) {
+	if (reader == NULL)
+		return;
+#if defined(_WIN32)
+	UnmapViewOfFile(reader->header);
+	CloseHandle(reader->handle);
+#else
+	munmap(reader->header, XTE_SHM_TOTAL_BYTES);
+#endif
+	delete reader;
+}
+
+int xte_shm_acquire(xte_shm_reader_t *reader, xte_shm_frame_t *frame) {
+	xte_shm_header_t *header = reader->header;
+	uint64_t now = xte_shm_now_usec();
+	header->reader_usec.store(now, std::memory_order_relaxed);
+	if (header->magic != XTE_SHM_MAGIC)
+		return -1;
+	uint64_t writer_usec = header->writer_usec.load(std::memory_order_relaxed);
+	if ((now > writer_usec) && (now - writer_usec > XTE_SHM_WRITER_TIMEOUT_USEC))
+		return -1;
+
+	// The plugin could be writing the newest slot right now, in which case try again since it will soon be done
+	for (int attempt = 0; attempt < 100; attempt++) {
+		uint32_t latest = header->latest.load(std::memory_order_acquire);
+		if (latest >= XTE_SHM_SLOTS)
+			return 0;
+		const xte_shm_slot_t *slot = &header->slots[latest];
+		uint32_t seqlock = slot->seqlock.load(std::memory_order_acquire);
+		if (seqlock & 1)
+			continue;
+		if (reader->have_last && (slot->sequence == reader->last_sequence))
+			return 0;
+
+		frame->sequence = slot->sequence;
+		frame->capture_usec = slot->capture_usec;
+		frame->texture_seq = slot->texture_seq;
+		frame->count = (slot->count < XTE_SHM_MAX_WINDOWS) ? slot->count : XTE_SHM_MAX_WINDOWS;
+		memcpy(frame->aircraft, slot->aircraft, sizeof(frame->aircraft));
+		frame->aircraft[sizeof(frame->aircraft) - 1] = '\0';
+		memcpy(frame->windows, slot->windows, sizeof(frame->windows));
+		frame->slot = (int)latest;
+		frame->seqlock = seqlock;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot->seqlock.load(std::memory_order_relaxed) != seqlock)
+			continue;
+
+		const unsigned char *pixels = reader->base + header->slot_offset[latest];
+		for (int i = 0; i < frame->count; i++) {
+			frame->windows[i].name[sizeof(frame->windows[i].name) - 1] = '\0';
+			frame->pixels[i] = pixels + frame->windows[i].offset;
+		}
+		reader->last_sequence = frame->sequence;
+		reader->have_last = true;
+		return 1;
+	}
+	return 0;
+}
+
+bool xte_shm_still_valid(xte_shm_reader_t *reader, const xte_shm_frame_t *frame) {
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return reader->header->slots[frame->slot].seqlock.load(std::memory_order_relaxed) == frame->seqlock;
+}
+
+bool xte_shm_copy_window(xte_shm_reader_t *reader, const xte_shm_frame_t *frame, int i, std::vector<unsigned char> &rgba) {
+	size_t bytes = (size_t)frame->windows[i].width * frame->windows[i].height * 4;
+	rgba.assign(frame->pixels[i], frame->pixels[i] + bytes);
+	return xte_shm_still_valid(reader, frame);
+}
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Builds the checks, which need the X-Plane SDK headers but not X-Plane. capture_test also needs Mesa's EGL and
+# OpenGL libraries, so it is only built on Linux.
+cd `dirname $0`
+set -x
+ENCODER="../XTextureExtractorEncode.cpp ../XTextureExtractorJpeg.cpp ../relay/xte_qoi.cpp ../lodepng/lodepng.cpp"
+if [ "`uname`" == "Darwin" ]; then
+  FLAGS="-std=c++17 -O2 -Wno-deprecated-declarations -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DAPL -DGL_SILENCE_DEPRECATION -I../SDK/CHeaders/XPLM"
+  clang++ $FLAGS delta_test.cpp $ENCODER -o delta_test
+  clang++ $FLAGS network_test.cpp $ENCODER -o network_test
+else
+  FLAGS="-std=c++17 -O2 -DXPLM301 -DXPLM300 -DXPLM210 -DXPLM200 -DLIN -I../SDK/CHeaders/XPLM"
+  g++ $FLAGS capture_test.cpp -lEGL -lGL -o capture_test
+  g++ $FLAGS delta_test.cpp $ENCODER -lpthread -o delta_test
+  g++ $FLAGS network_test.cpp $ENCODER -lpthread -o network_test
+fi
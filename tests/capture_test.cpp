@@ -0,0 +1,237 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Checks the window layout and the texture capture paths against a real OpenGL driver without X-Plane or a display,
+// using Mesa's software renderer through a surfaceless EGL context (Linux only). A texture is filled with a pattern
+// where every pixel says where it came from, then captured with the pixel pack buffer ring, without framebuffer
+// objects, and synchronously, and every window in the published frames is compared against the pattern.
+//
+// The capture code is included directly so the checks can get at its static functions and state.
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include "../XTextureExtractorCapture.cpp"
+
+// Everything the capture code expects from the rest of the plugin
+GLint cockpit_texture_id = 0;
+GLint cockpit_texture_width = 0;
+GLint cockpit_texture_height = 0;
+int cockpit_texture_seq = 1;
+int cockpit_window_limit = 0;
+char _g_window_name[COCKPIT_MAX_WINDOWS][256];
+int _g_texture_lbrt[COCKPIT_MAX_WINDOWS][4];
+int config_capture_mode = CAPTURE_MODE_PBO;
+std::atomic<int> network_client_count(1);
+
+void XPLMDebugString(const char *s) {
+	fputs(s, stdout);
+}
+
+void XPLMBindTexture2d(int inTextureNum, int inTextureUnit) {
+	glBindTexture(GL_TEXTURE_2D, inTextureNum);
+}
+
+void network_wakeup(void) {
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (false)
+
+#define TEST_WIDTH  300
+#define TEST_HEIGHT 200
+
+// Red and green are the x and y inside the texture in GL coordinates, blue is the high bits of both
+static void test_pixel(int x, int y, unsigned char *rgba) {
+	rgba[0] = (unsigned char)x;
+	rgba[1] = (unsigned char)y;
+	rgba[2] = (unsigned char)(((x >> 8) << 4) | (y >> 8));
+	rgba[3] = 255;
+}
+
+static bool test_open_gl(void) {
+	EGLDisplay display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if ((display == EGL_NO_DISPLAY) || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+		printf("Could not open a surfaceless EGL display: 0x%x\n", eglGetError());
+		return false;
+	}
+	EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+	if ((context == EGL_NO_CONTEXT) || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		printf("Could not create an OpenGL context: 0x%x\n", eglGetError());
+		return false;
+	}
+	printf("Testing with %s, OpenGL %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+	return true;
+}
+
+static void test_layout(void) {
+	cockpit_texture_width = TEST_WIDTH;
+	cockpit_texture_height = TEST_HEIGHT;
+	cockpit_window_limit = 4;
+	// The .tex rectangles are left, bottom, right, top with row 0 at the top of the image
+	int lbrt[4][4] = {
+		{ 10, 20, 110, 70 },     // Inside the texture
+		{ -5, 150, 40, 250 },    // Hanging off the left and bottom of the image, which is the top in GL
+		{ 280, 0, 400, 200 },    // Hanging off the right
+		{ 50, 50, 40, 60 },      // Backwards, so empty
+	};
+	memcpy(_g_texture_lbrt, lbrt, sizeof(lbrt));
+	capture_window_t layout[COCKPIT_MAX_WINDOWS];
+	size_t total = 0;
+	int count = capture_compute_layout(layout, &total);
+	CHECK(count == 4, "count %d", count);
+	int expect[4][4] = { // x, y, width, height
+		{ 10, TEST_HEIGHT - 70, 100, 50 },
+		{ 0, 0, 40, 50 },
+		{ 280, 0, 20, 200 },
+		{ 50, TEST_HEIGHT - 60, 0, 10 },
+	};
+	size_t offset = 0;
+	for (int i = 0; i < 4; i++) {
+		CHECK((layout[i].x == expect[i][0]) && (layout[i].y == expect[i][1]) && (layout[i].width == expect[i][2]) && (layout[i].height == expect[i][3]),
+			"window %d is %d,%d %dx%d", i, layout[i].x, layout[i].y, layout[i].width, layout[i].height);
+		CHECK(layout[i].offset == offset, "window %d offset %zu, expected %zu", i, layout[i].offset, offset);
+		offset += (size_t)expect[i][2] * expect[i][3] * 4;
+	}
+	CHECK(total == offset, "total %zu, expected %zu", total, offset);
+}
+
+// Every window in the frame has to match the pattern where it sits in the texture, bottom row first
+static void test_frame(const capture_frame_t *frame, const char *name) {
+	CHECK(frame != NULL, "%s: nothing was published", name);
+	if (frame == NULL)
+		return;
+	CHECK(frame->count == cockpit_window_limit, "%s: %d windows", name, frame->count);
+	CHECK(frame->texture_seq == cockpit_texture_seq, "%s: texture_seq %d", name, frame->texture_seq);
+	int wrong = 0;
+	for (int i = 0; i < frame->count; i++) {
+		const capture_window_t *win = &frame->layout[i];
+		for (int row = 0; row < win->height; row++)
+			for (int col = 0; col < win->width; col++) {
+				unsigned char expect[4];
+				test_pixel(win->x + col, win->y + row, expect);
+				if (memcmp(frame->pixels.data() + win->offset + ((size_t)row * win->width + col) * 4, expect, 4) != 0)
+					wrong++;
+			}
+	}
+	CHECK(wrong == 0, "%s: %d pixels are wrong", name, wrong);
+}
+
+// Run frames of the render loop until the ring publishes something, the driver is given a chance to finish in between
+static const capture_frame_t *test_capture_pbo(int *frames) {
+	for (*frames = 1; *frames <= 10; (*frames)++) {
+		capture_texture();
+		glFinish();
+		const capture_frame_t *frame = capture_acquire_frame();
+		if (frame != NULL)
+			return frame;
+	}
+	return NULL;
+}
+
+static void test_capture(void) {
+	std::vector<unsigned char> pattern((size_t)TEST_WIDTH * TEST_HEIGHT * 4);
+	for (int y = 0; y < TEST_HEIGHT; y++)
+		for (int x = 0; x < TEST_WIDTH; x++)
+			test_pixel(x, y, &pattern[((size_t)y * TEST_WIDTH + x) * 4]);
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, TEST_WIDTH, TEST_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, pattern.data());
+	cockpit_texture_id = texture;
+
+	capture_gl_init();
+	CHECK(capture_have_pbo, "no pixel pack buffers");
+	CHECK(capture_have_fbo, "no framebuffer objects");
+	CHECK(xte_glFenceSync != NULL, "no fences");
+
+	// Reading each window through the framebuffer into the ring
+	int frames = 0;
+	const capture_frame_t *frame = test_capture_pbo(&frames);
+	test_frame(frame, "pbo");
+	CHECK(capture_pbo[0].packed, "pbo: read the whole texture instead of the windows");
+	unsigned sequence = frame ? frame->sequence : 0;
+
+	// Once it is going, every frame publishes the readback from a frame or two before
+	for (int i = 0; i < 5; i++) {
+		frame = test_capture_pbo(&frames);
+		CHECK(frames == 1, "pbo: took %d frames to publish", frames);
+		CHECK(frame && (frame->sequence == sequence + 1), "pbo: sequence %u after %u", frame ? frame->sequence : 0, sequence);
+		sequence = frame ? frame->sequence : sequence;
+	}
+	test_frame(frame, "pbo repeated");
+
+	// A readback that finishes after the aircraft changed has to be dropped rather than published
+	capture_texture(); // Publishes what is already done and issues another readback
+	glFinish();
+	capture_acquire_frame();
+	cockpit_texture_seq++;
+	capture_texture();
+	CHECK(capture_acquire_frame() == NULL, "pbo: published a readback of the old aircraft");
+	frame = test_capture_pbo(&frames);
+	test_frame(frame, "pbo after the aircraft changed");
+
+	// Nobody listening, so nothing should be read back at all
+	network_client_count = 0;
+	for (int i = 0; i < 2 * CAPTURE_PBO_RING; i++) {
+		capture_texture();
+		glFinish();
+	}
+	capture_acquire_frame();
+	bool pending = false;
+	for (int i = 0; i < CAPTURE_PBO_RING; i++)
+		pending |= capture_pbo[i].pending;
+	CHECK(!pending, "pbo: still reading back with no clients");
+	network_client_count = 1;
+
+	// Without framebuffer objects the whole texture goes into the ring and the windows are picked out when it is mapped
+	capture_have_fbo = false;
+	frame = test_capture_pbo(&frames);
+	test_frame(frame, "pbo whole texture");
+	frame = test_capture_pbo(&frames);
+	test_frame(frame, "pbo whole texture repeated");
+	capture_have_fbo = true;
+
+	// The synchronous path, both ways
+	config_capture_mode = CAPTURE_MODE_SYNC;
+	capture_texture();
+	test_frame(capture_acquire_frame(), "sync");
+	capture_have_fbo = false;
+	capture_texture();
+	test_frame(capture_acquire_frame(), "sync whole texture");
+	capture_have_fbo = true;
+	config_capture_mode = CAPTURE_MODE_PBO;
+
+	GLenum error = glGetError();
+	CHECK(error == GL_NO_ERROR, "GL error 0x%x", error);
+}
+
+int main(int argc, char **argv) {
+	test_layout();
+	if (!test_open_gl())
+		return 1;
+	test_capture();
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
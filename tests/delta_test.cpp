@@ -0,0 +1,211 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Checks how the encoder decides what has changed. capture_hash_window() has to notice any change to a window, so
+// unchanged windows can be skipped. For the dirty tiles that encode_window_delta() sends to the delta clients, a window
+// that is not a whole number of tiles is changed in different places, and each delta is applied to a copy the way a
+// client would, which has to end up the same as the window every time.
+
+#include "../XTextureExtractor.h"
+#include "../lodepng/lodepng.h"
+
+// Everything the encoder expects from the rest of the plugin
+char _g_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_encode_threads = 1;
+int config_png_preset = PNG_PRESET_BALANCED;
+int config_jpeg_quality = JPEG_QUALITY_OFF;
+int config_jpeg_subsample = true;
+int config_window_count = 0;
+char config_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_window_png_preset[COCKPIT_MAX_WINDOWS];
+int config_window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+
+void XPLMDebugString(const char *s) {
+	fputs(s, stdout);
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (false)
+
+// Two tiles and a bit across, one and a bit down, so the right and bottom tiles are clipped
+#define TEST_WIDTH  (DELTA_TILE_SIZE * 2 + 22)
+#define TEST_HEIGHT (DELTA_TILE_SIZE + 36)
+
+// Pixel at x,y counted from the top left, which is stored bottom row first in the frame like a capture
+static unsigned char *test_pixel(capture_frame_t &frame, int x, int y) {
+	return frame.pixels.data() + ((size_t)(TEST_HEIGHT - 1 - y) * TEST_WIDTH + x) * 4;
+}
+
+// Apply a delta payload to a client's copy of the window, which is top row first, and return the tiles it had
+static std::vector<std::pair<int,int>> test_apply(std::vector<unsigned char> &client, const std::vector<unsigned char> &payload, int count) {
+	const int tile = DELTA_TILE_SIZE;
+	std::vector<std::pair<int,int>> tiles;
+	for (int t = 0; t < count; t++)
+		tiles.push_back(std::make_pair(payload[t * 4] | (payload[t * 4 + 1] << 8), payload[t * 4 + 2] | (payload[t * 4 + 3] << 8)));
+	unsigned char *image = NULL;
+	unsigned width = 0, height = 0;
+	unsigned error = lodepng_decode32(&image, &width, &height, payload.data() + count * 4, payload.size() - count * 4);
+	CHECK(!error, "tile PNG does not decode: %s", lodepng_error_text(error));
+	CHECK((width == (unsigned)tile) && (height == (unsigned)(tile * count)), "tile PNG is %ux%u for %d tiles", width, height, count);
+	if (error || (width != (unsigned)tile) || (height != (unsigned)(tile * count))) {
+		free(image);
+		return tiles;
+	}
+	for (int t = 0; t < count; t++) {
+		for (int r = 0; r < tile; r++)
+			for (int c = 0; c < tile; c++) {
+				int x = tiles[t].first * tile + c, y = tiles[t].second * tile + r;
+				const unsigned char *src = image + (((size_t)t * tile + r) * tile + c) * 4;
+				if ((x < TEST_WIDTH) && (y < TEST_HEIGHT))
+					memcpy(&client[((size_t)y * TEST_WIDTH + x) * 4], src, 4);
+				else
+					CHECK((src[0] | src[1] | src[2]) == 0, "tile %d,%d is not black past the edge at %d,%d", tiles[t].first, tiles[t].second, x, y);
+			}
+	}
+	free(image);
+	return tiles;
+}
+
+static bool test_same(capture_frame_t &frame, const std::vector<unsigned char> &client) {
+	for (int y = 0; y < TEST_HEIGHT; y++)
+		for (int x = 0; x < TEST_WIDTH; x++)
+			if (memcmp(test_pixel(frame, x, y), &client[((size_t)y * TEST_WIDTH + x) * 4], 3) != 0)
+				return false;
+	return true;
+}
+
+// Every bit of every pixel has to change the hash, including the ones after the last whole 32 bytes, and the same
+// pixels have to give the same hash wherever they are in the frame
+static void test_hash(void) {
+	capture_frame_t frame;
+	frame.count = 2;
+	frame.layout[0].width = frame.layout[1].width = 13;
+	frame.layout[0].height = frame.layout[1].height = 5;
+	size_t size = (size_t)13 * 5 * 4;
+	frame.layout[0].offset = 0;
+	frame.layout[1].offset = size;
+	frame.pixels.resize(size * 2);
+	for (size_t b = 0; b < size; b++)
+		frame.pixels[b] = frame.pixels[size + b] = (unsigned char)(b * 7);
+	uint64_t hash = capture_hash_window(&frame, 0);
+	CHECK(capture_hash_window(&frame, 1) == hash, "the same pixels at another offset hash differently");
+	int missed = 0;
+	for (size_t b = 0; b < size; b++)
+		for (int bit = 0; bit < 8; bit++) {
+			frame.pixels[size + b] ^= 1 << bit;
+			if (capture_hash_window(&frame, 1) == hash)
+				missed++;
+			frame.pixels[size + b] ^= 1 << bit;
+		}
+	CHECK(missed == 0, "%d single bit changes were missed", missed);
+
+	// Black windows of different sizes are still different
+	std::fill(frame.pixels.begin(), frame.pixels.end(), 0);
+	hash = capture_hash_window(&frame, 0);
+	frame.layout[1].height = 4;
+	CHECK(capture_hash_window(&frame, 1) != hash, "black windows of different sizes hash the same");
+}
+
+int main(int argc, char **argv) {
+	test_hash();
+
+	capture_frame_t frame;
+	frame.count = 1;
+	frame.layout[0].x = frame.layout[0].y = 0;
+	frame.layout[0].width = TEST_WIDTH;
+	frame.layout[0].height = TEST_HEIGHT;
+	frame.layout[0].offset = 0;
+	frame.pixels.resize((size_t)TEST_WIDTH * TEST_HEIGHT * 4);
+	for (int y = 0; y < TEST_HEIGHT; y++)
+		for (int x = 0; x < TEST_WIDTH; x++) {
+			unsigned char *p = test_pixel(frame, x, y);
+			p[0] = (unsigned char)(x * 3);
+			p[1] = (unsigned char)(y * 5);
+			p[2] = (unsigned char)((x / 7) ^ (y / 3));
+			p[3] = 255;
+		}
+
+	// The first time there is nothing to compare against, so the client is sent the whole window
+	std::vector<unsigned char> reference, payload;
+	int count = encode_window_delta(payload, &frame, 0, reference);
+	CHECK(count == -1, "no reference gave %d tiles", count);
+	CHECK(reference.size() == frame.pixels.size(), "reference is %zu bytes", reference.size());
+	std::vector<unsigned char> client((size_t)TEST_WIDTH * TEST_HEIGHT * 4);
+	for (int y = 0; y < TEST_HEIGHT; y++)
+		memcpy(&client[(size_t)y * TEST_WIDTH * 4], test_pixel(frame, 0, y), TEST_WIDTH * 4);
+
+	count = encode_window_delta(payload, &frame, 0, reference);
+	CHECK(count == 0, "unchanged window gave %d tiles", count);
+
+	// Single pixels in a full tile, in the clipped corner tile, and on the last column and row of tiles
+	struct {
+		int x, y;
+		int tx, ty;
+	} changes[] = {
+		{ 0, 0, 0, 0 },
+		{ TEST_WIDTH - 1, TEST_HEIGHT - 1, 2, 1 },
+		{ DELTA_TILE_SIZE * 2, 5, 2, 0 },
+		{ DELTA_TILE_SIZE - 1, DELTA_TILE_SIZE, 0, 1 },
+	};
+	for (auto &change : changes) {
+		test_pixel(frame, change.x, change.y)[1] ^= 0x80;
+		count = encode_window_delta(payload, &frame, 0, reference);
+		CHECK(count == 1, "pixel %d,%d gave %d tiles", change.x, change.y, count);
+		if (count == 1) {
+			auto tiles = test_apply(client, payload, count);
+			CHECK((tiles[0].first == change.tx) && (tiles[0].second == change.ty), "pixel %d,%d is in tile %d,%d not %d,%d",
+				change.x, change.y, tiles[0].first, tiles[0].second, change.tx, change.ty);
+			CHECK(test_same(frame, client), "client does not match after pixel %d,%d", change.x, change.y);
+		}
+	}
+
+	// Two tiles at once come out in order from the top left
+	test_pixel(frame, TEST_WIDTH - 1, 0)[0] ^= 0x80;
+	test_pixel(frame, 3, TEST_HEIGHT - 2)[2] ^= 0x80;
+	count = encode_window_delta(payload, &frame, 0, reference);
+	CHECK(count == 2, "two changes gave %d tiles", count);
+	if (count == 2) {
+		auto tiles = test_apply(client, payload, count);
+		CHECK((tiles[0] == std::make_pair(2, 0)) && (tiles[1] == std::make_pair(0, 1)), "tiles %d,%d and %d,%d", tiles[0].first, tiles[0].second, tiles[1].first, tiles[1].second);
+		CHECK(test_same(frame, client), "client does not match after two changes");
+	}
+
+	// Most of the window changing is sent whole again, and the reference still moves on so the next delta is right
+	for (int y = 0; y < TEST_HEIGHT; y++)
+		for (int x = 0; x < TEST_WIDTH; x++)
+			test_pixel(frame, x, y)[0] ^= 0x01;
+	count = encode_window_delta(payload, &frame, 0, reference);
+	CHECK(count == -1, "most of the window changing gave %d tiles", count);
+	CHECK(memcmp(reference.data(), frame.pixels.data(), reference.size()) == 0, "reference not updated for a whole window");
+	count = encode_window_delta(payload, &frame, 0, reference);
+	CHECK(count == 0, "unchanged window after a whole one gave %d tiles", count);
+
+	// A window that changed size cannot be compared with the old reference
+	frame.layout[0].height = TEST_HEIGHT - 1;
+	count = encode_window_delta(payload, &frame, 0, reference);
+	CHECK(count == -1, "resized window gave %d tiles", count);
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
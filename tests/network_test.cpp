@@ -0,0 +1,477 @@
+// ---------------------------------------------------------------------
+//
+// XTextureExtractor
+//
+// Copyright (C) 2018-2022 Wayne Piekarski
+// wayne@tinmith.net http://tinmith.net/wayne
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ---------------------------------------------------------------------
+
+
+// Checks the parts of the network code that do not need X-Plane or a real client: the XTEv4 record framing, both on
+// its own and after going through a client's send queue and out of a socket, and putting multicast records back
+// together from their datagrams when some are lost, and the maths behind each client's rate control.
+//
+// The network code is included directly rather than linked, since the client and record structures are private
+// to it. Linux and Mac only.
+
+#include "../XTextureExtractorNetwork.cpp"
+
+// Everything the network code expects from the rest of the plugin
+GLint cockpit_texture_id = 0;
+GLint cockpit_texture_width = 0;
+GLint cockpit_texture_height = 0;
+int cockpit_texture_seq = 0;
+char cockpit_aircraft_name[256] = "";
+char cockpit_aircraft_filename[256] = "";
+int cockpit_window_limit = 0;
+char _g_window_name[COCKPIT_MAX_WINDOWS][256];
+int _g_texture_lbrt[COCKPIT_MAX_WINDOWS][4];
+int config_capture_mode = CAPTURE_MODE_PBO;
+int config_encode_threads = 1;
+int config_keepalive_msec = NETWORK_KEEPALIVE_MSEC;
+int config_keyframe_msec = DELTA_KEYFRAME_MSEC;
+char config_multicast_group[64] = "";
+int config_multicast_port = MULTICAST_PORT;
+int config_multicast_parity = MULTICAST_PARITY;
+int config_shared_memory = false;
+int config_send_backend = NETWORK_SEND_SOCKET;
+int config_latency_msec = 0;
+int config_tcp_port = 0;
+int config_png_preset = PNG_PRESET_BALANCED;
+int config_jpeg_quality = JPEG_QUALITY_OFF;
+int config_jpeg_subsample = true;
+int config_window_count = 0;
+char config_window_name[COCKPIT_MAX_WINDOWS][256];
+int config_window_png_preset[COCKPIT_MAX_WINDOWS];
+int config_window_jpeg_quality[COCKPIT_MAX_WINDOWS];
+
+void XPLMDebugString(const char *s) {
+	fputs(s, stdout);
+}
+
+uint64_t capture_time_usec(void) {
+	return 1234567890123456ull; // Fixed so the stream records can be checked
+}
+
+const capture_frame_t *capture_acquire_frame(void) {
+	return NULL;
+}
+
+bool shm_reader_active(void) {
+	return false;
+}
+
+void shm_publish_frame(const capture_frame_t *frame) {
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (false)
+
+// Reads a varint the way a client does, returning false if it runs off the end
+static bool test_read_varint(const unsigned char *&in, const unsigned char *end, uint64_t &value) {
+	value = 0;
+	for (int shift = 0; (in < end) && (shift < 64); shift += 7) {
+		unsigned char b = *in++;
+		value |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static std::shared_ptr<std::vector<unsigned char>> test_payload(size_t size, unsigned char seed) {
+	auto payload = std::make_shared<std::vector<unsigned char>>(size);
+	for (size_t i = 0; i < size; i++)
+		(*payload)[i] = (unsigned char)(i * 31 + seed);
+	return payload;
+}
+
+// What a client should get out of an XTEv4 record
+struct test_v4_t {
+	int id, codec;
+	uint64_t sequence, usec;
+	uint64_t extra[2];
+	int extras;
+	std::shared_ptr<std::vector<unsigned char>> payload;
+};
+
+// Parse one XTEv4 record from the start of a buffer and compare it, returns the bytes it took up or 0 if it did not match
+static size_t test_parse_v4(const unsigned char *data, size_t size, const test_v4_t &expect) {
+	const unsigned char *in = data, *end = data + size;
+	uint64_t length = 0;
+	if (!test_read_varint(in, end, length) || (length > (uint64_t)(end - in))) {
+		CHECK(false, "record for window %d has a bad length", expect.id);
+		return 0;
+	}
+	end = in + length;
+	uint64_t sequence = 0, usec = 0, extra[2] = { 0, 0 };
+	bool ok = (end - in >= 2);
+	int id = ok ? *in++ : -1;
+	int codec = ok ? *in++ : -1;
+	ok = ok && test_read_varint(in, end, sequence) && test_read_varint(in, end, usec);
+	for (int e = 0; e < expect.extras; e++)
+		ok = ok && test_read_varint(in, end, extra[e]);
+	CHECK(ok, "record for window %d is cut short", expect.id);
+	CHECK((id == expect.id) && (codec == expect.codec), "record is window %d codec %d, expected %d codec %d", id, codec, expect.id, expect.codec);
+	CHECK((sequence == expect.sequence) && (usec == expect.usec), "record for window %d has frame %llu at %llu", expect.id, (unsigned long long)sequence, (unsigned long long)usec);
+	for (int e = 0; e < expect.extras; e++)
+		CHECK(extra[e] == expect.extra[e], "record for window %d has %llu for codec field %d, expected %llu", expect.id, (unsigned long long)extra[e], e, (unsigned long long)expect.extra[e]);
+	size_t data_size = ok ? end - in : 0;
+	CHECK(ok && (data_size == expect.payload->size()) && !memcmp(in, expect.payload->data(), data_size), "record for window %d has %zu bytes of the wrong data", expect.id, data_size);
+	return end - data;
+}
+
+// Flatten a record the way it goes out on the wire
+static std::vector<unsigned char> test_flatten(const network_record_t &record) {
+	std::vector<unsigned char> flat(record.header, record.header + record.header_size);
+	if (record.payload)
+		flat.insert(flat.end(), record.payload->begin(), record.payload->end());
+	flat.resize(flat.size() + record.padding, 0);
+	return flat;
+}
+
+static void test_varints(void) {
+	const uint64_t values[] = { 0, 1, 127, 128, 300, 16383, 16384, 0xFFFFFFFFull, 0x8000000000000000ull, ~0ull };
+	for (uint64_t value : values) {
+		unsigned char buffer[16];
+		unsigned char *end = write_varint(buffer, value);
+		int bits = 1;
+		while ((bits < 64) && (value >> bits))
+			bits++;
+		CHECK(end - buffer == (bits + 6) / 7, "%llu took %d bytes", (unsigned long long)value, (int)(end - buffer));
+		const unsigned char *in = buffer;
+		uint64_t decoded;
+		CHECK(test_read_varint(in, end, decoded) && (in == end) && (decoded == value), "%llu came back as %llu", (unsigned long long)value, (unsigned long long)decoded);
+	}
+}
+
+static void test_records(capture_frame_t &frame) {
+	// Each codec with its own fields, and payloads big enough to need 1, 2 and 3 byte lengths
+	test_v4_t expect[] = {
+		{ 0, XTEV4_CODEC_PNG, frame.sequence, frame.capture_usec, { 0, 0 }, 0, test_payload(100, 1) },
+		{ 1, XTEV4_CODEC_TILES, frame.sequence, frame.capture_usec, { DELTA_TILE_SIZE, 7 }, 2, test_payload(5000, 2) },
+		{ 2, XTEV4_CODEC_PNG_SCALED, frame.sequence, frame.capture_usec, { 640, 480 }, 2, test_payload(200000, 3) },
+		{ 2, XTEV4_CODEC_JPEG, frame.sequence, frame.capture_usec, { 640, 480 }, 2, test_payload(0, 4) },
+		{ XTEV4_STREAM_ID, XTEV4_CODEC_HEADER, 0, capture_time_usec(), { 0, 0 }, 0, test_payload(TCP_INTRO_HEADER, 5) },
+	};
+	for (auto &e : expect) {
+		network_record_t record;
+		make_record_v4(record, e.id, e.codec, (e.id == XTEV4_STREAM_ID) ? NULL : &frame, e.payload, (int)e.extra[1]);
+		CHECK(record.window == ((e.id == XTEV4_STREAM_ID) ? -1 : e.id), "window %d became record window %d", e.id, record.window);
+		CHECK(record.padding == 0, "window %d has %zu bytes of padding", e.id, record.padding);
+		std::vector<unsigned char> flat = test_flatten(record);
+		CHECK(record.size() == flat.size(), "window %d says %zu bytes but is %zu", e.id, record.size(), flat.size());
+		size_t used = test_parse_v4(flat.data(), flat.size(), e);
+		CHECK(used == flat.size(), "window %d used %zu of %zu bytes", e.id, used, flat.size());
+	}
+
+	// The XTEv3 records that come before the switch still have the 16 byte header and data padded to 1024 byte blocks,
+	// with a whole block of padding when it is already a multiple like the original plugin
+	for (size_t size : { (size_t)0, (size_t)1000, (size_t)1024, (size_t)3000 }) {
+		network_record_t record;
+		make_record(record, "IMAGE", 3, test_payload(size, 6), "PNG_");
+		CHECK((record.header_size == 16) && (record.padding == 1024 - size % 1024), "XTEv3 record of %zu bytes has a %zu byte header and %zu padding", size, record.header_size, record.padding);
+	}
+}
+
+// Records queued for a client come out of the socket one after the other, with the newest one for each window
+static void test_stream(capture_frame_t &frame) {
+	int socks[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+		CHECK(false, "socketpair failed: %d", errno);
+		return;
+	}
+	u_long non_block = 1;
+	ioctlsocket(socks[0], FIONBIO, &non_block);
+	network_client_t client;
+	client.sock = socks[0];
+	client.v4 = true;
+
+	test_v4_t stale = { 0, XTEV4_CODEC_PNG, frame.sequence - 1, frame.capture_usec, { 0, 0 }, 0, test_payload(150000, 7) };
+	test_v4_t expect[] = {
+		{ 0, XTEV4_CODEC_PNG, frame.sequence, frame.capture_usec, { 0, 0 }, 0, test_payload(300000, 8) },
+		{ 1, XTEV4_CODEC_PNG, frame.sequence, frame.capture_usec, { 0, 0 }, 0, test_payload(20, 9) },
+		{ XTEV4_STREAM_ID, XTEV4_CODEC_HEADER, 0, capture_time_usec(), { 0, 0 }, 0, test_payload(TCP_INTRO_HEADER, 10) },
+	};
+	network_record_t record;
+	make_record_v4(record, stale.id, stale.codec, &frame, stale.payload, 0);
+	network_queue_client(client, record);
+	for (auto &e : expect) {
+		make_record_v4(record, e.id, e.codec, (e.id == XTEV4_STREAM_ID) ? NULL : &frame, e.payload, 0);
+		network_queue_client(client, record);
+	}
+	CHECK(client.queue.size() == 3, "%zu records queued", client.queue.size());
+
+	// Keep sending as the other end reads, like poll() would
+	std::vector<unsigned char> received;
+	unsigned char buffer[65536];
+	for (int loops = 0; loops < 10000; loops++) {
+		CHECK(network_flush_client(client), "flush failed");
+		ssize_t bytes = recv(socks[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (bytes > 0)
+			received.insert(received.end(), buffer, buffer + bytes);
+		else if ((client.sending.size() == 0) && client.queue.empty())
+			break;
+	}
+	size_t offset = 0;
+	for (auto &e : expect) {
+		size_t used = test_parse_v4(received.data() + offset, received.size() - offset, e);
+		if (used == 0)
+			break;
+		offset += used;
+	}
+	CHECK(offset == received.size(), "parsed %zu of the %zu bytes received", offset, received.size());
+	closesocket(socks[0]);
+	closesocket(socks[1]);
+}
+
+// Take all the datagrams of one multicast record, lose the first data chunk of every parity group, and put the record
+// back together using the parity chunks like a receiver would. Returns the record, or nothing if it could not be done.
+static std::vector<unsigned char> test_reassemble(SOCKET receiver, uint32_t expect_id, int window, int parity) {
+	std::vector<std::vector<unsigned char>> chunks;
+	std::vector<bool> have;
+	uint32_t length = 0;
+	int data_chunks = -1;
+	unsigned char packet[65536];
+	while (true) {
+		ssize_t bytes = recv(receiver, packet, sizeof(packet), MSG_DONTWAIT);
+		if (bytes <= 0)
+			break;
+		CHECK((bytes > MULTICAST_HEADER) && (bytes <= MULTICAST_HEADER + MULTICAST_CHUNK_SIZE) && !memcmp(packet, "XTEM", 4), "bad datagram of %d bytes", (int)bytes);
+		uint32_t id = packet[4] | (packet[5] << 8) | (packet[6] << 16) | ((uint32_t)packet[7] << 24);
+		length = packet[8] | (packet[9] << 8) | (packet[10] << 16) | ((uint32_t)packet[11] << 24);
+		int index = packet[12] | (packet[13] << 8);
+		data_chunks = packet[14] | (packet[15] << 8);
+		CHECK((id == expect_id) && (packet[16] == window) && (packet[17] == parity) && !packet[18] && !packet[19],
+			"datagram is record %u window %d parity %d, expected %u window %d parity %d", id, packet[16], packet[17], expect_id, window, parity);
+		CHECK(data_chunks == (int)((length + MULTICAST_CHUNK_SIZE - 1) / MULTICAST_CHUNK_SIZE), "%d chunks for %u bytes", data_chunks, length);
+		if ((size_t)index >= chunks.size()) {
+			chunks.resize(index + 1);
+			have.resize(index + 1, false);
+		}
+		CHECK(!have[index], "chunk %d sent twice", index);
+		chunks[index].assign(packet + MULTICAST_HEADER, packet + bytes);
+		chunks[index].resize(MULTICAST_CHUNK_SIZE, 0);
+		have[index] = true;
+	}
+	if (data_chunks < 0) {
+		CHECK(false, "no datagrams for record %u", expect_id);
+		return std::vector<unsigned char>();
+	}
+	int groups = (parity == 0) ? 0 : (data_chunks + parity - 1) / parity;
+	CHECK((int)chunks.size() == data_chunks + groups, "%zu chunks for %d data chunks with parity %d", chunks.size(), data_chunks, parity);
+	for (int g = 0; g < groups; g++) {
+		int lost = g * parity;
+		unsigned char *rebuilt = chunks[lost].data();
+		memcpy(rebuilt, chunks[data_chunks + g].data(), MULTICAST_CHUNK_SIZE);
+		for (int c = lost + 1; (c < lost + parity) && (c < data_chunks); c++)
+			for (int b = 0; b < MULTICAST_CHUNK_SIZE; b++)
+				rebuilt[b] ^= chunks[c][b];
+	}
+	std::vector<unsigned char> record;
+	for (int c = 0; (c < data_chunks) && (c < (int)chunks.size()); c++)
+		record.insert(record.end(), chunks[c].begin(), chunks[c].end());
+	record.resize(length);
+	return record;
+}
+
+static void test_multicast(capture_frame_t &frame) {
+	// A UDP socket on loopback stands in for the group, so the datagrams can be read straight back
+	SOCKET receiver = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	int receive_buffer = 4 * 1024 * 1024;
+	setsockopt(receiver, SOL_SOCKET, SO_RCVBUF, (char *)&receive_buffer, sizeof(receive_buffer));
+	multicast_socket = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((bind(receiver, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (getsockname(receiver, (struct sockaddr *)&addr, &addr_len) != 0) ||
+		(connect(multicast_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0)) {
+		CHECK(false, "could not set up UDP on loopback: %d", errno);
+		return;
+	}
+
+	// Sizes that end part way through a chunk and exactly on one, groups that end early, and no parity at all
+	struct {
+		size_t size;
+		int parity;
+	} cases[] = {
+		{ 1, MULTICAST_PARITY },
+		{ 50000, MULTICAST_PARITY },
+		{ 7 * MULTICAST_CHUNK_SIZE - 20, 3 },
+		{ 100000, 1 },
+		{ 30000, 0 },
+	};
+	for (auto &c : cases) {
+		config_multicast_parity = c.parity;
+		network_record_t record;
+		make_record_v4(record, 4, XTEV4_CODEC_PNG, &frame, test_payload(c.size, 11), 0);
+		std::vector<unsigned char> flat = test_flatten(record);
+		CHECK(network_multicast_record(record), "multicast of %zu bytes failed", c.size);
+		std::vector<unsigned char> received = test_reassemble(receiver, multicast_record_id, 4, c.parity);
+		CHECK(received == flat, "record of %zu bytes with parity %d came back as %zu different bytes", c.size, c.parity, received.size());
+	}
+
+	// Too many chunks to number the parity chunks after the data ones is refused rather than wrapping the index
+	config_multicast_parity = 1;
+	network_record_t record;
+	make_record_v4(record, 4, XTEV4_CODEC_PNG, &frame, test_payload((size_t)0x8000 * MULTICAST_CHUNK_SIZE, 12), 0);
+	CHECK(!network_multicast_record(record), "record with %zu chunks and as many parity chunks was sent", record.size() / MULTICAST_CHUNK_SIZE + 1);
+	unsigned char packet[MULTICAST_HEADER + MULTICAST_CHUNK_SIZE];
+	CHECK(recv(receiver, packet, sizeof(packet), MSG_DONTWAIT) < 0, "part of a refused record was sent");
+	config_multicast_parity = MULTICAST_PARITY;
+
+	closesocket(multicast_socket);
+	multicast_socket = INVALID_SOCKET;
+	closesocket(receiver);
+}
+
+static bool test_near(double value, double expect) {
+	return (value > expect * 0.999) && (value < expect * 1.001);
+}
+
+// The rate control maths, on a socket that nothing is ever read from so the bytes left in it are known
+static void test_rate(capture_frame_t &frame) {
+	int socks[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+		CHECK(false, "socketpair failed: %d", errno);
+		return;
+	}
+	u_long non_block = 1;
+	ioctlsocket(socks[0], FIONBIO, &non_block);
+	config_latency_msec = 100;
+	auto now = std::chrono::steady_clock::now();
+	network_client_t client;
+	client.sock = socks[0];
+	client.v4 = true;
+	client.codecs |= 1u << XTEV4_CODEC_PNG_SCALED;
+	client.scale_changed = now;
+
+	// The first measurement only finds out what is in the socket, then the rate is what left it, smoothed
+	client.accepted = 250000;
+	network_measure_client(client, 0.25, now);
+	CHECK((client.rate == 0) && (client.socket_queued == 0), "first measurement gave a rate of %.0f with %d queued", client.rate, client.socket_queued);
+	client.accepted = 250000;
+	network_measure_client(client, 0.25, now);
+	CHECK(test_near(client.rate, 1000000), "rate %.0f, expected 1000000", client.rate);
+	client.accepted = 500000;
+	network_measure_client(client, 0.25, now);
+	CHECK(test_near(client.rate, 1300000), "rate %.0f, expected 1300000", client.rate);
+	// A socket that ran dry only shows what we gave it, so the rate stays where it was
+	client.accepted = 10000;
+	client.idle = true;
+	network_measure_client(client, 0.25, now);
+	CHECK(test_near(client.rate, 1300000), "idle client changed the rate to %.0f", client.rate);
+
+	// What the client needs is the full size bytes per frame at no more than NETWORK_TARGET_FPS
+	client.offered = 300000;
+	client.offered_frames = 10;
+	network_measure_client(client, 0.25, now);
+	CHECK(test_near(client.need, 30000.0 * NETWORK_TARGET_FPS), "need %.0f, expected %.0f", client.need, 30000.0 * NETWORK_TARGET_FPS);
+	CHECK(client.scale == 1, "scaled before it had settled");
+
+	// Once settled, a client that takes less than it needs goes to half size, then tries full size again later
+	client.rate = client.need / 2;
+	client.offered = 300000;
+	client.offered_frames = 5;
+	now += std::chrono::milliseconds(NETWORK_SCALE_SETTLE_MSEC);
+	network_measure_client(client, 0.25, now);
+	CHECK(client.scale == 2, "client taking half of what it needs was not scaled");
+	client.need_keyframe = 0;
+	client.offered = 75000;
+	client.offered_frames = 5;
+	now += std::chrono::milliseconds(NETWORK_SCALE_SETTLE_MSEC);
+	double need = client.need;
+	network_measure_client(client, 0.25, now);
+	CHECK(client.scale == 2, "half size client went back to full size before the probe time");
+	CHECK(test_near(client.need, need * 0.7 + 75000.0 / 5 * 4 * NETWORK_TARGET_FPS * 0.3), "half size need %.0f is not counted at full size", client.need);
+	now += std::chrono::milliseconds(NETWORK_SCALE_PROBE_MSEC);
+	network_measure_client(client, 0.25, now);
+	CHECK((client.scale == 1) && (client.need == 0) && (client.need_keyframe == ~0u), "probe left scale %d need %.0f keyframes %x", client.scale, client.need, client.need_keyframe);
+	// Clients that cannot stretch a smaller image back out are never scaled
+	client.codecs &= ~(1u << XTEV4_CODEC_PNG_SCALED);
+	client.rate = 1000;
+	client.offered = 300000;
+	client.offered_frames = 5;
+	now += std::chrono::milliseconds(NETWORK_SCALE_SETTLE_MSEC);
+	network_measure_client(client, 0.25, now);
+	CHECK(client.scale == 1, "client without PNG_SCALED was scaled");
+
+	// The socket is only given as much as the link can send within the latency target, but always at least one record
+	std::vector<network_record_t> records(4);
+	for (int i = 0; i < 4; i++)
+		make_record_v4(records[i], i, XTEV4_CODEC_PNG, &frame, test_payload(40000, (unsigned char)i), 0);
+	struct {
+		double rate;
+		int latency;
+		int expect;
+	} budgets[] = {
+		{ 1000000, 100, 3 },   // 100000 bytes, which the third record goes over
+		{ 1000000, 0, 4 },     // No latency target
+		{ 0, 100, 4 },         // Not measured yet
+		{ 1000, 100, 1 },      // NETWORK_MIN_BUDGET, which is less than one record
+		{ 10000000, 100, 4 },
+	};
+	for (auto &b : budgets) {
+		client.queue.clear();
+		client.sending = network_record_t();
+		for (auto &r : records)
+			network_queue_client(client, r);
+		client.rate = b.rate;
+		config_latency_msec = b.latency;
+		const network_record_t *pending[NETWORK_MAX_IOVEC / 3];
+		int count = network_client_pending(client, pending);
+		CHECK((count == b.expect) && !client.throttled, "rate %.0f latency %d gave %d records, expected %d", b.rate, b.latency, count, b.expect);
+	}
+
+	// Nothing more goes in once the socket already holds the budget, and the client is marked as held back
+	std::vector<unsigned char> filler(NETWORK_MIN_BUDGET + 1000);
+	CHECK(send(socks[0], (const char *)filler.data(), (int)filler.size(), SEND_FLAGS) == (ssize_t)filler.size(), "could not fill the socket");
+	client.rate = 1000;
+	config_latency_msec = 100;
+	const network_record_t *pending[NETWORK_MAX_IOVEC / 3];
+	int count = network_client_pending(client, pending);
+	CHECK((count == 0) && client.throttled, "full socket gave %d records, throttled %d", count, client.throttled);
+	config_latency_msec = 0;
+	count = network_client_pending(client, pending);
+	CHECK((count > 0) && !client.throttled, "full socket with no latency target gave %d records", count);
+
+	closesocket(socks[0]);
+	closesocket(socks[1]);
+}
+
+int main(int argc, char **argv) {
+	capture_frame_t frame;
+	frame.count = 3;
+	for (int i = 0; i < frame.count; i++) {
+		frame.layout[i].width = 640;
+		frame.layout[i].height = 480;
+	}
+	frame.sequence = 1000;
+	frame.capture_usec = 1700000000000000ull;
+
+	test_varints();
+	test_records(frame);
+	test_stream(frame);
+	test_multicast(frame);
+	test_rate(frame);
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# Builds and runs every check, and exits with an error if any of them failed
+cd `dirname $0`
+./build.sh || exit 1
+failed=0
+for check in capture_test delta_test network_test; do
+  if [ -x $check ]; then
+    echo "=== $check"
+    ./$check || failed=1
+  fi
+done
+exit $failed